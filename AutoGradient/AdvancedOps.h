@@ -2,6 +2,7 @@
 #define AUTOGRADIENT_ADVANCEDOPS_H
 
 #include <utility>
+#include <stdexcept>
 #include "Random.h"
 #include "BasicOps.h"
 
@@ -9,75 +10,221 @@
 // but commonly used, so I put them here for better performance
 
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
 	// dot(a, b) = sum(cwiseProduct(a, b))
+	// For a minibatch (one sample per column) this is the sum of the per-sample dot products
 	class DotOp : public Operator {
 		BINARY_OP(DotOp)
 		OVERRIDE_OUTPUT { return ValueType::Scalar; }
-		OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)).cwiseProduct(std::get<Matrix>(V(rhs))).sum(); }
-		OVERRIDE_DIFF {
+		OVERRIDE_FLOPS { return 2.0 * sizeOf(*inputs[0]); }
+		OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Matrix>(V(lhs)).cwiseProduct(std::get<Matrix>(V(rhs))).sum(); }
+		OVERRIDE_DIFF_INTO {
 			const Scalar vOutput = std::get<Scalar>(outputGrad);
-			return { std::get<Matrix>(V(rhs)) * vOutput, std::get<Matrix>(V(lhs)) * vOutput };
+			const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+			matrixOf(inputGrads[0], vRhs) = vRhs * vOutput;
+			matrixOf(inputGrads[1], vLhs) = vLhs * vOutput;
 		}
 	};
 	BINARY_OP_FUNC(dot, DotOp)
 
 	// softmax(a) = exp(a) / (sum(exp(a)) + EPSILON)
+	// Applied to every column independently, so a minibatch can be fed as one sample per column
 	class SoftmaxOp : public Operator {
 		const Scalar EPSILON = static_cast<Scalar>(1e-8);
 		UNARY_OP(SoftmaxOp)
 		OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL {
-			const Array &x = std::get<Matrix>(V(operand));
-			const Array &ex = (x - x.maxCoeff()).exp();
-			return ex / (ex.sum() + EPSILON);
-		}
-		OVERRIDE_DIFF {
-			const Array &x = std::get<Matrix>(V(operand));
-			const Array &ex = (x - x.maxCoeff()).exp();
-			const Array &r = ex.sum() - ex;
-			const Matrix &d = ex / ((ex + r).square() + EPSILON) * r;
-			return { d.cwiseProduct(std::get<Matrix>(outputGrad)) };
+		OVERRIDE_EVAL_INTO {
+			const Matrix &x = std::get<Matrix>(V(operand));
+			Matrix &ret = matrixOf(out, x);
+			for (auto j = 0; j < x.cols(); j++) {
+				auto ex = ret.col(j).array();
+				ex = (x.col(j).array() - x.col(j).maxCoeff()).exp();
+				ex /= ex.sum() + EPSILON;
+			}
+		}
+		// The Jacobian of a column is diag(p) - p * p^T, so the gradient is p * (g - dot(g, p))
+		OVERRIDE_DIFF_INTO {
+			const Matrix &p = std::get<Matrix>(env->output());
+			const Matrix &vOutput = std::get<Matrix>(outputGrad);
+			Matrix &ret = matrixOf(inputGrads[0], p);
+			for (auto j = 0; j < p.cols(); j++)
+				ret.col(j) = p.col(j).cwiseProduct(vOutput.col(j)) - p.col(j) * vOutput.col(j).dot(p.col(j));
 		}
 	};
 	UNARY_OP_FUNC(softmax, SoftmaxOp)
 	
 	// crossEntropy(a, b) = -dot(y, log(yHat)) - dot(1 - y, log(1 - yHat))
+	// Like dot, summed over all the samples of a minibatch
 	class CrossEntropyOp : public Operator {
 		const Scalar EPSILON = static_cast<Scalar>(1e-8);
 		BINARY_OP(CrossEntropyOp)
 		OVERRIDE_OUTPUT { return ValueType::Scalar; }
-		OVERRIDE_EVAL{
-			const Array &yHat = std::get<Matrix>(V(lhs));
-			const Array &y = std::get<Matrix>(V(rhs));
-			return -(y * (yHat + EPSILON).log()).sum() - ((1 - y) * (1 + EPSILON - yHat).log()).sum();
+		OVERRIDE_EVAL_INTO {
+			const auto yHat = std::get<Matrix>(V(lhs)).array();
+			const auto y = std::get<Matrix>(V(rhs)).array();
+			scalarOf(out) = -(y * (yHat + EPSILON).log()).sum() - ((1 - y) * (1 + EPSILON - yHat).log()).sum();
 		}
-		OVERRIDE_DIFF{
+		OVERRIDE_DIFF_INTO {
 			const Scalar vOutput = std::get<Scalar>(outputGrad);
-			const Array &yHat = std::get<Matrix>(V(lhs));
-			const Array &y = std::get<Matrix>(V(rhs));
-			return { ((1 - y) / (1 + EPSILON - yHat) - y / (yHat + EPSILON)) * vOutput,
-					 vOutput * y * ((1 + EPSILON - yHat).log() - (yHat + EPSILON).log()) };
+			const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+			const auto yHat = vLhs.array();
+			const auto y = vRhs.array();
+			matrixOf(inputGrads[0], vLhs).array() = ((1 - y) / (1 + EPSILON - yHat) - y / (yHat + EPSILON)) * vOutput;
+			matrixOf(inputGrads[1], vRhs).array() = vOutput * y * ((1 + EPSILON - yHat).log() - (yHat + EPSILON).log());
 		}
 	};
 	BINARY_OP_FUNC_WITH_PARAM(crossEntropy, CrossEntropyOp, yHat, y)
 
-	class DropoutOp : public Operator, public std::enable_shared_from_this<DropoutOp> {
+	// softmaxCrossEntropy(z, y) = sum over the columns of log(sum(exp(z))) * sum(y) - dot(y, z), the cross-entropy of
+	// softmax(z) computed from the logits z with log-sum-exp, so that it neither overflows nor takes the log of 0.
+	// y is either a distribution per column (e.g. one-hot) or a row holding the class index of every column, in
+	// which case no gradient flows into it. The gradient of z is sum(y) * softmax(z) - y.
+	// Scratch keeps softmax(z) and the log-sum-exp of every column
+	class SoftmaxCrossEntropyOp : public Operator {
+		BINARY_OP(SoftmaxCrossEntropyOp)
+		OVERRIDE_OUTPUT { return ValueType::Scalar; }
+		OVERRIDE_FLOPS { return 4.0 * sizeOf(*inputs[0]); }
+		static bool classIndices(const Matrix &z, const Matrix &y) { return y.rows() == 1 && z.rows() > 1; }
+		static Eigen::Index classOf(const Matrix &z, const Matrix &y, const Eigen::Index j) {
+			const auto c = static_cast<Eigen::Index>(y(0, j));
+			if (c < 0 || c >= z.rows() || static_cast<Scalar>(c) != y(0, j))
+				throw std::out_of_range("class index out of range");
+			return c;
+		}
+		OVERRIDE_EVAL_INTO {
+			const Matrix &z = std::get<Matrix>(V(lhs)), &y = std::get<Matrix>(V(rhs));
+			const auto indices = classIndices(z, y);
+			if (y.cols() != z.cols() || (!indices && y.rows() != z.rows()))
+				throw std::invalid_argument("labels do not match the logits");
+			auto &scratch = env->scratch(2);
+			Matrix &p = matrixOf(scratch[0], z), &lse = matrixOf(scratch[1], 1, z.cols());
+			Scalar loss = 0;
+			for (auto j = 0; j < z.cols(); j++) {
+				const Scalar m = z.col(j).maxCoeff();
+				auto ex = p.col(j).array();
+				ex = (z.col(j).array() - m).exp();
+				const Scalar s = ex.sum();
+				ex /= s;
+				lse(0, j) = m + std::log(s);
+				if (indices)
+					loss += lse(0, j) - z(classOf(z, y, j), j);
+				else
+					loss += lse(0, j) * y.col(j).sum() - y.col(j).dot(z.col(j));
+			}
+			scalarOf(out) = loss;
+		}
+		OVERRIDE_DIFF_INTO {
+			const Scalar g = std::get<Scalar>(outputGrad);
+			const Matrix &z = std::get<Matrix>(V(lhs)), &y = std::get<Matrix>(V(rhs));
+			const auto &scratch = env->scratch(2);
+			const Matrix &p = std::get<Matrix>(scratch[0]), &lse = std::get<Matrix>(scratch[1]);
+			Matrix &gZ = matrixOf(inputGrads[0], z), &gY = matrixOf(inputGrads[1], y);
+			if (classIndices(z, y)) {
+				gZ = p * g;
+				for (auto j = 0; j < z.cols(); j++)
+					gZ(classOf(z, y, j), j) -= g;
+				gY.setZero();
+				return;
+			}
+			for (auto j = 0; j < z.cols(); j++) {
+				gZ.col(j) = (p.col(j) * y.col(j).sum() - y.col(j)) * g;
+				gY.col(j) = (lse(0, j) - z.col(j).array()).matrix() * g;
+			}
+		}
+	};
+	BINARY_OP_FUNC_WITH_PARAM(softmaxCrossEntropy, SoftmaxCrossEntropyOp, z, y)
+
+	// Lookup of the columns of table (one embedding per column) by index: ids holds k indices per sample (column),
+	// the output column j stacks the columns ids(0, j) ... ids(k - 1, j) of table. The gradient of table is
+	// SparseColumns, so a large table costs as much as the columns read, no gradient flows into ids
+	class EmbeddingOp : public Operator {
+		BINARY_OP(EmbeddingOp)
+		OVERRIDE_OUTPUT { return ValueType::Matrix; }
+		static Eigen::Index columnOf(const Matrix &table, const Matrix &ids, const Eigen::Index r, const Eigen::Index j) {
+			const auto c = static_cast<Eigen::Index>(ids(r, j));
+			if (c < 0 || c >= table.cols() || static_cast<Scalar>(c) != ids(r, j))
+				throw std::out_of_range("embedding index out of range");
+			return c;
+		}
+		OVERRIDE_EVAL_INTO {
+			const Matrix &table = std::get<Matrix>(V(lhs)), &ids = std::get<Matrix>(V(rhs));
+			const auto dim = table.rows();
+			Matrix &ret = matrixOf(out, dim * ids.rows(), ids.cols());
+			for (auto j = 0; j < ids.cols(); j++)
+				for (auto r = 0; r < ids.rows(); r++)
+					ret.col(j).segment(r * dim, dim) = table.col(columnOf(table, ids, r, j));
+		}
+		OVERRIDE_DIFF_INTO {
+			const Matrix &g = std::get<Matrix>(outputGrad);
+			const Matrix &table = std::get<Matrix>(V(lhs)), &ids = std::get<Matrix>(V(rhs));
+			const auto dim = table.rows();
+			auto &gTable = sparseColumnsOf(inputGrads[0]);
+			gTable.cols = table.cols();
+			gTable.indices.resize(static_cast<size_t>(ids.size()));
+			gTable.values.resize(dim, ids.size());
+			for (auto j = 0; j < ids.cols(); j++)
+				for (auto r = 0; r < ids.rows(); r++) {
+					const auto k = j * ids.rows() + r;
+					gTable.indices[static_cast<size_t>(k)] = columnOf(table, ids, r, j);
+					gTable.values.col(k) = g.col(j).segment(r * dim, dim);
+				}
+			matrixOf(inputGrads[1], ids).setZero();
+		}
+	};
+	BINARY_OP_FUNC_WITH_PARAM(embedding, EmbeddingOp, table, ids)
+
+	// Column j of x times mask(0, j), mask being a row with one weight per column. A 0/1 mask drops the padding
+	// of a batch of sequences of different lengths, see Recurrent.h
+	class MaskColumnsOp : public Operator {
+		BINARY_OP(MaskColumnsOp)
+		OVERRIDE_OUTPUT { return ValueType::Matrix; }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &x = std::get<Matrix>(V(lhs)), &mask = std::get<Matrix>(V(rhs));
+			if (mask.rows() != 1 || mask.cols() != x.cols())
+				throw std::invalid_argument("the mask does not match the columns");
+			matrixOf(out, x).noalias() = x * mask.row(0).asDiagonal();
+		}
+		OVERRIDE_DIFF_INTO {
+			const Matrix &g = std::get<Matrix>(outputGrad);
+			const Matrix &x = std::get<Matrix>(V(lhs)), &mask = std::get<Matrix>(V(rhs));
+			matrixOf(inputGrads[0], g).noalias() = g * mask.row(0).asDiagonal();
+			matrixOf(inputGrads[1], mask) = g.cwiseProduct(x).colwise().sum();
+		}
+	};
+	BINARY_OP_FUNC_WITH_PARAM(maskColumns, MaskColumnsOp, x, mask)
+
+	class DropoutOp : public Operator {
 		const Scalar EPSILON = std::numeric_limits<Scalar>::epsilon();
 		bool training;
 		OpPtr operand;
 		Scalar dropRate;
-		mutable std::mt19937_64 rng;
 	public:
 		DropoutOp(OpPtr x, Scalar dropRate, bool training = true)
-			: training(training), operand(std::move(x)), dropRate(dropRate), rng(seededRNG()) {}
+			: training(training), operand(std::move(x)), dropRate(dropRate) {}
 		void setTraining(const bool training) { this->training = training; }
+		void save(GraphWriter &out) const override {
+			out.write(dropRate);
+			out.write(training);
+		}
+		OpPtr inference() const override {
+			if (!training)
+				return nullptr;
+			return std::static_pointer_cast<Operator>(std::make_shared<DropoutOp>(operand, dropRate, false));
+		}
 		OVERRIDE_INPUTS { return { operand }; }
 		OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL {
-			if (!training)
-				return (1 - dropRate) * std::get<Matrix>(V(operand));
-			Matrix ret = std::get<Matrix>(V(operand));
-			const std::uniform_real_distribution<Scalar> dist;
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vOperand = std::get<Matrix>(V(operand));
+			Matrix &ret = matrixOf(out, vOperand);
+			if (!training) {
+				ret = (1 - dropRate) * vOperand;
+				return;
+			}
+			ret = vOperand;
+			// The random state belongs to the executor, so that executors sharing this op do not race
+			// and a seeded executor always drops the same nodes
+			auto &rng = env->rng();
+			std::uniform_real_distribution<Scalar> dist;
 			for (auto i = 0; i < ret.rows(); i++)
 				for (auto j = 0; j < ret.cols(); j++)
 					if (dist(rng) < dropRate)
@@ -89,21 +236,20 @@ namespace autograd {
 			// If a node is already 0, then dropping it by setting it to 0 again will not make any "difference",
 			// and therefore confuse the differentiator afterwards, so here we introduce a difference by setting
 			// it to EPSILON
-			return ret;
 		}
-		OVERRIDE_DIFF {
-			if (!training)
-				return { (1 - dropRate) * std::get<Matrix>(outputGrad) };
-			const OpPtr pThis = std::static_pointer_cast<Operator>(
-				std::const_pointer_cast<DropoutOp>(shared_from_this()));
-			const Matrix &vThis = std::get<Matrix>(V(pThis));
+		OVERRIDE_DIFF_INTO {
+			const Matrix &vOutput = std::get<Matrix>(outputGrad);
+			Matrix &ret = matrixOf(inputGrads[0], vOutput);
+			if (!training) {
+				ret = (1 - dropRate) * vOutput;
+				return;
+			}
+			const Matrix &vThis = std::get<Matrix>(env->output());
 			const Matrix& vOperand = std::get<Matrix>(V(operand));
-			Matrix ret = std::get<Matrix>(outputGrad);
 			// By comparing the last output and the last operand output we know which nodes were dropped
 			for (auto i = 0; i < ret.rows(); i++)
 				for (auto j = 0; j < ret.cols(); j++)
-					ret(i, j) = vOperand(i, j) == vThis(i, j) ? ret(i, j) : 0;
-			return { ret };
+					ret(i, j) = vOperand(i, j) == vThis(i, j) ? vOutput(i, j) : 0;
 		}
 	};
 	inline OpPtr dropout(OpPtr operand, Scalar dropRate, bool training = true) {
@@ -111,5 +257,6 @@ namespace autograd {
 			std::make_shared<DropoutOp>(std::move(operand), dropRate, training));
 	}
 }
+}
 
 #endif
\ No newline at end of file
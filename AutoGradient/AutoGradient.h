@@ -5,7 +5,15 @@
 #include "BasicOps.h"
 #include "AdvancedOps.h"
 #include "Functions.h"
+#include "ConvOps.h"
 #include "Optimizers.h"
+#include "Trainer.h"
+#include "Recurrent.h"
+#include "InferenceSession.h"
+#include "Dataset.h"
+#include "Checkpoint.h"
+#include "GraphIO.h"
+#include "Profiler.h"
 #include "InitUtils.h"
 
 #endif
\ No newline at end of file
@@ -7,11 +7,15 @@
 
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <type_traits>
 
 #include "Operator.h"
 #include "Executor.h"
+#include "GraphIO.h"
 
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
 
 // Abbreviations of some boilerplate code
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
@@ -24,6 +28,13 @@ namespace autograd {
 #define OVERRIDE_EVAL Value eval(std::shared_ptr<Executor> env) const override
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
 #define OVERRIDE_DIFF std::vector<Value> diff(std::shared_ptr<Executor> env, const Value &outputGrad) const override
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define OVERRIDE_EVAL_INTO void evalInto(std::shared_ptr<Executor> env, Value &out) const override
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define OVERRIDE_FLOPS double flops(const std::vector<const Value *> &inputs, const Value &output) const override
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define OVERRIDE_DIFF_INTO void diffInto(std::shared_ptr<Executor> env, const Value &outputGrad, \
+                                         std::vector<Value> &inputGrads) const override
 
 
 // Boilerplate code for binary operator
@@ -33,14 +44,16 @@ namespace autograd {
         OpPtr lhs, rhs; \
     public: \
         name(OpPtr lhs, OpPtr rhs) : lhs(std::move(lhs)), rhs(std::move(rhs)) {} \
-        OVERRIDE_INPUTS { return { lhs, rhs }; };
+        OVERRIDE_INPUTS { return { lhs, rhs }; }; \
+        bool pure() const override { return true; }
 // Boilerplate code for unary operator
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
 #define UNARY_OP(name) \
         OpPtr operand; \
     public: \
         explicit name(OpPtr operand) : operand(std::move(operand)) {} \
-        OVERRIDE_INPUTS { return { operand }; };
+        OVERRIDE_INPUTS { return { operand }; }; \
+        bool pure() const override { return true; }
 // Boilerplate code for input operator
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
 #define INPUT_OP(name, type, output) \
@@ -49,8 +62,9 @@ namespace autograd {
         explicit name(const type &value) : value(value) {} \
         OVERRIDE_INPUTS { return {}; }; \
         OVERRIDE_OUTPUT { return output; }; \
-        OVERRIDE_EVAL { return value; }; \
-        OVERRIDE_DIFF { return {}; };
+        OVERRIDE_EVAL_INTO { out = value; }; \
+        OVERRIDE_DIFF_INTO {}; \
+        void save(GraphWriter &out) const override { out.write(value); }
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
 #define UNARY_FUNC(name, input, opname) \
     inline OpPtr name(input value) { \
@@ -60,8 +74,8 @@ namespace autograd {
 #define UNARY_OP_FUNC(name, opname) UNARY_FUNC(name, OpPtr, opname)
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
 #define BINARY_OP_FUNC_OVERLOAD_WITH_PARAM(name, arg1, arg2) \
-    inline OpPtr name(Scalar arg1, OpPtr arg2) { return name(constant(arg1), std::move(arg2)); } \
-    inline OpPtr name(OpPtr arg1, Scalar arg2) { return name(std::move(arg1), constant(arg2)); } \
+    inline OpPtr name(Scalar arg1, OpPtr arg2) { return name(literal(arg1), std::move(arg2)); } \
+    inline OpPtr name(OpPtr arg1, Scalar arg2) { return name(std::move(arg1), literal(arg2)); } \
     inline OpPtr name(const Matrix &arg1, OpPtr arg2) { return name(constant(arg1), std::move(arg2)); } \
     inline OpPtr name(OpPtr arg1, const Matrix &arg2) { return name(std::move(arg1), constant(arg2)); }
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
@@ -83,139 +97,323 @@ namespace autograd {
     };
     UNARY_FUNC(constant, Scalar, ScalarConstOp)
 
+    // A scalar that cannot change, e.g. the 1 of 1 - y: the simplification pass of Executor merges equal ones and
+    // folds what reads only literals. Scalars given to the overloaded operators are literals, constant() makes
+    // one that can be set()
+    class ScalarLiteralOp : public Operator {
+	    INPUT_OP(ScalarLiteralOp, Scalar, ValueType::Scalar)
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override { return value == static_cast<const ScalarLiteralOp &>(other).value; }
+    };
+    UNARY_FUNC(literal, Scalar, ScalarLiteralOp)
+
     class MatrixConstOp : public Operator {
     	INPUT_OP(MatrixConstOp, Matrix, ValueType::Matrix)
 		void set(const Matrix &value) { this->value = value; }
     };
     UNARY_FUNC(constant, Matrix, MatrixConstOp)
 
+    // Only products read sparse matrices (see SparseDenseProductOp), their gradient has the pattern of the value
+    class SparseConstOp : public Operator {
+        INPUT_OP(SparseConstOp, SparseMatrix, ValueType::Sparse)
+        void set(const SparseMatrix &value) { this->value = value; }
+    };
+    UNARY_FUNC(constant, const SparseMatrix &, SparseConstOp)
+
+    // With MIXED_PRECISION, parameters are updated on their MasterScalar copy and the graph sees it rounded to Scalar
     class ScalarParamOp : public Operator {
         INPUT_OP(ScalarParamOp, Scalar, ValueType::Scalar)
         bool updatable() const override { return true; }
-        void update(const Value &delta) override { value += std::get<Scalar>(delta); }
+        void update(const Value &delta) override {
+            if constexpr (MIXED_PRECISION) {
+                master += std::get<Scalar>(delta);
+                value = static_cast<Scalar>(master);
+            } else
+                value += std::get<Scalar>(delta);
+        }
+        MasterScalar masterValue() const { return MIXED_PRECISION ? master : value; }
+        Parameters parameters() override { return { &value, MIXED_PRECISION ? &master : nullptr, 1 }; }
+    private:
+        MasterScalar master = value;
     };
     UNARY_FUNC(parameter, Scalar, ScalarParamOp)
 
     class MatrixParamOp : public Operator {
         INPUT_OP(MatrixParamOp, Matrix, ValueType::Matrix)
         bool updatable() const override { return true; }
-        void update(const Value &delta) override { value += std::get<Matrix>(delta); }
+        void update(const Value &delta) override {
+            if constexpr (MIXED_PRECISION) {
+                master += std::get<Matrix>(delta).cast<MasterScalar>();
+                value = master.cast<Scalar>();
+            } else
+                value += std::get<Matrix>(delta);
+        }
+        MasterMatrix masterValue() const {
+            if constexpr (MIXED_PRECISION)
+                return master;
+            else
+                return value;
+        }
+        Parameters parameters() override {
+            return { value.data(), MIXED_PRECISION ? master.data() : nullptr, static_cast<size_t>(value.size()),
+                     value.rows(), value.cols() };
+        }
+    private:
+        // Left empty unless MIXED_PRECISION
+        MasterMatrix master = MIXED_PRECISION ? value.template cast<MasterScalar>() : MasterMatrix();
     };
     UNARY_FUNC(parameter, Matrix, MatrixParamOp)
 
     class ScalarSumOp : public Operator {
         BINARY_OP(ScalarSumOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::get<Scalar>(V(lhs)) + std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF { return { outputGrad, outputGrad }; }
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Scalar>(V(lhs)) + std::get<Scalar>(V(rhs)); }
+        OVERRIDE_DIFF_INTO {
+            scalarOf(inputGrads[0]) = std::get<Scalar>(outputGrad);
+            scalarOf(inputGrads[1]) = std::get<Scalar>(outputGrad);
+        }
     };
 
     class ScalarDiffOp : public Operator {
         BINARY_OP(ScalarDiffOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::get<Scalar>(V(lhs)) - std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF { return { outputGrad, -std::get<Scalar>(outputGrad) }; }
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Scalar>(V(lhs)) - std::get<Scalar>(V(rhs)); }
+        OVERRIDE_DIFF_INTO {
+            scalarOf(inputGrads[0]) = std::get<Scalar>(outputGrad);
+            scalarOf(inputGrads[1]) = -std::get<Scalar>(outputGrad);
+        }
     };
 
     class ScalarProductOp : public Operator {
         BINARY_OP(ScalarProductOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::get<Scalar>(V(lhs)) * std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF {
-            return { std::get<Scalar>(V(rhs)) * std::get<Scalar>(outputGrad),
-                        std::get<Scalar>(V(lhs)) * std::get<Scalar>(outputGrad) };
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Scalar>(V(lhs)) * std::get<Scalar>(V(rhs)); }
+        OVERRIDE_DIFF_INTO {
+            scalarOf(inputGrads[0]) = std::get<Scalar>(V(rhs)) * std::get<Scalar>(outputGrad);
+            scalarOf(inputGrads[1]) = std::get<Scalar>(V(lhs)) * std::get<Scalar>(outputGrad);
         }
     };
 
     class ScalarQuotientOp : public Operator {
         BINARY_OP(ScalarQuotientOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::get<Scalar>(V(lhs)) / std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Scalar>(V(lhs)) / std::get<Scalar>(V(rhs)); }
+        OVERRIDE_DIFF_INTO {
             const Scalar vLhs = std::get<Scalar>(V(lhs)), vRhs = std::get<Scalar>(V(rhs));
             const Scalar vOutput = std::get<Scalar>(outputGrad);
-            return { vOutput / vRhs, vOutput * vLhs / (-vRhs * vRhs) };
+            scalarOf(inputGrads[0]) = vOutput / vRhs;
+            scalarOf(inputGrads[1]) = vOutput * vLhs / (-vRhs * vRhs);
         }
     };
 
+    // Matrices of the same shape are added coefficient-wise, a column vector on either side is
+    // broadcast over the columns of the other one, e.g. adding a bias to a minibatch w * x + b
     class MatrixSumOp : public Operator {
         BINARY_OP(MatrixSumOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)) + std::get<Matrix>(V(rhs)); }
-        OVERRIDE_DIFF { return { outputGrad, outputGrad }; }
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+            checkBroadcast(vLhs, vRhs);
+            if (vLhs.cols() == vRhs.cols())
+                matrixOf(out, vLhs) = vLhs + vRhs;
+            else if (vRhs.cols() == 1)
+                matrixOf(out, vLhs) = vLhs.colwise() + vRhs.col(0);
+            else
+                matrixOf(out, vRhs) = vRhs.colwise() + vLhs.col(0);
+        }
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+            reduceBroadcast(inputGrads[0], vLhs, vOutput);
+            reduceBroadcast(inputGrads[1], vRhs, vOutput);
+        }
+        // Throws unless both sides have the same shape, or the same rows and a single column on one side
+        static void checkBroadcast(const Matrix &a, const Matrix &b) {
+            if (a.rows() != b.rows() || (a.cols() != b.cols() && a.cols() != 1 && b.cols() != 1))
+                throw std::invalid_argument("matrices of different shapes, and neither is a column to broadcast");
+        }
+        // Gradient of an operand that may have been broadcast to the shape of the output
+        static void reduceBroadcast(Value &grad, const Matrix &operand, const Matrix &vOutput) {
+            if (operand.rows() != vOutput.rows() || (operand.cols() != vOutput.cols() && operand.cols() != 1))
+                throw std::invalid_argument("the gradient does not have the shape of the operand or of its broadcast");
+            if (operand.cols() == vOutput.cols())
+                matrixOf(grad, vOutput) = vOutput;
+            else
+                matrixOf(grad, operand).noalias() = vOutput.rowwise().sum();
+        }
     };
 
+    // Broadcasts like MatrixSumOp
     class MatrixDiffOp : public Operator {
         BINARY_OP(MatrixDiffOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)) - std::get<Matrix>(V(rhs)); }
-        OVERRIDE_DIFF { return { outputGrad, -std::get<Matrix>(outputGrad) }; }
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+            MatrixSumOp::checkBroadcast(vLhs, vRhs);
+            if (vLhs.cols() == vRhs.cols())
+                matrixOf(out, vLhs) = vLhs - vRhs;
+            else if (vRhs.cols() == 1)
+                matrixOf(out, vLhs) = vLhs.colwise() - vRhs.col(0);
+            else
+                matrixOf(out, vRhs) = (-vRhs).colwise() + vLhs.col(0);
+        }
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+            MatrixSumOp::reduceBroadcast(inputGrads[0], vLhs, vOutput);
+            MatrixSumOp::reduceBroadcast(inputGrads[1], vRhs, vOutput);
+            std::get<Matrix>(inputGrads[1]) *= -1;
+        }
     };
 
     class MatrixProductOp : public Operator {
         BINARY_OP(MatrixProductOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL{
-        	return std::get<Matrix>(V(lhs)) * std::get<Matrix>(V(rhs)); }
-        OVERRIDE_DIFF {
+        OVERRIDE_FLOPS { return 2.0 * std::get<Matrix>(*inputs[0]).cols() * sizeOf(output); }
+		OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+        	matrixOf(out, vLhs.rows(), vRhs.cols()).noalias() = vLhs * vRhs;
+        }
+        OVERRIDE_DIFF_INTO {
 	        const Matrix &vOutput = std::get<Matrix>(outputGrad);
-	        return { vOutput * std::get<Matrix>(V(rhs)).transpose(),
-                     std::get<Matrix>(V(lhs)).transpose() * vOutput };
+            const Matrix &vLhs = std::get<Matrix>(V(lhs)), &vRhs = std::get<Matrix>(V(rhs));
+	        matrixOf(inputGrads[0], vLhs).noalias() = vOutput * vRhs.transpose();
+            matrixOf(inputGrads[1], vRhs).noalias() = vLhs.transpose() * vOutput;
+        }
+    };
+
+    // Sparse lhs times dense rhs, in time and memory proportional to the nonzeros of lhs. The gradient of lhs
+    // is kept to its pattern: the coefficients that are zero are structural, e.g. the missing edges of a graph
+    class SparseDenseProductOp : public Operator {
+        BINARY_OP(SparseDenseProductOp)
+        OVERRIDE_OUTPUT { return ValueType::Matrix; }
+        OVERRIDE_FLOPS {
+            return 2.0 * static_cast<double>(sizeOf(*inputs[0])) * static_cast<double>(std::get<Matrix>(output).cols());
+        }
+        OVERRIDE_EVAL_INTO {
+            const SparseMatrix &vLhs = std::get<SparseMatrix>(V(lhs));
+            const Matrix &vRhs = std::get<Matrix>(V(rhs));
+            matrixOf(out, vLhs.rows(), vRhs.cols()).noalias() = vLhs * vRhs;
+        }
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            const SparseMatrix &vLhs = std::get<SparseMatrix>(V(lhs));
+            const Matrix &vRhs = std::get<Matrix>(V(rhs));
+            auto &gLhs = sparseOf(inputGrads[0], vLhs);
+            for (Eigen::Index i = 0; i < gLhs.outerSize(); i++)
+                for (SparseMatrix::InnerIterator it(gLhs, i); it; ++it)
+                    it.valueRef() = vOutput.row(i).dot(vRhs.row(it.col()));
+            matrixOf(inputGrads[1], vRhs).noalias() = vLhs.transpose() * vOutput;
+        }
+    };
+
+    // Dense lhs times sparse rhs, e.g. weights times a minibatch of bag-of-words columns. Same as
+    // SparseDenseProductOp otherwise
+    class DenseSparseProductOp : public Operator {
+        BINARY_OP(DenseSparseProductOp)
+        OVERRIDE_OUTPUT { return ValueType::Matrix; }
+        OVERRIDE_FLOPS {
+            return 2.0 * static_cast<double>(sizeOf(*inputs[1])) * static_cast<double>(std::get<Matrix>(output).rows());
+        }
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs));
+            const SparseMatrix &vRhs = std::get<SparseMatrix>(V(rhs));
+            matrixOf(out, vLhs.rows(), vRhs.cols()).noalias() = vLhs * vRhs;
+        }
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            const Matrix &vLhs = std::get<Matrix>(V(lhs));
+            const SparseMatrix &vRhs = std::get<SparseMatrix>(V(rhs));
+            matrixOf(inputGrads[0], vLhs).noalias() = vOutput * vRhs.transpose();
+            auto &gRhs = sparseOf(inputGrads[1], vRhs);
+            for (Eigen::Index k = 0; k < gRhs.outerSize(); k++)
+                for (SparseMatrix::InnerIterator it(gRhs, k); it; ++it)
+                    it.valueRef() = vLhs.col(k).dot(vOutput.col(it.col()));
         }
     };
 
     class MatrixScalarProductOp : public Operator {
         BINARY_OP(MatrixScalarProductOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return std::get<Scalar>(V(lhs)) * std::get<Matrix>(V(rhs)); }
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vRhs = std::get<Matrix>(V(rhs));
+            matrixOf(out, vRhs) = std::get<Scalar>(V(lhs)) * vRhs;
+        }
+        OVERRIDE_DIFF_INTO {
             const Matrix &vOutput = std::get<Matrix>(outputGrad);
-            return { vOutput.cwiseProduct(std::get<Matrix>(V(rhs))).sum(),
-                     std::get<Scalar>(V(lhs)) * vOutput };
+            scalarOf(inputGrads[0]) = vOutput.cwiseProduct(std::get<Matrix>(V(rhs))).sum();
+            matrixOf(inputGrads[1], vOutput) = std::get<Scalar>(V(lhs)) * vOutput;
         }
     };
 
     class MatrixScalarQuotientOp : public Operator {
         BINARY_OP(MatrixScalarQuotientOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)) / std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs));
+            matrixOf(out, vLhs) = vLhs / std::get<Scalar>(V(rhs));
+        }
+        OVERRIDE_DIFF_INTO {
             const Matrix &vOutput = std::get<Matrix>(outputGrad);
             const Scalar vRhs = std::get<Scalar>(V(rhs));
-            return { vOutput / vRhs,
-                     vOutput.cwiseProduct(std::get<Matrix>(V(lhs))).sum() / (-vRhs * vRhs) };
+            matrixOf(inputGrads[0], vOutput) = vOutput / vRhs;
+            scalarOf(inputGrads[1]) = vOutput.cwiseProduct(std::get<Matrix>(V(lhs))).sum() / (-vRhs * vRhs);
         }
     };
 
 	class MatrixScalarSumOp : public Operator {
 		BINARY_OP(MatrixScalarSumOp)
 		OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)).array() + std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF { return { outputGrad, std::get<Matrix>(outputGrad).sum() }; }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vLhs = std::get<Matrix>(V(lhs));
+			matrixOf(out, vLhs).array() = vLhs.array() + std::get<Scalar>(V(rhs));
+		}
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            matrixOf(inputGrads[0], vOutput) = vOutput;
+            scalarOf(inputGrads[1]) = vOutput.sum();
+        }
 	};
 
 	class MatrixScalarDiffOp : public Operator {
 		BINARY_OP(MatrixScalarDiffOp)
 		OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)).array() - std::get<Scalar>(V(rhs)); }
-        OVERRIDE_DIFF { return { outputGrad, -std::get<Matrix>(outputGrad).sum() }; }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vLhs = std::get<Matrix>(V(lhs));
+			matrixOf(out, vLhs).array() = vLhs.array() - std::get<Scalar>(V(rhs));
+		}
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            matrixOf(inputGrads[0], vOutput) = vOutput;
+            scalarOf(inputGrads[1]) = -vOutput.sum();
+        }
 	};
 
 	class ScalarMatrixDiffOp : public Operator {
 		BINARY_OP(ScalarMatrixDiffOp)
 		OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL { return std::get<Scalar>(V(lhs)) - std::get<Matrix>(V(rhs)).array(); }
-        OVERRIDE_DIFF { return { std::get<Matrix>(outputGrad).sum(), -std::get<Matrix>(outputGrad) }; }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vRhs = std::get<Matrix>(V(rhs));
+			matrixOf(out, vRhs).array() = std::get<Scalar>(V(lhs)) - vRhs.array();
+		}
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            scalarOf(inputGrads[0]) = vOutput.sum();
+            matrixOf(inputGrads[1], vOutput) = -vOutput;
+        }
 	};
 
     class MatrixCWiseProductOp : public Operator {
         BINARY_OP(MatrixCWiseProductOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)).cwiseProduct(std::get<Matrix>(V(rhs))); };
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs));
+            matrixOf(out, vLhs) = vLhs.cwiseProduct(std::get<Matrix>(V(rhs)));
+        }
+        OVERRIDE_DIFF_INTO {
             const Matrix &vOutput = std::get<Matrix>(outputGrad);
-            return { vOutput.cwiseProduct(std::get<Matrix>(V(rhs))),
-                     vOutput.cwiseProduct(std::get<Matrix>(V(lhs))) };
+            matrixOf(inputGrads[0], vOutput) = vOutput.cwiseProduct(std::get<Matrix>(V(rhs)));
+            matrixOf(inputGrads[1], vOutput) = vOutput.cwiseProduct(std::get<Matrix>(V(lhs)));
         }
     };
     BINARY_OP_FUNC(cwiseProduct, MatrixCWiseProductOp)
@@ -223,12 +421,16 @@ namespace autograd {
     class MatrixCWiseQuotientOp : public Operator {
         BINARY_OP(MatrixCWiseQuotientOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(lhs)).cwiseQuotient(std::get<Matrix>(V(rhs))); };
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vLhs = std::get<Matrix>(V(lhs));
+            matrixOf(out, vLhs) = vLhs.cwiseQuotient(std::get<Matrix>(V(rhs)));
+        }
+        OVERRIDE_DIFF_INTO {
             const Matrix &vOutput = std::get<Matrix>(outputGrad);
             const Matrix &vRhs = std::get<Matrix>(V(rhs));
-            return { vOutput.cwiseQuotient(vRhs),
-                     -vOutput.cwiseProduct(std::get<Matrix>(V(lhs))).cwiseQuotient(vRhs).cwiseQuotient(vRhs) };
+            matrixOf(inputGrads[0], vOutput) = vOutput.cwiseQuotient(vRhs);
+            matrixOf(inputGrads[1], vOutput) =
+                -vOutput.cwiseProduct(std::get<Matrix>(V(lhs))).cwiseQuotient(vRhs).cwiseQuotient(vRhs);
         }
     };
     BINARY_OP_FUNC(cwiseQuotient, MatrixCWiseQuotientOp)
@@ -236,13 +438,13 @@ namespace autograd {
     class ScalarPowOp : public Operator {
         BINARY_OP(ScalarPowOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::pow(std::get<Scalar>(V(lhs)), std::get<Scalar>(V(rhs))); };
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::pow(std::get<Scalar>(V(lhs)), std::get<Scalar>(V(rhs))); };
+        OVERRIDE_DIFF_INTO {
             const Scalar vLhs = std::get<Scalar>(V(lhs));
             const Scalar vRhs = std::get<Scalar>(V(rhs));
 			const Scalar vOutput = std::get<Scalar>(outputGrad);
-            return { vOutput * vRhs * std::pow(vLhs, vRhs - 1),
-            		 vOutput * std::log(vLhs) * std::pow(vLhs, vRhs) };
+            scalarOf(inputGrads[0]) = vOutput * vRhs * std::pow(vLhs, vRhs - 1);
+            scalarOf(inputGrads[1]) = vOutput * std::log(vLhs) * std::pow(vLhs, vRhs);
         }
     };
     BINARY_OP_FUNC(pow, ScalarPowOp)
@@ -250,25 +452,32 @@ namespace autograd {
     class ScalarNegOp : public Operator {
         UNARY_OP(ScalarNegOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return -std::get<Scalar>(V(operand)); }
-        OVERRIDE_DIFF { return { -std::get<Scalar>(outputGrad) }; }
+        OVERRIDE_EVAL_INTO { scalarOf(out) = -std::get<Scalar>(V(operand)); }
+        OVERRIDE_DIFF_INTO { scalarOf(inputGrads[0]) = -std::get<Scalar>(outputGrad); }
     };
 
     class MatrixNegOp : public Operator {
         UNARY_OP(MatrixNegOp)
         OVERRIDE_OUTPUT { return ValueType::Matrix; }
-        OVERRIDE_EVAL { return -std::get<Matrix>(V(operand)); }
-        OVERRIDE_DIFF { return { -std::get<Matrix>(outputGrad) }; }
+        OVERRIDE_EVAL_INTO {
+            const Matrix &vOperand = std::get<Matrix>(V(operand));
+            matrixOf(out, vOperand) = -vOperand;
+        }
+        OVERRIDE_DIFF_INTO {
+            const Matrix &vOutput = std::get<Matrix>(outputGrad);
+            matrixOf(inputGrads[0], vOutput) = -vOutput;
+        }
     };
 
     class MatrixCoefSumOp : public Operator {
         UNARY_OP(MatrixCoefSumOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(operand)).sum(); }
-        OVERRIDE_DIFF {
+        OVERRIDE_FLOPS { return static_cast<double>(sizeOf(*inputs[0])); }
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Matrix>(V(operand)).sum(); }
+        OVERRIDE_DIFF_INTO {
             const Matrix &vOperand = std::get<Matrix>(V(operand));
 			const Scalar vOutput = std::get<Scalar>(outputGrad);
-			return { vOutput * Matrix::Ones(vOperand.rows(), vOperand.cols()) };
+			matrixOf(inputGrads[0], vOperand).setConstant(vOutput);
         }
     };
 	UNARY_OP_FUNC(sum, MatrixCoefSumOp)
@@ -276,16 +485,15 @@ namespace autograd {
 	class MatrixMaxOp : public Operator {
 		UNARY_OP(MatrixMaxOp)
         OVERRIDE_OUTPUT { return ValueType::Scalar; }
-        OVERRIDE_EVAL { return std::get<Matrix>(V(operand)).maxCoeff(); }
-        OVERRIDE_DIFF {
+        OVERRIDE_EVAL_INTO { scalarOf(out) = std::get<Matrix>(V(operand)).maxCoeff(); }
+        OVERRIDE_DIFF_INTO {
             const Matrix &vOperand = std::get<Matrix>(V(operand));
 			const Scalar vOutput = std::get<Scalar>(outputGrad);
 			const Scalar max = vOperand.maxCoeff();
-			Matrix ret(vOperand.rows(), vOperand.cols());
+			Matrix &ret = matrixOf(inputGrads[0], vOperand);
 			for (auto i = 0; i < ret.rows(); i++)
 				for (auto j = 0; j < ret.cols(); j++)
 					ret(i, j) = vOperand(i, j) == max ? vOutput : 0;
-			return { ret };
         }
 	};
 	UNARY_OP_FUNC(max, MatrixMaxOp)
@@ -297,11 +505,24 @@ namespace autograd {
 	public:
 		FunctionApplyOp(OpPtr x, const F &f) : x(std::move(x)), f(f) {}
 		OVERRIDE_INPUTS { return { x }; }
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override { return &f == &static_cast<const FunctionApplyOp &>(other).f; }
+		void save(GraphWriter &out) const override { out.writeFunction(&f); }
 		OVERRIDE_OUTPUT { return ValueType::Scalar; }
-		OVERRIDE_EVAL { return f(std::get<Scalar>(V(x))); }
-		OVERRIDE_DIFF { return { std::get<Scalar>(outputGrad) * f.d(std::get<Scalar>(V(x))) }; }
+		OVERRIDE_EVAL_INTO { scalarOf(out) = f(std::get<Scalar>(V(x))); }
+		OVERRIDE_DIFF_INTO {
+			scalarOf(inputGrads[0]) = std::get<Scalar>(outputGrad) * f.d(std::get<Scalar>(V(x)));
+		}
 	};
 
+	// Detects the optional array kernels of a function object, see Functions.h
+	template <typename F, typename = void>
+	struct HasArrayKernels : std::false_type {};
+	template <typename F>
+	struct HasArrayKernels<F, std::void_t<decltype(std::declval<const F &>().forward(
+		std::declval<const Matrix &>(), std::declval<Matrix &>(), std::declval<Matrix &>()))>> : std::true_type {};
+
+	// Uses the array kernels of F if it has them, the scratch buffer of the executor keeps the cache they fill
 	template <typename F>
 	class FunctionBroadcastOp : public Operator {
 		OpPtr x;
@@ -309,30 +530,53 @@ namespace autograd {
 	public:
 		FunctionBroadcastOp(OpPtr x, const F &f) : x(std::move(x)), f(f) {}
 		OVERRIDE_INPUTS { return { x }; }
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override { return &f == &static_cast<const FunctionBroadcastOp &>(other).f; }
+		void save(GraphWriter &out) const override { out.writeFunction(&f); }
 		OVERRIDE_OUTPUT { return ValueType::Matrix; }
-		OVERRIDE_EVAL {
+		OVERRIDE_EVAL_INTO {
 			const Matrix &vx = std::get<Matrix>(V(x));
-			Matrix ret(vx.rows(), vx.cols());
-			for (auto i = 0; i < vx.rows(); i++)
-				for (auto j = 0; j < vx.cols(); j++)
-					ret(i, j) = f(vx(i, j));
-			return ret;
+			apply(f, vx, matrixOf(out, vx), cacheOf(env->scratch()));
 		}
-		OVERRIDE_DIFF{
+		OVERRIDE_DIFF_INTO {
 			const Matrix &vx = std::get<Matrix>(V(x));
-			Matrix ret(vx.rows(), vx.cols());
-			for (auto i = 0; i < vx.rows(); i++)
-				for (auto j = 0; j < vx.cols(); j++)
-					ret(i, j) = f.d(vx(i, j));
-			return { ret.cwiseProduct(std::get<Matrix>(outputGrad)) };
+			applyDiff(f, vx, std::get<Matrix>(env->output()), cacheOf(env->scratch()),
+			          std::get<Matrix>(outputGrad), matrixOf(inputGrads[0], vx));
+		}
+		// Defined in FusedOps.h, folds a dense layer feeding this op into a DenseOp
+		OpPtr fuse(const FusionContext &ctx) const override;
+		// The kernels, shared with the fused ops so that fusion does not change the results
+		// y = f(x), y must have the shape of x and may alias it
+		static void apply(const F &f, const Matrix &x, Matrix &y, Matrix &cache) {
+			if constexpr (HasArrayKernels<F>::value)
+				f.forward(x, y, cache);
+			else
+				for (auto i = 0; i < x.rows(); i++)
+					for (auto j = 0; j < x.cols(); j++)
+						y(i, j) = f(x(i, j));
+		}
+		// ret = f'(x) * grad, given y and cache from apply(). ret must have the shape of x and may alias x or grad
+		static void applyDiff(const F &f, const Matrix &x, const Matrix &y, const Matrix &cache,
+		                      const Matrix &grad, Matrix &ret) {
+			if constexpr (HasArrayKernels<F>::value)
+				f.backward(x, y, cache, grad, ret);
+			else
+				for (auto i = 0; i < x.rows(); i++)
+					for (auto j = 0; j < x.cols(); j++)
+						ret(i, j) = f.d(x(i, j)) * grad(i, j);
+		}
+		static Matrix &cacheOf(Value &v) {
+			if (!std::holds_alternative<Matrix>(v))
+				v.emplace<Matrix>();
+			return std::get<Matrix>(v);
 		}
 	};
 
     [[noreturn]] inline void unreachable() { throw std::invalid_argument("unreachable or unimplemented code"); }
 // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
 #define OVERLOAD_BINARY_OP(op) \
-    inline OpPtr operator op(Scalar a, OpPtr b) { return constant(a) op std::move(b); } \
-    inline OpPtr operator op(OpPtr a, Scalar b) { return std::move(a) op constant(b); } \
+    inline OpPtr operator op(Scalar a, OpPtr b) { return literal(a) op std::move(b); } \
+    inline OpPtr operator op(OpPtr a, Scalar b) { return std::move(a) op literal(b); } \
     inline OpPtr operator op(const Matrix &a, OpPtr b) { return constant(a) op std::move(b); } \
     inline OpPtr operator op(OpPtr a, const Matrix &b) { return std::move(a) op constant(b); }
 
@@ -374,9 +618,15 @@ namespace autograd {
             return std::static_pointer_cast<Operator>(std::make_shared<MatrixScalarProductOp>(std::move(b), std::move(a)));
         if (outA == ValueType::Matrix && outB == ValueType::Matrix)
             return std::static_pointer_cast<Operator>(std::make_shared<MatrixProductOp>(std::move(a), std::move(b)));
+        if (outA == ValueType::Sparse && outB == ValueType::Matrix)
+            return std::static_pointer_cast<Operator>(std::make_shared<SparseDenseProductOp>(std::move(a), std::move(b)));
+        if (outA == ValueType::Matrix && outB == ValueType::Sparse)
+            return std::static_pointer_cast<Operator>(std::make_shared<DenseSparseProductOp>(std::move(a), std::move(b)));
         unreachable();
     }
     OVERLOAD_BINARY_OP(*)
+    inline OpPtr operator *(const SparseMatrix &a, OpPtr b) { return constant(a) * std::move(b); }
+    inline OpPtr operator *(OpPtr a, const SparseMatrix &b) { return std::move(a) * constant(b); }
 
     inline OpPtr operator /(OpPtr a, OpPtr b) {
         const auto outA = a->outputType(), outB = b->outputType();
@@ -394,7 +644,8 @@ namespace autograd {
                 return std::static_pointer_cast<Operator>(std::make_shared<ScalarNegOp>(std::move(a)));
             case ValueType::Matrix:
                 return std::static_pointer_cast<Operator>(std::make_shared<MatrixNegOp>(std::move(a)));
-            case ValueType::Cube:
+            case ValueType::Tensor:
+            case ValueType::Sparse:
                 break;
         }
         unreachable();
@@ -406,10 +657,13 @@ namespace autograd {
 #undef OVERRIDE_OUTPUT
 #undef OVERRIDE_EVAL
 #undef OVERRIDE_DIFF
+#undef OVERRIDE_EVAL_INTO
+#undef OVERRIDE_DIFF_INTO
 #undef BINARY_OP
 #undef UNARY_OP
 #undef INPUT_OP
 #undef UNARY_OP_FUNC
 */
 }
+}
 #endif //AUTOGRADIENT_BASICOPS_H
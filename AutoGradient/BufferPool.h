@@ -0,0 +1,83 @@
+//
+// Free value buffers waiting to be reused, see ExecutorOptions::planMemory
+//
+
+#ifndef AUTOGRADIENT_BUFFERPOOL_H
+#define AUTOGRADIENT_BUFFERPOOL_H
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include "Value.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // Buffers are matched on their type and their number of coefficients: matrixOf() and tensorOf() reshape
+    // such a buffer without allocating. Scalars have no storage and are never pooled
+    class BufferPool {
+    public:
+        // (index of the alternative in Value, number of coefficients)
+        using Key = std::pair<size_t, Eigen::Index>;
+    private:
+        struct Bucket {
+            std::vector<Value> buffers;
+            // Fewest buffers the bucket held since the last trim(), that many were never asked for
+            size_t lowWater = 0;
+        };
+        std::map<Key, Bucket> buckets;
+        size_t pooledBytes = 0;
+    public:
+        static Key keyOf(const Value &v) {
+            if (std::holds_alternative<Matrix>(v))
+                return { v.index(), std::get<Matrix>(v).size() };
+            if (std::holds_alternative<Tensor>(v))
+                return { v.index(), std::get<Tensor>(v).size() };
+            if (std::holds_alternative<SparseColumns>(v))
+                return { v.index(), std::get<SparseColumns>(v).values.size() };
+            if (std::holds_alternative<SparseMatrix>(v))
+                return { v.index(), std::get<SparseMatrix>(v).nonZeros() };
+            return { v.index(), 0 };
+        }
+        static size_t bytesOf(const Key &key) { return static_cast<size_t>(key.second) * sizeof(Scalar); }
+        static size_t bytesOf(const Value &v) { return bytesOf(keyOf(v)); }
+
+        // Moves the storage of v into the pool, v is left empty
+        void give(Value &v) {
+            const auto key = keyOf(v);
+            if (key.second == 0)
+                return;
+            pooledBytes += bytesOf(v);
+            buckets[key].buffers.push_back(std::move(v));
+        }
+        // Moves a free buffer matching key into dst, dst keeps what it holds if there is none
+        void take(const Key &key, Value &dst) {
+            const auto it = buckets.find(key);
+            if (it == buckets.end() || it->second.buffers.empty())
+                return;
+            auto &bucket = it->second;
+            pooledBytes -= bytesOf(bucket.buffers.back());
+            dst = std::move(bucket.buffers.back());
+            bucket.buffers.pop_back();
+            bucket.lowWater = std::min(bucket.lowWater, bucket.buffers.size());
+        }
+        // Frees the buffers that stayed in the pool since the last call, so the pool shrinks to what one
+        // pass actually reuses. Called between passes
+        void trim() {
+            for (auto it = buckets.begin(); it != buckets.end(); ) {
+                auto &bucket = it->second;
+                for (; bucket.lowWater > 0; bucket.lowWater--) {
+                    pooledBytes -= bytesOf(bucket.buffers.back());
+                    bucket.buffers.pop_back();
+                }
+                bucket.lowWater = bucket.buffers.size();
+                it = bucket.buffers.empty() ? buckets.erase(it) : std::next(it);
+            }
+        }
+        size_t bytes() const { return pooledBytes; }
+    };
+}
+}
+
+#endif //AUTOGRADIENT_BUFFERPOOL_H
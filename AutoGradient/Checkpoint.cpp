@@ -0,0 +1,266 @@
+//
+// Checkpoints: parameters and optimizer state in a versioned binary file
+//
+
+#include "Checkpoint.h"
+#include "Dataset.h"
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <vector>
+#include <unordered_set>
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    const char MAGIC[4] = { 'A', 'G', 'C', 'K' };
+    // Written as is, a file from a machine of the other byte order is rejected
+    const uint32_t ENDIANNESS_MARK = 0x01020304;
+
+    enum class EntryType : uint32_t { Float32, Float64, UInt64 };
+
+    template <typename T>
+    EntryType entryTypeOf() {
+        if constexpr (is_same_v<T, float>)
+            return EntryType::Float32;
+        else if constexpr (is_same_v<T, double>)
+            return EntryType::Float64;
+        else
+            return EntryType::UInt64;
+    }
+
+    size_t sizeOf(const EntryType type) { return type == EntryType::Float32 ? 4 : 8; }
+
+    struct Header {
+        char magic[4];
+        uint32_t version, byteOrder, count;
+    };
+
+    // Followed by the name
+    struct EntryHeader {
+        uint32_t type, nameLength;
+        uint64_t rows, cols, offset;
+    };
+
+    struct Entry {
+        string name;
+        EntryType type;
+        uint64_t rows, cols;
+        const void *data;
+    };
+
+    uint64_t align(const uint64_t offset) {
+        return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+    }
+
+    // The updatable ops of the graph of executor, with their names. Positions follow a depth-first walk of the
+    // graph as built (inputs in order) from the result, they do not depend on how it was compiled (simplification,
+    // fusion, substitutes). The parameters that only the compiled plan reads come after, in the order of topoOrder()
+    vector<pair<OpPtr, string>> namedParameters(const Executor &executor, const ParameterNames &names) {
+        vector<OpPtr> ops, stack{ executor.result() };
+        unordered_set<const Operator *> visited;
+        while (!stack.empty()) {
+            const auto op = move(stack.back());
+            stack.pop_back();
+            if (!visited.insert(op.get()).second)
+                continue;
+            if (op->updatable())
+                ops.push_back(op);
+            const auto inputs = op->inputs();
+            stack.insert(stack.end(), inputs.rbegin(), inputs.rend());
+        }
+        for (const auto &op : executor.topoOrder())
+            if (op->updatable() && visited.insert(op.get()).second)
+                ops.push_back(op);
+        vector<pair<OpPtr, string>> ret;
+        for (const auto &op : ops) {
+            if (!op->parameters().value)
+                throw logic_error("checkpoints need the coefficients of every parameter, see Operator::parameters()");
+            const auto it = names.find(op);
+            ret.emplace_back(op, it != names.end() ? it->second : "param" + to_string(ret.size()));
+        }
+        return ret;
+    }
+
+    // Where the coefficients of every parameter of optimizer begin in its flat buffers
+    unordered_map<const Operator *, size_t> stateOffsets(const Optimizer *optimizer) {
+        unordered_map<const Operator *, size_t> ret;
+        if (optimizer)
+            for (const auto &param : optimizer->parameterList())
+                ret[param.op.get()] = param.offset;
+        return ret;
+    }
+
+    struct MappedEntry {
+        EntryType type;
+        uint64_t rows, cols;
+        const unsigned char *data;
+    };
+
+    // Copies the coefficients of entry into out, converting them if they were saved in another precision
+    template <typename T>
+    void read(const MappedEntry &entry, T *out, const size_t n) {
+        if (entry.type == entryTypeOf<T>()) {
+            memcpy(out, entry.data, n * sizeof(T));
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (entry.type == EntryType::Float32) {
+                float v;
+                memcpy(&v, entry.data + 4 * i, 4);
+                out[i] = static_cast<T>(v);
+            } else {
+                double v;
+                memcpy(&v, entry.data + 8 * i, 8);
+                out[i] = static_cast<T>(v);
+            }
+        }
+    }
+}
+
+void autograd::saveCheckpoint(const string &path, Executor &executor, const ParameterNames &names,
+                              const CheckpointCounters &counters) {
+    vector<Entry> entries;
+    const auto params = namedParameters(executor, names);
+    const auto optimizer = dynamic_cast<Optimizer *>(&executor);
+    const auto state = optimizer ? optimizer->state() : Optimizer::State();
+    const auto offsets = stateOffsets(optimizer);
+    for (const auto &[op, name] : params) {
+        const auto coefficients = op->parameters();
+        const auto rows = static_cast<uint64_t>(coefficients.rows), cols = static_cast<uint64_t>(coefficients.cols);
+        entries.push_back({ name, entryTypeOf<Scalar>(), rows, cols, coefficients.value });
+        if (coefficients.master)
+            entries.push_back({ name + "/master", entryTypeOf<MasterScalar>(), rows, cols, coefficients.master });
+        const auto it = offsets.find(op.get());
+        if (it != offsets.end())
+            for (const auto &[buffer, values] : state.buffers)
+                entries.push_back({ name + "/" + buffer, entryTypeOf<Scalar>(), rows, cols, values->data() + it->second });
+    }
+    for (const auto &[counter, value] : state.counters)
+        entries.push_back({ "optimizer/" + counter, EntryType::UInt64, 1, 1, value });
+    for (const auto &[counter, value] : counters)
+        entries.push_back({ "counter/" + counter, EntryType::UInt64, 1, 1, &value });
+
+    uint64_t offset = sizeof(Header);
+    for (const auto &entry : entries)
+        offset += sizeof(EntryHeader) + entry.name.size();
+    vector<uint64_t> entryOffsets;
+    for (const auto &entry : entries) {
+        offset = align(offset);
+        entryOffsets.push_back(offset);
+        offset += entry.rows * entry.cols * sizeOf(entry.type);
+    }
+    const auto temporary = path + ".tmp";
+    {
+        ofstream out(temporary, ios::binary | ios::trunc);
+        if (!out)
+            throw runtime_error("cannot write " + temporary);
+        Header header{};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = CHECKPOINT_VERSION;
+        header.byteOrder = ENDIANNESS_MARK;
+        header.count = static_cast<uint32_t>(entries.size());
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (size_t i = 0; i < entries.size(); i++) {
+            const auto &entry = entries[i];
+            const EntryHeader entryHeader{ static_cast<uint32_t>(entry.type), static_cast<uint32_t>(entry.name.size()),
+                                           entry.rows, entry.cols, entryOffsets[i] };
+            out.write(reinterpret_cast<const char *>(&entryHeader), sizeof(entryHeader));
+            out.write(entry.name.data(), static_cast<streamsize>(entry.name.size()));
+        }
+        const char padding[CHECKPOINT_ALIGNMENT] = {};
+        for (size_t i = 0; i < entries.size(); i++) {
+            out.write(padding, static_cast<streamsize>(entryOffsets[i] - static_cast<uint64_t>(out.tellp())));
+            out.write(static_cast<const char *>(entries[i].data),
+                      static_cast<streamsize>(entries[i].rows * entries[i].cols * sizeOf(entries[i].type)));
+        }
+        if (!out.flush())
+            throw runtime_error("cannot write " + temporary);
+    }
+    replaceFile(temporary, path);
+}
+
+CheckpointCounters autograd::loadCheckpoint(const string &path, Executor &executor, const ParameterNames &names) {
+    const MappedFile file(path);
+    const auto data = file.data();
+    const auto size = file.size();
+    Header header{};
+    if (size < sizeof(header))
+        throw invalid_argument(path + " is not a checkpoint");
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.byteOrder != ENDIANNESS_MARK)
+        throw invalid_argument(path + " is not a checkpoint");
+    if (header.version > CHECKPOINT_VERSION)
+        throw invalid_argument(path + " is from a newer version");
+    unordered_map<string, MappedEntry> entries;
+    uint64_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++) {
+        EntryHeader entryHeader{};
+        if (size < offset + sizeof(entryHeader))
+            throw invalid_argument(path + " is truncated");
+        memcpy(&entryHeader, data + offset, sizeof(entryHeader));
+        offset += sizeof(entryHeader);
+        const auto type = static_cast<EntryType>(entryHeader.type);
+        if (entryHeader.type > static_cast<uint32_t>(EntryType::UInt64) || size < offset + entryHeader.nameLength ||
+            size < entryHeader.offset + entryHeader.rows * entryHeader.cols * sizeOf(type))
+            throw invalid_argument(path + " is truncated");
+        string name(reinterpret_cast<const char *>(data + offset), entryHeader.nameLength);
+        offset += entryHeader.nameLength;
+        entries[move(name)] = { type, entryHeader.rows, entryHeader.cols, data + entryHeader.offset };
+    }
+    // A coefficient entry of the shape of the parameter, or nullptr if missing and optional
+    const auto find = [&](const string &name, const Operator::Parameters &coefficients, const bool required) {
+        const auto it = entries.find(name);
+        if (it == entries.end()) {
+            if (required)
+                throw invalid_argument(path + " has no " + name);
+            return static_cast<const MappedEntry *>(nullptr);
+        }
+        const auto &entry = it->second;
+        if (entry.type == EntryType::UInt64 || entry.rows != static_cast<uint64_t>(coefficients.rows) ||
+            entry.cols != static_cast<uint64_t>(coefficients.cols))
+            throw invalid_argument(name + " does not have the shape of the parameter in " + path);
+        return &entry;
+    };
+    const auto params = namedParameters(executor, names);
+    const auto optimizer = dynamic_cast<Optimizer *>(&executor);
+    const auto state = optimizer ? optimizer->state() : Optimizer::State();
+    const auto offsets = stateOffsets(optimizer);
+    for (const auto &[op, name] : params) {
+        // Version 1 numbered the parameters in the order of the compiled plan, which depends on its options
+        if (header.version < 2 && !names.count(op))
+            throw invalid_argument(path + " numbers its parameters by an order that is not stable, name them");
+        const auto coefficients = op->parameters();
+        read(*find(name, coefficients, true), coefficients.value, coefficients.size);
+        if (coefficients.master) {
+            if (const auto master = find(name + "/master", coefficients, false))
+                read(*master, coefficients.master, coefficients.size);
+            else
+                for (size_t i = 0; i < coefficients.size; i++)
+                    coefficients.master[i] = coefficients.value[i];
+            for (size_t i = 0; i < coefficients.size; i++)
+                coefficients.value[i] = static_cast<Scalar>(coefficients.master[i]);
+        }
+        const auto it = offsets.find(op.get());
+        if (it != offsets.end())
+            for (const auto &[buffer, values] : state.buffers)
+                if (const auto entry = find(name + "/" + buffer, coefficients, false))
+                    read(*entry, values->data() + it->second, coefficients.size);
+    }
+    const auto counter = [&](const MappedEntry &entry) {
+        if (entry.type != EntryType::UInt64)
+            throw invalid_argument(path + " has an invalid counter");
+        uint64_t value;
+        memcpy(&value, entry.data, sizeof(value));
+        return value;
+    };
+    for (const auto &[name, value] : state.counters)
+        if (const auto it = entries.find("optimizer/" + name); it != entries.end())
+            *value = counter(it->second);
+    CheckpointCounters ret;
+    for (const auto &[name, entry] : entries)
+        if (name.rfind("counter/", 0) == 0)
+            ret[name.substr(8)] = counter(entry);
+    return ret;
+}
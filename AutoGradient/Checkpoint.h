@@ -0,0 +1,45 @@
+//
+// Checkpoints: parameters and optimizer state in a versioned binary file
+//
+
+#ifndef AUTOGRADIENT_CHECKPOINT_H
+#define AUTOGRADIENT_CHECKPOINT_H
+
+#include <map>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "Optimizers.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // Parameters are named by the names given here, otherwise by their position ("param0", "param1" ...) in a
+    // depth-first walk of the graph as built from the result of the executor, inputs in order. Positions do not
+    // depend on the options of the executor; name the parameters to load into a graph that reaches them in
+    // another order.
+    // Layout: a header (magic "AGCK", version, number of entries), a table of entries (type, name, rows, cols,
+    // offset) and then their coefficients, column-major and aligned to CHECKPOINT_ALIGNMENT bytes, so that a
+    // mapped checkpoint is copied straight into the parameters. Entries:
+    //  - name: the parameter, in the precision of the library that saved it
+    //  - name/master: its MasterScalar copy with MIXED_PRECISION
+    //  - name/m1, name/m2 ...: per-coefficient optimizer state (see Optimizer::state())
+    //  - optimizer/updates ...: optimizer counters, counter/... the counters passed to saveCheckpoint()
+    // Loading converts coefficients saved in another precision
+    using ParameterNames = std::unordered_map<OpPtr, std::string>;
+    using CheckpointCounters = std::map<std::string, std::uint64_t>;
+
+    // Version 1 numbered parameters in the order of the compiled plan, its files load only by given names
+    constexpr std::uint32_t CHECKPOINT_VERSION = 2;
+    constexpr std::uint64_t CHECKPOINT_ALIGNMENT = 64;
+
+    // Saves the parameters of the graph of executor, and its state if it is an optimizer, with counters of
+    // the caller (epoch, DataParallelTrainer::stepCount() ...). The file is replaced only once fully written
+    void saveCheckpoint(const std::string &path, Executor &executor, const ParameterNames &names = {},
+                        const CheckpointCounters &counters = {});
+    // Loads the parameters of the graph of executor, and its state if it is an optimizer and the checkpoint
+    // has some. Every parameter must be in the checkpoint with its shape. Returns the counters of the caller
+    CheckpointCounters loadCheckpoint(const std::string &path, Executor &executor, const ParameterNames &names = {});
+}
+}
+
+#endif //AUTOGRADIENT_CHECKPOINT_H
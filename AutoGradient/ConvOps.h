@@ -0,0 +1,385 @@
+#ifndef AUTOGRADIENT_CONVOPS_H
+#define AUTOGRADIENT_CONVOPS_H
+
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include "BasicOps.h"
+
+// Spatial ops, images are rows x cols x channels x batch tensors (see Tensor.h), so every
+// channel of every sample is a contiguous column-major plane
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+	// A kernelRows x kernelCols window sliding over the first two dimensions of a tensor
+	struct Window2d {
+		Eigen::Index kernelRows, kernelCols, stride = 1, padding = 0;
+		Eigen::Index outRows(const Eigen::Index rows) const { return (rows + 2 * padding - kernelRows) / stride + 1; }
+		Eigen::Index outCols(const Eigen::Index cols) const { return (cols + 2 * padding - kernelCols) / stride + 1; }
+		// Outputs [first, second) for which kernel row (or column) offset falls inside an input of the given size
+		std::pair<Eigen::Index, Eigen::Index> validRange(const Eigen::Index offset, const Eigen::Index size,
+		                                                 const Eigen::Index outSize) const {
+			const auto lo = offset >= padding ? 0 : (padding - offset + stride - 1) / stride;
+			const auto last = size - 1 + padding - offset;
+			const auto hi = last < 0 ? 0 : std::min(outSize, last / stride + 1);
+			return { lo, std::max(lo, hi) };
+		}
+		bool operator ==(const Window2d &other) const {
+			return kernelRows == other.kernelRows && kernelCols == other.kernelCols && stride == other.stride &&
+			       padding == other.padding;
+		}
+	};
+
+	// Cross-correlation of x with a bank of filters, plus one bias per filter
+	// w has one row per filter, its columns are the kernel coefficients of all the channels in column-major order
+	// (kernel row fastest, then kernel column, then channel) and b is a column holding the biases.
+	// The output is an outRows x outCols x filters x batch tensor
+	class Conv2dOp : public Operator {
+	public:
+		enum class Algorithm {
+			Auto,		// picked from the shape, see useIm2col()
+			Im2col,		// the patches unrolled into a matrix, one GEMM per sample
+			Direct,		// every kernel coefficient swept over a whole plane at once
+		};
+		// Multiply-adds per output position (over all filters) from which unrolling pays off
+		static constexpr Eigen::Index IM2COL_THRESHOLD = 128;
+	private:
+		using Index = Eigen::Index;
+		OpPtr x, w, b;
+		Window2d window;
+		Algorithm algorithm;
+	public:
+		Conv2dOp(OpPtr x, OpPtr w, OpPtr b, const Window2d &window, const Algorithm algorithm = Algorithm::Auto)
+			: x(std::move(x)), w(std::move(w)), b(std::move(b)), window(window), algorithm(algorithm) {}
+		OVERRIDE_INPUTS { return { x, w, b }; }
+		OVERRIDE_OUTPUT { return ValueType::Tensor; }
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override {
+			const auto &op = static_cast<const Conv2dOp &>(other);
+			return window == op.window && algorithm == op.algorithm;
+		}
+		void save(GraphWriter &out) const override {
+			out.write(window);
+			out.write(algorithm);
+		}
+		// A multiply-add per output coefficient and kernel coefficient
+		OVERRIDE_FLOPS { return 2.0 * std::get<Matrix>(*inputs[1]).cols() * sizeOf(output); }
+		// Many filters over long patches make a good GEMM. With few filters or short patches the product is too
+		// skinny to amortize unrolling, sweeping the planes directly is faster then (e.g. 4 filters of 3x3x3)
+		bool useIm2col(const Index channels, const Index filters) const {
+			if (algorithm != Algorithm::Auto)
+				return algorithm == Algorithm::Im2col;
+			return filters * channels * window.kernelRows * window.kernelCols >= IM2COL_THRESHOLD;
+		}
+		OVERRIDE_EVAL_INTO {
+			const Tensor &vx = std::get<Tensor>(V(x));
+			const Matrix &vw = std::get<Matrix>(V(w)), &vb = std::get<Matrix>(V(b));
+			checkShapes(vx, vw, vb);
+			const Index channels = vx.dim(2), batch = vx.dim(3), filters = vw.rows();
+			const Index outRows = window.outRows(vx.dim(0)), outCols = window.outCols(vx.dim(1));
+			Tensor &ret = tensorOf(out, { outRows, outCols, filters, batch });
+			if (useIm2col(channels, filters)) {
+				// The patches are kept for diff()
+				Tensor &patches = tensorOf(env->scratch(2)[0], { outRows * outCols, vw.cols(), batch });
+				for (Index n = 0; n < batch; n++) {
+					auto p = patches.matrix(n);
+					im2col(vx, n, p, outRows, outCols);
+					auto y = ret.slice(n).reshape({ outRows * outCols, filters }).matrix();
+					y.noalias() = p * vw.transpose();
+					y.rowwise() += vb.col(0).transpose();
+				}
+				return;
+			}
+			// Filters innermost, so that the input block of a tap is read from cache by all of them
+			for (Index n = 0; n < batch; n++) {
+				for (Index f = 0; f < filters; f++)
+					planeOf(ret, f, n).setConstant(vb(f, 0));
+				forEachTap(vx, outRows, outCols, [&](const Index k, const Index c, const Index row, const Index col,
+				                                     const Index r0, const Index c0, const Index nr, const Index nc) {
+					withBlock(vx, c, n, row, col, nr, nc, [&](const auto &in) {
+						for (Index f = 0; f < filters; f++)
+							planeOf(ret, f, n).block(r0, c0, nr, nc) += vw(f, k) * in;
+					});
+				});
+			}
+		}
+		OVERRIDE_DIFF_INTO {
+			const Tensor &vx = std::get<Tensor>(V(x));
+			const Matrix &vw = std::get<Matrix>(V(w)), &vb = std::get<Matrix>(V(b));
+			const Tensor &g = std::get<Tensor>(outputGrad);
+			const Index channels = vx.dim(2), batch = vx.dim(3), filters = vw.rows();
+			const Index outRows = g.dim(0), outCols = g.dim(1);
+			Tensor &gx = tensorOf(inputGrads[0], vx);
+			Matrix &gw = matrixOf(inputGrads[1], vw), &gb = matrixOf(inputGrads[2], vb);
+			gx.setZero();
+			gw.setZero();
+			gb.setZero();
+			if (useIm2col(channels, filters)) {
+				auto &scratch = env->scratch(2);
+				const Tensor &patches = std::get<Tensor>(scratch[0]);
+				Matrix &dp = matrixOf(scratch[1], outRows * outCols, vw.cols());
+				for (Index n = 0; n < batch; n++) {
+					const auto gy = g.slice(n).reshape({ outRows * outCols, filters }).matrix();
+					gw.noalias() += gy.transpose() * patches.matrix(n);
+					gb.col(0) += gy.colwise().sum().transpose();
+					dp.noalias() = gy * vw;
+					col2im(dp, gx, n, outRows, outCols);
+				}
+				return;
+			}
+			for (Index n = 0; n < batch; n++) {
+				for (Index f = 0; f < filters; f++)
+					gb(f, 0) += planeOf(g, f, n).sum();
+				forEachTap(vx, outRows, outCols, [&](const Index k, const Index c, const Index row, const Index col,
+				                                     const Index r0, const Index c0, const Index nr, const Index nc) {
+					withBlock(vx, c, n, row, col, nr, nc, [&](const auto &in) {
+						for (Index f = 0; f < filters; f++)
+							gw(f, k) += planeOf(g, f, n).block(r0, c0, nr, nc).cwiseProduct(in).sum();
+					});
+					withBlock(gx, c, n, row, col, nr, nc, [&](auto &&in) {
+						for (Index f = 0; f < filters; f++)
+							in += vw(f, k) * planeOf(g, f, n).block(r0, c0, nr, nc);
+					});
+				});
+			}
+		}
+	private:
+		void checkShapes(const Tensor &vx, const Matrix &vw, const Matrix &vb) const {
+			if (vw.cols() != vx.dim(2) * window.kernelRows * window.kernelCols)
+				throw std::invalid_argument("conv2d: filters do not match the kernel size and the input channels");
+			if (vb.rows() != vw.rows() || vb.cols() != 1)
+				throw std::invalid_argument("conv2d: one bias per filter expected");
+			if (window.outRows(vx.dim(0)) <= 0 || window.outCols(vx.dim(1)) <= 0)
+				throw std::invalid_argument("conv2d: kernel larger than the input");
+		}
+		// Calls f(k, c, row, col, r0, c0, nr, nc) for every coefficient k (of channel c) of the kernel: the outputs
+		// it contributes to are the block at (r0, c0) of size nr x nc, reading the input from (row, col) on
+		template <typename F>
+		void forEachTap(const Tensor &vx, const Index outRows, const Index outCols, F f) const {
+			Index k = 0;
+			for (Index c = 0; c < vx.dim(2); c++)
+				for (Index kc = 0; kc < window.kernelCols; kc++)
+					for (Index kr = 0; kr < window.kernelRows; kr++, k++) {
+						const auto [r0, r1] = window.validRange(kr, vx.dim(0), outRows);
+						const auto [c0, c1] = window.validRange(kc, vx.dim(1), outCols);
+						if (r0 < r1 && c0 < c1)
+							f(k, c, r0 * window.stride + kr - window.padding, c0 * window.stride + kc - window.padding,
+							  r0, c0, r1 - r0, c1 - c0);
+					}
+		}
+		// Plane (c, n) of t as a matrix, mapped directly to spare the reference counting of slice()
+		static Tensor::MatrixMap planeOf(Tensor &t, const Index c, const Index n) {
+			return Tensor::MatrixMap(&t(0, 0, c, n), t.dim(0), t.dim(1), Eigen::OuterStride<>(t.stride(1)));
+		}
+		static Tensor::ConstMatrixMap planeOf(const Tensor &t, const Index c, const Index n) {
+			return Tensor::ConstMatrixMap(&t(0, 0, c, n), t.dim(0), t.dim(1), Eigen::OuterStride<>(t.stride(1)));
+		}
+		// Calls f with the nr x nc block at (row, col) of plane (c, n) of t, stepping by the stride of the window.
+		// A unit stride gets a map that Eigen can vectorize
+		template <typename T, typename F>
+		void withBlock(T &t, const Index c, const Index n, const Index row, const Index col,
+		               const Index nr, const Index nc, F f) const {
+			using M = std::conditional_t<std::is_const_v<T>, const Matrix, Matrix>;
+			auto *data = &t(row, col, c, n);
+			if (window.stride == 1)
+				f(Eigen::Map<M, Eigen::Unaligned, Eigen::OuterStride<>>(data, nr, nc, Eigen::OuterStride<>(t.stride(1))));
+			else
+				f(Eigen::Map<M, Eigen::Unaligned, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>>(
+					data, nr, nc, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(window.stride * t.stride(1), window.stride)));
+		}
+		// Row r + outRows * c of p is the patch under output (r, c) of sample n, one column per kernel coefficient
+		void im2col(const Tensor &vx, const Index n, Tensor::MatrixMap p, const Index outRows, const Index outCols) const {
+			// Padding is the only part no tap writes
+			if (window.padding > 0)
+				p.setZero();
+			forEachTap(vx, outRows, outCols, [&](const Index k, const Index c, const Index row, const Index col,
+			                                     const Index r0, const Index c0, const Index nr, const Index nc) {
+				withBlock(vx, c, n, row, col, nr, nc, [&](const auto &in) {
+					Eigen::Map<Matrix>(p.col(k).data(), outRows, outCols).block(r0, c0, nr, nc) = in;
+				});
+			});
+		}
+		// The reverse of im2col(), overlapping patches are summed into gx
+		void col2im(const Matrix &dp, Tensor &gx, const Index n, const Index outRows, const Index outCols) const {
+			forEachTap(gx, outRows, outCols, [&](const Index k, const Index c, const Index row, const Index col,
+			                                     const Index r0, const Index c0, const Index nr, const Index nc) {
+				withBlock(gx, c, n, row, col, nr, nc, [&](auto &&in) {
+					in += Eigen::Map<const Matrix>(dp.col(k).data(), outRows, outCols).block(r0, c0, nr, nc);
+				});
+			});
+		}
+	};
+	inline OpPtr conv2d(OpPtr x, OpPtr w, OpPtr b, const Eigen::Index kernelRows, const Eigen::Index kernelCols,
+	                    const Eigen::Index stride = 1, const Eigen::Index padding = 0,
+	                    const Conv2dOp::Algorithm algorithm = Conv2dOp::Algorithm::Auto) {
+		return std::static_pointer_cast<Operator>(std::make_shared<Conv2dOp>(
+			std::move(x), std::move(w), std::move(b), Window2d{ kernelRows, kernelCols, stride, padding }, algorithm));
+	}
+
+	// Max over every window of every channel, windows must lie inside the input (no padding)
+	class MaxPool2dOp : public Operator {
+		using Index = Eigen::Index;
+		OpPtr x;
+		Window2d window;
+	public:
+		MaxPool2dOp(OpPtr x, const Window2d &window) : x(std::move(x)), window(window) {}
+		OVERRIDE_INPUTS { return { x }; }
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override { return window == static_cast<const MaxPool2dOp &>(other).window; }
+		void save(GraphWriter &out) const override { out.write(window); }
+		OVERRIDE_OUTPUT { return ValueType::Tensor; }
+		OVERRIDE_EVAL_INTO {
+			const Tensor &vx = std::get<Tensor>(V(x));
+			const Index channels = vx.dim(2), batch = vx.dim(3), step = vx.stride(1);
+			const Index outRows = window.outRows(vx.dim(0)), outCols = window.outCols(vx.dim(1));
+			Tensor &ret = tensorOf(out, { outRows, outCols, channels, batch });
+			// Where the max of every window is in its plane, for diff()
+			Tensor &argmax = tensorOf(env->scratch(), ret);
+			for (Index n = 0; n < batch; n++)
+				for (Index c = 0; c < channels; c++) {
+					const Scalar *plane = &vx(0, 0, c, n);
+					for (Index oc = 0; oc < outCols; oc++)
+						for (Index orow = 0; orow < outRows; orow++) {
+							Index best = orow * window.stride + oc * window.stride * step;
+							for (Index kc = 0; kc < window.kernelCols; kc++)
+								for (Index kr = 0; kr < window.kernelRows; kr++) {
+									const Index i = orow * window.stride + kr + (oc * window.stride + kc) * step;
+									if (plane[i] > plane[best])
+										best = i;
+								}
+							ret(orow, oc, c, n) = plane[best];
+							argmax(orow, oc, c, n) = static_cast<Scalar>(best);
+						}
+				}
+		}
+		OVERRIDE_DIFF_INTO {
+			const Tensor &vx = std::get<Tensor>(V(x));
+			const Tensor &g = std::get<Tensor>(outputGrad);
+			const Tensor &argmax = std::get<Tensor>(env->scratch());
+			Tensor &gx = tensorOf(inputGrads[0], vx);
+			gx.setZero();
+			// argmax holds offsets in the planes of x, gx may be laid out differently if x is a view
+			const Index step = vx.stride(1);
+			for (Index n = 0; n < g.dim(3); n++)
+				for (Index c = 0; c < g.dim(2); c++)
+					for (Index oc = 0; oc < g.dim(1); oc++)
+						for (Index orow = 0; orow < g.dim(0); orow++) {
+							const auto i = static_cast<Index>(argmax(orow, oc, c, n));
+							gx(i % step, i / step, c, n) += g(orow, oc, c, n);
+						}
+		}
+	};
+
+	// Mean over every window of every channel, windows must lie inside the input (no padding)
+	class AvgPool2dOp : public Operator {
+		using Index = Eigen::Index;
+		OpPtr x;
+		Window2d window;
+	public:
+		AvgPool2dOp(OpPtr x, const Window2d &window) : x(std::move(x)), window(window) {}
+		OVERRIDE_INPUTS { return { x }; }
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override { return window == static_cast<const AvgPool2dOp &>(other).window; }
+		void save(GraphWriter &out) const override { out.write(window); }
+		OVERRIDE_OUTPUT { return ValueType::Tensor; }
+		OVERRIDE_EVAL_INTO {
+			const Tensor &vx = std::get<Tensor>(V(x));
+			const Index channels = vx.dim(2), batch = vx.dim(3);
+			const Index outRows = window.outRows(vx.dim(0)), outCols = window.outCols(vx.dim(1));
+			const Scalar area = static_cast<Scalar>(window.kernelRows * window.kernelCols);
+			Tensor &ret = tensorOf(out, { outRows, outCols, channels, batch });
+			for (Index n = 0; n < batch; n++)
+				for (Index c = 0; c < channels; c++)
+					for (Index oc = 0; oc < outCols; oc++)
+						for (Index orow = 0; orow < outRows; orow++) {
+							Scalar sum = 0;
+							for (Index kc = 0; kc < window.kernelCols; kc++)
+								for (Index kr = 0; kr < window.kernelRows; kr++)
+									sum += vx(orow * window.stride + kr, oc * window.stride + kc, c, n);
+							ret(orow, oc, c, n) = sum / area;
+						}
+		}
+		OVERRIDE_DIFF_INTO {
+			const Tensor &vx = std::get<Tensor>(V(x));
+			const Tensor &g = std::get<Tensor>(outputGrad);
+			const Scalar area = static_cast<Scalar>(window.kernelRows * window.kernelCols);
+			Tensor &gx = tensorOf(inputGrads[0], vx);
+			gx.setZero();
+			for (Index n = 0; n < g.dim(3); n++)
+				for (Index c = 0; c < g.dim(2); c++)
+					for (Index oc = 0; oc < g.dim(1); oc++)
+						for (Index orow = 0; orow < g.dim(0); orow++) {
+							const Scalar share = g(orow, oc, c, n) / area;
+							for (Index kc = 0; kc < window.kernelCols; kc++)
+								for (Index kr = 0; kr < window.kernelRows; kr++)
+									gx(orow * window.stride + kr, oc * window.stride + kc, c, n) += share;
+						}
+		}
+	};
+
+	// stride = 0 means non-overlapping windows (stride = size)
+	inline OpPtr maxPool2d(OpPtr x, const Eigen::Index size, const Eigen::Index stride = 0) {
+		return std::static_pointer_cast<Operator>(
+			std::make_shared<MaxPool2dOp>(std::move(x), Window2d{ size, size, stride > 0 ? stride : size, 0 }));
+	}
+	inline OpPtr avgPool2d(OpPtr x, const Eigen::Index size, const Eigen::Index stride = 0) {
+		return std::static_pointer_cast<Operator>(
+			std::make_shared<AvgPool2dOp>(std::move(x), Window2d{ size, size, stride > 0 ? stride : size, 0 }));
+	}
+
+	// One sample per column -> rows x cols x channels x batch, coefficients kept in the same order
+	class ToImageOp : public Operator {
+		OpPtr x;
+		Eigen::Index rows, cols, channels;
+	public:
+		ToImageOp(OpPtr x, const Eigen::Index rows, const Eigen::Index cols, const Eigen::Index channels)
+			: x(std::move(x)), rows(rows), cols(cols), channels(channels) {}
+		OVERRIDE_INPUTS { return { x }; }
+		bool pure() const override { return true; }
+		bool sameAs(const Operator &other) const override {
+			const auto &op = static_cast<const ToImageOp &>(other);
+			return rows == op.rows && cols == op.cols && channels == op.channels;
+		}
+		void save(GraphWriter &out) const override {
+			out.write(rows);
+			out.write(cols);
+			out.write(channels);
+		}
+		OVERRIDE_OUTPUT { return ValueType::Tensor; }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vx = std::get<Matrix>(V(x));
+			if (vx.rows() != rows * cols * channels)
+				throw std::invalid_argument("toImage: the samples do not have the size of an image");
+			tensorOf(out, { rows, cols, channels, vx.cols() }).flat() = Eigen::Map<const Array>(vx.data(), vx.size());
+		}
+		OVERRIDE_DIFF_INTO {
+			const Tensor &g = std::get<Tensor>(outputGrad);
+			Matrix &gx = matrixOf(inputGrads[0], std::get<Matrix>(V(x)));
+			Eigen::Map<Array>(gx.data(), gx.size()) = g.flat();
+		}
+	};
+	inline OpPtr toImage(OpPtr x, const Eigen::Index rows, const Eigen::Index cols, const Eigen::Index channels = 1) {
+		return std::static_pointer_cast<Operator>(std::make_shared<ToImageOp>(std::move(x), rows, cols, channels));
+	}
+
+	// The reverse of toImage(): every sample (the last dimension of x) flattened into a column
+	class FlattenOp : public Operator {
+		UNARY_OP(FlattenOp)
+		OVERRIDE_OUTPUT { return ValueType::Matrix; }
+		OVERRIDE_EVAL_INTO {
+			const Tensor &vx = std::get<Tensor>(V(operand));
+			const auto batch = vx.dim(vx.rank() - 1);
+			Matrix &ret = matrixOf(out, vx.size() / batch, batch);
+			Eigen::Map<Array>(ret.data(), ret.size()) = vx.flat();
+		}
+		OVERRIDE_DIFF_INTO {
+			const Matrix &g = std::get<Matrix>(outputGrad);
+			tensorOf(inputGrads[0], std::get<Tensor>(V(operand))).flat() = Eigen::Map<const Array>(g.data(), g.size());
+		}
+	};
+	UNARY_OP_FUNC(flatten, FlattenOp)
+}
+}
+
+#endif
@@ -0,0 +1,334 @@
+//
+// Memory-mapped datasets and a loader assembling shuffled minibatches on a background thread
+//
+
+#include "Dataset.h"
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <stdexcept>
+#include <filesystem>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace autograd;
+
+#ifdef _WIN32
+MappedFile::MappedFile(const string &path) {
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER fileSize;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize)) {
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        throw runtime_error("cannot open " + path);
+    }
+    length = static_cast<size_t>(fileSize.QuadPart);
+    // Empty files cannot be mapped, and need not be
+    if (!length)
+        return;
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+        base = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!base) {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        throw runtime_error("cannot map " + path);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (base)
+        UnmapViewOfFile(base);
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+}
+
+void autograd::replaceFile(const string &temporary, const string &path) {
+    const auto file = CreateFileA(temporary.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                                  nullptr);
+    const auto synced = file != INVALID_HANDLE_VALUE && FlushFileBuffers(file);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    if (!synced)
+        throw runtime_error("cannot sync " + temporary);
+    if (!MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        throw runtime_error("cannot rename " + temporary + " to " + path);
+}
+#else
+MappedFile::MappedFile(const string &path) {
+    const auto fd = open(path.c_str(), O_RDONLY);
+    struct stat st {};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("cannot open " + path);
+    }
+    length = static_cast<size_t>(st.st_size);
+    // The mapping outlives the descriptor. Empty files cannot be mapped, and need not be
+    const auto mapped = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (mapped == MAP_FAILED)
+        throw runtime_error("cannot map " + path);
+    base = static_cast<const unsigned char *>(mapped);
+}
+
+MappedFile::~MappedFile() {
+    if (base)
+        munmap(const_cast<unsigned char *>(base), length);
+}
+
+namespace {
+    void syncPath(const string &path, const int flags) {
+        const auto fd = open(path.c_str(), flags);
+        const auto synced = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        if (!synced)
+            throw runtime_error("cannot sync " + path);
+    }
+}
+
+void autograd::replaceFile(const string &temporary, const string &path) {
+    syncPath(temporary, O_RDWR);
+    filesystem::rename(temporary, path);
+    // The rename itself only lasts once the directory is synced
+    const auto directory = filesystem::path(path).parent_path();
+    syncPath(directory.empty() ? "." : directory.string(), O_RDONLY | O_DIRECTORY);
+}
+#endif
+
+size_t autograd::elementSize(const ElementType type) {
+    switch (type) {
+    case ElementType::UInt8:
+    case ElementType::Int8:
+        return 1;
+    case ElementType::Int16:
+        return 2;
+    case ElementType::Int32:
+    case ElementType::Float32:
+        return 4;
+    case ElementType::Float64:
+        return 8;
+    }
+    throw invalid_argument("unknown element type");
+}
+
+namespace {
+    bool bigEndianMachine() {
+        const uint16_t one = 1;
+        unsigned char first;
+        memcpy(&first, &one, 1);
+        return first == 0;
+    }
+
+    // Reads n coefficients of type T from src, reversing their bytes if swap
+    template <typename T>
+    void load(const unsigned char *src, const size_t n, const bool swap, const Scalar scale, Scalar *out) {
+        unsigned char bytes[sizeof(T)];
+        T v;
+        for (size_t i = 0; i < n; i++, src += sizeof(T)) {
+            if (swap) {
+                reverse_copy(src, src + sizeof(T), bytes);
+                memcpy(&v, bytes, sizeof(T));
+            } else
+                memcpy(&v, src, sizeof(T));
+            out[i] = static_cast<Scalar>(v) * scale;
+        }
+    }
+
+    uint32_t readBigEndian32(const unsigned char *p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+}
+
+void Dataset::convert(const size_t sample, Scalar *out) const {
+    const auto src = first + sample * sampleSize * elementSize(type);
+    const auto swap = bigEndian != bigEndianMachine();
+    switch (type) {
+    case ElementType::UInt8: load<uint8_t>(src, sampleSize, swap, scale, out); break;
+    case ElementType::Int8: load<int8_t>(src, sampleSize, swap, scale, out); break;
+    case ElementType::Int16: load<int16_t>(src, sampleSize, swap, scale, out); break;
+    case ElementType::Int32: load<int32_t>(src, sampleSize, swap, scale, out); break;
+    case ElementType::Float32: load<float>(src, sampleSize, swap, scale, out); break;
+    case ElementType::Float64: load<double>(src, sampleSize, swap, scale, out); break;
+    }
+}
+
+Dataset Dataset::idx(const string &path, const Scalar scale) {
+    Dataset ret;
+    const auto file = make_shared<const MappedFile>(path);
+    const auto data = file->data();
+    // Magic: two zero bytes, the type code and the number of dimensions, then every dimension
+    if (file->size() < 4 || data[0] || data[1] || !data[3])
+        throw invalid_argument(path + " is not an IDX file");
+    switch (data[2]) {
+    case 0x08: ret.type = ElementType::UInt8; break;
+    case 0x09: ret.type = ElementType::Int8; break;
+    case 0x0B: ret.type = ElementType::Int16; break;
+    case 0x0C: ret.type = ElementType::Int32; break;
+    case 0x0D: ret.type = ElementType::Float32; break;
+    case 0x0E: ret.type = ElementType::Float64; break;
+    default: throw invalid_argument(path + " has an unknown IDX type");
+    }
+    const size_t dims = data[3], header = 4 + 4 * dims;
+    if (file->size() < header)
+        throw invalid_argument(path + " is truncated");
+    ret.count = readBigEndian32(data + 4);
+    ret.sampleSize = 1;
+    for (size_t d = 1; d < dims; d++)
+        ret.sampleSize *= readBigEndian32(data + 4 + 4 * d);
+    if (file->size() < header + ret.count * ret.sampleSize * elementSize(ret.type))
+        throw invalid_argument(path + " is truncated");
+    ret.file = file;
+    ret.first = data + header;
+    ret.bigEndian = true;
+    ret.scale = scale;
+    return ret;
+}
+
+Dataset Dataset::raw(const string &path, const ElementType type, const size_t sampleSize, const size_t offset,
+                     const Scalar scale) {
+    if (!sampleSize)
+        throw invalid_argument("samples cannot be empty");
+    Dataset ret;
+    const auto file = make_shared<const MappedFile>(path);
+    if (file->size() < offset)
+        throw invalid_argument(path + " is truncated");
+    ret.file = file;
+    ret.first = file->data() + offset;
+    ret.type = type;
+    ret.bigEndian = bigEndianMachine();
+    ret.sampleSize = sampleSize;
+    ret.count = (file->size() - offset) / (sampleSize * elementSize(type));
+    ret.scale = scale;
+    return ret;
+}
+
+Dataset Dataset::oneHot(const size_t classes) const {
+    if (sampleSize != 1)
+        throw invalid_argument("class indices are samples of one coefficient");
+    auto ret = *this;
+    ret.classes = classes;
+    return ret;
+}
+
+void Dataset::gather(const size_t *indices, const size_t n, Matrix &out) const {
+    out.resize(rows(), n);
+    for (size_t j = 0; j < n; j++) {
+        if (indices[j] >= count)
+            throw out_of_range("sample index out of range");
+        if (!classes) {
+            convert(indices[j], out.col(j).data());
+            continue;
+        }
+        Scalar c;
+        convert(indices[j], &c);
+        if (c < 0 || c >= classes)
+            throw out_of_range("class index out of range");
+        out.col(j).setZero();
+        out(static_cast<Eigen::Index>(c), j) = 1;
+    }
+}
+
+void Dataset::slice(const size_t begin, const size_t end, Matrix &out) const {
+    vector<size_t> indices(end - begin);
+    iota(indices.begin(), indices.end(), begin);
+    gather(indices.data(), indices.size(), out);
+}
+
+DataLoader::DataLoader(vector<Dataset> datasets, const size_t batchSize, const bool shuffle, const uint64_t seed,
+                       const bool dropLast)
+    : datasets(move(datasets)), batchSize(batchSize), shuffle(shuffle), dropLast(dropLast), rng(seed) {
+    if (this->datasets.empty())
+        throw invalid_argument("a loader needs a dataset");
+    for (const auto &dataset : this->datasets)
+        if (dataset.size() != size())
+            throw invalid_argument("datasets of a loader must have the same size");
+    if (!batchSize || !batches())
+        throw invalid_argument("a loader must have at least one minibatch");
+    order.resize(size());
+    iota(order.begin(), order.end(), size_t(0));
+    freeBuffers = { 0, 1 };
+    worker = thread(&DataLoader::produce, this);
+}
+
+DataLoader::~DataLoader() {
+    {
+        lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+// Runs ahead epoch after epoch, blocked whenever both buffers are waiting for the caller
+void DataLoader::produce() {
+    try {
+        for (;;) {
+            if (shuffle)
+                std::shuffle(order.begin(), order.end(), rng);
+            for (size_t begin = 0; begin < order.size(); begin += batchSize) {
+                const auto end = min(order.size(), begin + batchSize);
+                if (dropLast && end - begin < batchSize)
+                    break;
+                size_t b;
+                {
+                    unique_lock<std::mutex> lock(queueMutex);
+                    changed.wait(lock, [this] { return stopping || !freeBuffers.empty(); });
+                    if (stopping)
+                        return;
+                    b = freeBuffers.front();
+                    freeBuffers.pop_front();
+                }
+                buffers[b].resize(datasets.size());
+                for (size_t k = 0; k < datasets.size(); k++)
+                    datasets[k].gather(order.data() + begin, end - begin, buffers[b][k]);
+                {
+                    lock_guard<std::mutex> lock(queueMutex);
+                    ready.push_back(b);
+                }
+                changed.notify_all();
+            }
+            {
+                lock_guard<std::mutex> lock(queueMutex);
+                if (stopping)
+                    return;
+                ready.push_back(END);
+            }
+            changed.notify_all();
+        }
+    } catch (...) {
+        {
+            lock_guard<std::mutex> lock(queueMutex);
+            error = current_exception();
+        }
+        changed.notify_all();
+    }
+}
+
+const vector<Matrix> *DataLoader::next() {
+    unique_lock<std::mutex> lock(queueMutex);
+    if (current != END) {
+        freeBuffers.push_back(current);
+        current = END;
+        changed.notify_all();
+    }
+    changed.wait(lock, [this] { return !ready.empty() || error; });
+    // Batches gathered before a failure are still handed out
+    if (ready.empty())
+        rethrow_exception(error);
+    current = ready.front();
+    ready.pop_front();
+    return current == END ? nullptr : &buffers[current];
+}
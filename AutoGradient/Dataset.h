@@ -0,0 +1,116 @@
+//
+// Memory-mapped datasets and a loader assembling shuffled minibatches on a background thread
+//
+
+#ifndef AUTOGRADIENT_DATASET_H
+#define AUTOGRADIENT_DATASET_H
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <random>
+#include <cstdint>
+#include "Value.h"
+#include "Random.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // A read-only mapping of a whole file, unmapped on destruction
+    class MappedFile {
+        const unsigned char *base = nullptr;
+        size_t length = 0;
+#ifdef _WIN32
+        void *file = nullptr, *mapping = nullptr;
+#endif
+    public:
+        explicit MappedFile(const std::string &path);
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator =(const MappedFile &) = delete;
+        ~MappedFile();
+        const unsigned char *data() const { return base; }
+        size_t size() const { return length; }
+    };
+
+    // Renames temporary to path once its data, and on POSIX the directory entry of path, are on disk: after a
+    // crash path is either the old file or the whole new one
+    void replaceFile(const std::string &temporary, const std::string &path);
+
+    // Type of the coefficients as stored in a file
+    enum class ElementType { UInt8, Int8, Int16, Int32, Float32, Float64 };
+
+    size_t elementSize(ElementType type);
+
+    // Fixed-size samples stored one after the other in a mapped file. Nothing is read until samples are
+    // gathered, which converts them to Scalar (scaled) as the columns of a matrix: the file is never
+    // loaded or converted as a whole. Copies share the mapping
+    class Dataset {
+        std::shared_ptr<const MappedFile> file;
+        const unsigned char *first = nullptr;
+        ElementType type = ElementType::UInt8;
+        bool bigEndian = false;
+        size_t sampleSize = 0, count = 0, classes = 0;
+        Scalar scale = 1;
+        void convert(size_t sample, Scalar *out) const;
+    public:
+        Dataset() = default;
+        // IDX file (MNIST and co.), the sample is everything past the first dimension.
+        // Coefficients are multiplied by scale, e.g. 1 / 255 for pixels
+        static Dataset idx(const std::string &path, Scalar scale = 1);
+        // Headerless file of samples of sampleSize coefficients, in the byte order of this machine, from offset on
+        static Dataset raw(const std::string &path, ElementType type, size_t sampleSize, size_t offset = 0,
+                           Scalar scale = 1);
+        // Samples read as class indices, gathered as one-hot columns of classes coefficients
+        Dataset oneHot(size_t classes) const;
+        size_t size() const { return count; }
+        // Number of rows of the gathered matrices
+        size_t rows() const { return classes ? classes : sampleSize; }
+        // Samples indices[0 .. n) as the columns of out, reusing its storage when the size matches
+        void gather(const size_t *indices, size_t n, Matrix &out) const;
+        // Samples [begin, end) as the columns of out
+        void slice(size_t begin, size_t end, Matrix &out) const;
+    };
+
+    // Splits datasets of the same size into minibatches, the same samples from each (e.g. images and labels),
+    // in an order reshuffled every epoch. Batches are gathered by a background thread into one of two buffers
+    // while the caller works with the other, so reading and converting overlaps with training.
+    // The order only depends on the seed
+    class DataLoader {
+        std::vector<Dataset> datasets;
+        size_t batchSize;
+        bool shuffle, dropLast;
+        std::mt19937_64 rng;
+        std::vector<size_t> order;
+        // Two buffers, the indices of those free and those gathered in the queues. END marks the end of an epoch
+        static constexpr size_t END = SIZE_MAX;
+        std::vector<Matrix> buffers[2];
+        std::deque<size_t> freeBuffers, ready;
+        // The buffer handed out by the last next(), freed by the following one
+        size_t current = END;
+        bool stopping = false;
+        std::exception_ptr error;
+        std::mutex queueMutex;
+        std::condition_variable changed;
+        std::thread worker;
+        void produce();
+    public:
+        DataLoader(std::vector<Dataset> datasets, size_t batchSize, bool shuffle = true,
+                   std::uint64_t seed = seededRNG()(), bool dropLast = false);
+        DataLoader(const DataLoader &) = delete;
+        DataLoader &operator =(const DataLoader &) = delete;
+        ~DataLoader();
+        // The next minibatch, one matrix per dataset with one sample per column, valid until the next call.
+        // nullptr ends an epoch, the call after begins the next one
+        const std::vector<Matrix> *next();
+        size_t size() const { return datasets.front().size(); }
+        // Number of minibatches per epoch
+        size_t batches() const { return dropLast ? size() / batchSize : (size() + batchSize - 1) / batchSize; }
+    };
+}
+}
+
+#endif //AUTOGRADIENT_DATASET_H
@@ -3,142 +3,769 @@
 //
 
 #include "Executor.h"
+#include "BasicOps.h"
+#include "Fusion.h"
+#include "GraphIO.h"
+#include "Random.h"
 #include <queue>
 #include <unordered_set>
 #include <sstream>
 #include <typeinfo>
+#include <typeindex>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 using namespace autograd;
 
-Executor::Executor(const OpPtr &result) {
-    this->resultOp = result;
-    unordered_map<OpPtr, size_t> inDegree;
-    unordered_map<OpPtr, vector<OpPtr>> outOps;
-    unordered_map<OpPtr, bool> visited;
-    queue<OpPtr> qBFS, qTopoSort;
-    qBFS.push(result);
-    visited[result] = true;
-    while (!qBFS.empty()) {
-        auto u = qBFS.front(); qBFS.pop();
-        auto inputs = u->inputs();
-        if (inputs.empty())
-            qTopoSort.push(u);
-        inDegree[u] = inputs.size();
-        for (const auto &v : inputs) {
-            outOps[v].push_back(u);
-            if (!visited[v]) {
-                visited[v] = true;
-                qBFS.push(v);
+namespace {
+    // The replacement of op in substitutes (replacements are substituted in turn), or op itself
+    OpPtr substitute(const unordered_map<const Operator *, OpPtr> &substitutes, const OpPtr &op) {
+        auto ret = op;
+        for (auto it = substitutes.find(ret.get()); it != substitutes.end(); it = substitutes.find(ret.get()))
+            ret = it->second;
+        return ret;
+    }
+
+    // The ops of the graphs of root and of the ops in keep in topological order, root last, resolve gives the op
+    // evaluated in place of an input
+    template <typename F>
+    vector<OpPtr> topoSort(const OpPtr &root, const vector<OpPtr> &keep, const F &resolve) {
+        vector<OpPtr> order;
+        unordered_map<OpPtr, size_t> inDegree;
+        unordered_map<OpPtr, vector<OpPtr>> outOps;
+        unordered_map<OpPtr, bool> visited;
+        queue<OpPtr> qBFS, qTopoSort;
+        // The graph of root first, then what only the ops in keep read
+        for (size_t r = 0; r <= keep.size(); r++) {
+            const auto start = r == 0 ? root : resolve(keep[r - 1]);
+            if (visited[start])
+                continue;
+            qBFS.push(start);
+            visited[start] = true;
+            while (!qBFS.empty()) {
+                auto u = qBFS.front(); qBFS.pop();
+                auto inputs = u->inputs();
+                if (inputs.empty())
+                    qTopoSort.push(u);
+                inDegree[u] = inputs.size();
+                for (auto v : inputs) {
+                    v = resolve(v);
+                    outOps[v].push_back(u);
+                    if (!visited[v]) {
+                        visited[v] = true;
+                        qBFS.push(v);
+                    }
+                }
+            }
+        }
+        while (!qTopoSort.empty()) {
+            auto u = qTopoSort.front(); qTopoSort.pop();
+            // Root is held back until nothing else is left
+            if (u == root) {
+                if (!qTopoSort.empty()) {
+                    qTopoSort.push(u);
+                    continue;
+                }
+                if (!outOps[u].empty())
+                    throw invalid_argument("the ops in ExecutorOptions::keep cannot read the result");
             }
+            order.push_back(u);
+            for (const auto &v : outOps[u])
+                if (--inDegree[v] == 0)
+                    qTopoSort.push(v);
+        }
+        return order;
+    }
+
+    class SimplificationProbe : public Executor {
+    public:
+        using Executor::Executor;
+    };
+
+    // Merge the duplicate pure ops of the graph of result and fold its constant subgraphs, by adding to substitutes.
+    // Returns the number of ops removed
+    size_t simplifyGraph(const OpPtr &result, const ExecutorOptions &options,
+                         unordered_map<const Operator *, OpPtr> &substitutes) {
+        const auto resolve = [&substitutes](const OpPtr &op) { return substitute(substitutes, op); };
+        const auto order = topoSort(resolve(result), options.keep, resolve);
+        // Pure ops hashed by their type and their inputs, the ones in a bucket are compared with sameAs()
+        unordered_map<size_t, vector<OpPtr>> buckets;
+        unordered_set<const Operator *> constants, readByVariable;
+        vector<OpPtr> inputs;
+        for (const auto &u : order) {
+            inputs = u->inputs();
+            for (auto &in : inputs)
+                in = resolve(in);
+            const auto isConstant = u->pure() && all_of(inputs.begin(), inputs.end(), [&](const OpPtr &in) {
+                return constants.count(in.get()) > 0;
+            });
+            if (!isConstant)
+                for (const auto &in : inputs)
+                    readByVariable.insert(in.get());
+            if (!u->pure())
+                continue;
+            auto hash = type_index(typeid(*u)).hash_code();
+            for (const auto &in : inputs)
+                hash = hash * 31 + std::hash<const Operator *>()(in.get());
+            auto &bucket = buckets[hash];
+            const auto same = find_if(bucket.begin(), bucket.end(), [&](const OpPtr &other) {
+                if (typeid(*other) != typeid(*u) || !u->sameAs(*other))
+                    return false;
+                const auto otherInputs = other->inputs();
+                return equal(inputs.begin(), inputs.end(), otherInputs.begin(), otherInputs.end(),
+                             [&](const OpPtr &a, const OpPtr &b) { return a == resolve(b); });
+            });
+            if (same != bucket.end()) {
+                substitutes[u.get()] = *same;
+                continue;
+            }
+            bucket.push_back(u);
+            if (isConstant)
+                constants.insert(u.get());
+        }
+        // Evaluate the largest constant subgraphs, those read by variable ops or from outside of the graph.
+        // Tensors have no constant op and stay evaluated
+        for (const auto &op : options.keep)
+            readByVariable.insert(resolve(op).get());
+        readByVariable.insert(resolve(result).get());
+        ExecutorOptions probeOptions;
+        probeOptions.simplify = false;
+        probeOptions.fuse = false;
+        probeOptions.parallel = false;
+        probeOptions.differentiable = false;
+        probeOptions.substitutes = options.substitutes;
+        for (const auto &u : order) {
+            if (!constants.count(u.get()) || !readByVariable.count(u.get()) || u->inputs().empty() ||
+                u->outputType() == ValueType::Tensor)
+                continue;
+            const auto probe = make_shared<SimplificationProbe>(u, probeOptions);
+            const auto &value = probe->propagate(false);
+            substitutes[u.get()] = holds_alternative<Scalar>(value) ? literal(get<Scalar>(value))
+                                                                     : constant(get<Matrix>(value));
         }
+        return order.size() - topoSort(resolve(result), options.keep, resolve).size();
     }
-    while (!qTopoSort.empty()) {
-        auto u = qTopoSort.front(); qTopoSort.pop();
-        this->order.push_back(u);
-        for (const auto &v : outOps[u])
-            if (--inDegree[v] == 0)
-                qTopoSort.push(v);
+
+    // Run the fusion pass over the graphs of result and of the ops in keep, returns the replacement of every op that
+    // has been rewritten. The ops in keep count as read from outside of the graph, so that they are never absorbed
+    unordered_map<const Operator *, OpPtr> fuseGraph(const OpPtr &result, const vector<OpPtr> &keep,
+                                                     const unordered_map<const Operator *, OpPtr> &substitutes) {
+        unordered_map<const Operator *, size_t> consumers;
+        const auto root = substitute(substitutes, result);
+        unordered_set<const Operator *> visited{ root.get() };
+        queue<OpPtr> qBFS;
+        qBFS.push(root);
+        // The ops in keep that root does not read are fused too, after it
+        vector<OpPtr> stack;
+        for (size_t r = 0; r <= keep.size(); r++) {
+            if (r > 0) {
+                const auto u = substitute(substitutes, keep[r - 1]);
+                if (!visited.insert(u.get()).second)
+                    continue;
+                qBFS.push(u);
+                stack.insert(stack.begin(), u);
+            }
+            while (!qBFS.empty()) {
+                auto u = qBFS.front(); qBFS.pop();
+                for (auto v : u->inputs()) {
+                    v = substitute(substitutes, v);
+                    consumers[v.get()]++;
+                    if (visited.insert(v.get()).second)
+                        qBFS.push(v);
+                }
+            }
+        }
+        stack.push_back(root);
+        for (const auto &op : keep)
+            consumers[substitute(substitutes, op).get()]++;
+        const FusionContext ctx(move(consumers), root.get());
+        // Top-down, so that the outermost op of a pattern gets the chance to absorb the whole of it
+        unordered_map<const Operator *, OpPtr> replaced;
+        visited.clear();
+        while (!stack.empty()) {
+            auto u = stack.back(); stack.pop_back();
+            if (!visited.insert(u.get()).second)
+                continue;
+            auto v = u;
+            while (auto r = fuse(v, ctx))
+                v = r;
+            if (v != u)
+                replaced.insert(make_pair(u.get(), v));
+            for (const auto &in : v->inputs())
+                stack.push_back(substitute(substitutes, in));
+        }
+        return replaced;
     }
 }
 
-Value createOnesFor(const Value &v) {
-    if (holds_alternative<Scalar>(v))
-        return 1;
-    if (holds_alternative<Matrix>(v)) {
-        const Matrix &mat = get<Matrix>(v);
-        return Matrix::Ones(mat.rows(), mat.cols());
+Executor::Executor(const OpPtr &result, const ExecutorOptions &options)
+    : resultOp(result), rngSeed(seededRNG()()), planMemory(options.planMemory || options.checkpoint),
+      checkpoint(options.checkpoint) {
+    unordered_map<const Operator *, OpPtr> substitutes, replaced;
+    for (const auto &[op, replacement] : options.substitutes)
+        substitutes[op.get()] = replacement;
+    if (options.simplify)
+        simplified = simplifyGraph(result, options, substitutes);
+    if (options.fuse)
+        replaced = fuseGraph(result, options.keep, substitutes);
+    const auto resolve = [&substitutes, &replaced](const OpPtr &op) {
+        return substitute(replaced, substitute(substitutes, op));
+    };
+    order = topoSort(resolve(result), options.keep, resolve);
+    // Compile the order into a flat plan, every op gets the index of its position as slot
+    for (size_t i = 0; i < order.size(); i++)
+        slots.insert(make_pair(order[i].get(), i));
+    // A rewritten op shares the slot of its replacement, the ops it absorbed have none
+    for (const auto &[op, replacement] : replaced)
+        if (const auto it = slots.find(replacement.get()); it != slots.end())
+            slots.insert(make_pair(op, it->second));
+    for (const auto &[op, replacement] : substitutes)
+        if (const auto it = slots.find(resolve(replacement).get()); it != slots.end())
+            slots.insert(make_pair(op, it->second));
+    plan.reserve(order.size());
+    for (const auto &op : order) {
+        Step step{op, op->inputs(), {}};
+        step.inputSlots.reserve(step.inputs.size());
+        for (const auto &in : step.inputs)
+            step.inputSlots.push_back(slots.at(in.get()));
+        plan.push_back(move(step));
     }
-    Cube ret;
-    for (const auto &mat : get<Cube>(v))
-        ret.push_back(Matrix::Ones(mat.rows(), mat.cols()));
-    return ret;
+    resultSlot = slots.at(result.get());
+    lastValues.resize(order.size());
+    lastGrads.resize(order.size());
+    grads.resize(order.size());
+    inputGrads.resize(order.size());
+    scratches.resize(order.size());
+    scratchKeys.resize(order.size());
+    differentiable = options.differentiable;
+    if (differentiable)
+        for (size_t i = 0; i < plan.size(); i++)
+            inputGrads[i].resize(plan[i].inputs.size());
+    hasLastGrad.assign(order.size(), false);
+    hasGrad.assign(order.size(), false);
+    fed.assign(order.size(), false);
+    rngs.resize(order.size());
+    // Wavefronts: the level of a step is the length of the longest path from a leaf to it
+    parallel = options.parallel;
+    vector<size_t> levelOf(plan.size(), 0);
+    for (size_t i = 0; i < plan.size(); i++) {
+        for (const auto in : plan[i].inputSlots)
+            levelOf[i] = std::max(levelOf[i], levelOf[in] + 1);
+        if (levelOf[i] >= levels.size())
+            levels.resize(levelOf[i] + 1);
+        levels[levelOf[i]].push_back(i);
+    }
+    contributions.resize(levels.size());
+    for (size_t l = 0; l < levels.size() && differentiable; l++) {
+        unordered_map<size_t, size_t> index;
+        auto &level = contributions[l];
+        for (auto it = levels[l].crbegin(); it != levels[l].crend(); ++it)
+            for (size_t j = 0; j < plan[*it].inputSlots.size(); j++) {
+                const auto target = plan[*it].inputSlots[j];
+                if (index.find(target) == index.end()) {
+                    index.insert(make_pair(target, level.size()));
+                    level.push_back({ target, {} });
+                }
+                level[index[target]].sources.emplace_back(*it, j);
+            }
+    }
+    // Liveness: without gradient a value is last read by its consumer of the highest level
+    valueKeys.resize(order.size());
+    pinned.assign(order.size(), false);
+    pinned[resultSlot] = true;
+    for (size_t i = 0; i < plan.size(); i++)
+        if (plan[i].inputs.empty())
+            pinned[i] = true;
+    for (const auto &op : options.keep)
+        pinned[slots.at(op.get())] = true;
+    vector<size_t> lastUse(plan.size(), 0);
+    vector<char> used(plan.size(), false);
+    for (size_t i = 0; i < plan.size(); i++)
+        for (const auto in : plan[i].inputSlots) {
+            lastUse[in] = std::max(lastUse[in], levelOf[i]);
+            used[in] = true;
+        }
+    dyingAfter.resize(levels.size());
+    for (size_t i = 0; i < plan.size(); i++)
+        if (used[i] && !pinned[i])
+            dyingAfter[lastUse[i]].push_back(i);
+    // Segments, the last one is differentiated right after the forward pass and never recomputed
+    recomputed.assign(plan.size(), false);
+    if (!checkpoint)
+        return;
+    vector<char> ends(levels.size(), false);
+    if (options.checkpoints.empty()) {
+        const auto stride = std::max<size_t>(1, static_cast<size_t>(ceil(sqrt(static_cast<double>(levels.size())))));
+        for (auto l = stride - 1; l < levels.size(); l += stride)
+            ends[l] = true;
+    } else
+        for (const auto &op : options.checkpoints)
+            ends[levelOf[slots.at(op.get())]] = true;
+    segmentBegin.resize(levels.size());
+    for (size_t l = 0; l < levels.size(); l++)
+        segmentBegin[l] = l > 0 && !ends[l - 1] ? segmentBegin[l - 1] : l;
+    for (size_t i = 0; i < plan.size(); i++) {
+        const auto segment = segmentBegin[levelOf[i]];
+        recomputed[i] = used[i] && !pinned[i] && segment != segmentBegin.back() && segmentBegin[lastUse[i]] == segment;
+    }
+    rngMarks.resize(plan.size());
 }
 
-struct InvalidValueException : exception {
-	InvalidValueException(const char *what) : exception(what) {}
+thread_local const Executor::Step *Executor::current = nullptr;
+
+// Makes a step current on this thread, restoring the previous one (an op may run an executor of its own)
+class Executor::StepScope {
+    const Step *saved;
+public:
+    explicit StepScope(const Step *step) : saved(current) { current = step; }
+    ~StepScope() { current = saved; }
+    StepScope(const StepScope &) = delete;
+    StepScope &operator =(const StepScope &) = delete;
 };
 
-// No more NaNs and Infs ... please!
-void validateValue(const Value &v) {
-	if (holds_alternative<Scalar>(v)) {
-		const Scalar vx = get<Scalar>(v);
-		if (isnan(vx))
-			throw InvalidValueException("scalar nan");
-		if (isinf(vx))
-			throw InvalidValueException("scalar inf");
-	} else if (holds_alternative<Matrix>(v)) {
-		const Matrix& vx = get<Matrix>(v);
-		if (vx.array().isNaN().count())
-			throw InvalidValueException("matrix nan");
-		if (vx.array().isInf().count())
-			throw InvalidValueException("matrix inf");
-	}
+size_t Executor::slotOf(const OpPtr &ptr) const {
+    // Ops almost always ask for their own inputs, which are resolved by a short linear scan
+    if (current != nullptr && owns(current)) {
+        const auto &inputs = current->inputs;
+        for (size_t i = 0; i < inputs.size(); i++)
+            if (inputs[i] == ptr)
+                return current->inputSlots[i];
+        if (current->op == ptr)
+            return current - plan.data();
+    }
+    return slots.at(ptr.get());
+}
+
+const Value &Executor::valueOf(const OpPtr &ptr) const {
+    const auto slot = slotOf(ptr);
+    // The ops being run read the values of their inputs and their own, which are still alive
+    if (planMemory && !pinned[slot] && (current == nullptr || !owns(current)))
+        throw logic_error("the value has been freed by memory planning, add the op to ExecutorOptions::keep");
+    return lastValues[slot];
+}
+
+const Value &Executor::gradientOf(const OpPtr &ptr) const {
+    static const Value none;
+    const auto slot = slotOf(ptr);
+    return hasGrad[slot] ? grads[slot] : none;
+}
+
+// With memory planning hasLastGrad still records which slots the gradient reached, for memoryReport()
+const Value &Executor::lastGradientOf(const OpPtr &ptr) const {
+    static const Value none;
+    const auto slot = slotOf(ptr);
+    return hasLastGrad[slot] && (!planMemory || pinned[slot]) ? lastGrads[slot] : none;
+}
+
+Value &Executor::feed(const OpPtr &input) {
+    const auto slot = slotOf(input);
+    if (!plan[slot].inputs.empty())
+        throw invalid_argument("only ops without inputs can be fed");
+    // The simplification pass may have merged or folded them
+    if (plan[slot].op->pure())
+        throw invalid_argument("literals cannot be fed, feed a constant() instead");
+    fed[slot] = true;
+    return lastValues[slot];
+}
+
+void Executor::seed(const uint64_t seed) {
+    rngSeed = seed;
+    for (size_t i = 0; i < rngs.size(); i++)
+        if (rngs[i])
+            rngs[i]->seed(mixSeed(seed, i));
+}
+
+mt19937_64 &Executor::rng() {
+    const auto slot = static_cast<size_t>(current - plan.data());
+    if (!rngs[slot])
+        rngs[slot] = make_unique<mt19937_64>(mixSeed(rngSeed, slot));
+    return *rngs[slot];
+}
+
+namespace {
+    // Fill dst with ones in the shape of v, reusing the storage of dst
+    void setOnesLike(Value &dst, const Value &v) {
+        if (holds_alternative<Scalar>(v)) {
+            scalarOf(dst) = 1;
+            return;
+        }
+        if (holds_alternative<Matrix>(v)) {
+            matrixOf(dst, get<Matrix>(v)).setOnes();
+            return;
+        }
+        if (holds_alternative<SparseMatrix>(v)) {
+            auto &ones = sparseOf(dst, get<SparseMatrix>(v).rows(), get<SparseMatrix>(v).cols());
+            ones = get<SparseMatrix>(v);
+            ones.coeffs().setOnes();
+            return;
+        }
+        tensorOf(dst, get<Tensor>(v)).setOnes();
+    }
+
+    struct InvalidValueException : runtime_error {
+		explicit InvalidValueException(const char *what) : runtime_error(what) {}
+    };
+
+    // No more NaNs and Infs ... please!
+    void validateValue(const Value &v) {
+		if (holds_alternative<Scalar>(v)) {
+			const Scalar vx = get<Scalar>(v);
+			if (isnan(vx))
+				throw InvalidValueException("scalar nan");
+			if (isinf(vx))
+				throw InvalidValueException("scalar inf");
+		} else if (holds_alternative<Matrix>(v)) {
+			const Matrix& vx = get<Matrix>(v);
+			if (vx.array().isNaN().count())
+				throw InvalidValueException("matrix nan");
+			if (vx.array().isInf().count())
+				throw InvalidValueException("matrix inf");
+		}
+    }
+}
+
+void Executor::accumulateGradient(const OpPtr &ptr, const Value &grad) {
+    const auto slot = slotOf(ptr);
+    if (hasGrad[slot])
+        accumulate(grads[slot], grad);
+    else {
+        grads[slot] = grad;
+        hasGrad[slot] = true;
+    }
+}
+
+void Executor::beginPass() {
+    pool.trim();
+    liveBytes = 0;
+    for (size_t i = 0; i < plan.size(); i++) {
+        liveBytes += BufferPool::bytesOf(lastValues[i]) + BufferPool::bytesOf(lastGrads[i]) +
+                     BufferPool::bytesOf(grads[i]);
+        for (const auto &g : inputGrads[i])
+            liveBytes += BufferPool::bytesOf(g);
+        liveBytes += scratchBytes(i);
+    }
+    peakBytes = 0;
+    updatePeak();
+}
+
+void Executor::release(Value &buffer) {
+    liveBytes -= BufferPool::bytesOf(buffer);
+    pool.give(buffer);
+}
+
+size_t Executor::scratchBytes(const size_t i) const {
+    size_t ret = 0;
+    for (const auto &buffer : scratches[i])
+        ret += BufferPool::bytesOf(buffer);
+    return ret;
+}
+
+// Scratch buffers only carry state from the eval of a step to its diff
+void Executor::releaseScratch(const size_t i) {
+    for (auto &buffer : scratches[i])
+        release(buffer);
+}
+
+// With memory planning, the buffers of a level (values and scratches) are taken from the pool and accounted
+// for serially around the parallel loop: liveBytes drops by what they held before and grows by what they hold after
+void Executor::evalLevel(const shared_ptr<Executor> &self, const size_t l, const bool markRngs, const bool recompute) {
+    const auto &level = levels[l];
+    const auto size = static_cast<ptrdiff_t>(level.size());
+    if (planMemory)
+        for (const auto i : level) {
+            if (recompute && !recomputed[i])
+                continue;
+            liveBytes -= BufferPool::bytesOf(lastValues[i]);
+            if (!fed[i] && BufferPool::keyOf(lastValues[i]).second == 0)
+                pool.take(valueKeys[i], lastValues[i]);
+            auto &buffers = scratches[i];
+            liveBytes -= scratchBytes(i);
+            for (size_t j = 0; j < scratchKeys[i].size(); j++)
+                if (BufferPool::keyOf(buffers[j]).second == 0)
+                    pool.take(scratchKeys[i][j], buffers[j]);
+        }
+    // Exceptions cannot leave a parallel region, the first one thrown by a step is rethrown after it
+    exception_ptr error;
+    #pragma omp parallel for schedule(dynamic) if(parallel && size > 1)
+    for (ptrdiff_t k = 0; k < size; k++) try {
+        const auto i = level[k];
+        if (recompute && !recomputed[i])
+            continue;
+        // Rewind the random stream to where the forward eval started
+        if (recompute) {
+            if (rngMarks[i])
+                *rngs[i] = *rngMarks[i];
+            else
+                rngs[i].reset();
+        } else if (markRngs && recomputed[i]) {
+            if (!rngs[i])
+                rngMarks[i].reset();
+            else if (rngMarks[i])
+                *rngMarks[i] = *rngs[i];
+            else
+                rngMarks[i] = make_unique<mt19937_64>(*rngs[i]);
+        }
+        if (!fed[i])
+            evalStep(self, i, recompute ? Profiler::Phase::Recompute : Profiler::Phase::Forward);
+        valueKeys[i] = BufferPool::keyOf(lastValues[i]);
+        scratchKeys[i].resize(scratches[i].size());
+        for (size_t j = 0; j < scratches[i].size(); j++)
+            scratchKeys[i][j] = BufferPool::keyOf(scratches[i][j]);
+    } catch (...) {
+        #pragma omp critical(autogradExecutorError)
+        if (!error)
+            error = current_exception();
+    }
+    if (error)
+        rethrow_exception(error);
+    if (!planMemory)
+        return;
+    for (const auto i : level)
+        if (!recompute || recomputed[i])
+            liveBytes += BufferPool::bytesOf(lastValues[i]) + scratchBytes(i);
+    updatePeak();
+}
+
+void Executor::setProfiler(shared_ptr<Profiler> profiler) {
+    this->profiler = move(profiler);
+    profiled.assign(this->profiler ? 3 * plan.size() : 0, {});
+    stepNames.clear();
+    if (this->profiler)
+        for (const auto &step : plan)
+            stepNames.push_back(typeNameOf(*step.op));
+}
+
+// Without a profiler a step costs one test more
+void Executor::evalStep(const shared_ptr<Executor> &self, const size_t i, const Profiler::Phase phase) {
+    StepScope scope(&plan[i]);
+    if (!profiler) {
+        plan[i].op->evalInto(self, lastValues[i]);
+        return;
+    }
+    auto &event = profiled[3 * i + static_cast<size_t>(phase)];
+    const auto key = BufferPool::keyOf(lastValues[i]);
+    event.start = Profiler::Clock::now();
+    plan[i].op->evalInto(self, lastValues[i]);
+    event.end = Profiler::Clock::now();
+    event.name = stepNames[i];
+    event.phase = phase;
+    event.thread = this_thread::get_id();
+    event.bytes = BufferPool::keyOf(lastValues[i]) != key ? BufferPool::bytesOf(lastValues[i]) : 0;
+    vector<const Value *> inputs;
+    for (const auto in : plan[i].inputSlots)
+        inputs.push_back(&lastValues[in]);
+    event.flops = plan[i].op->flops(inputs, lastValues[i]);
+}
+
+void Executor::diffStep(const shared_ptr<Executor> &self, const size_t i) {
+    StepScope scope(&plan[i]);
+    if (!profiler) {
+        plan[i].op->diffInto(self, lastGrads[i], inputGrads[i]);
+        return;
+    }
+    auto &event = profiled[3 * i + static_cast<size_t>(Profiler::Phase::Backward)];
+    auto &out = inputGrads[i];
+    vector<BufferPool::Key> keys;
+    for (const auto &g : out)
+        keys.push_back(BufferPool::keyOf(g));
+    event.start = Profiler::Clock::now();
+    plan[i].op->diffInto(self, lastGrads[i], out);
+    event.end = Profiler::Clock::now();
+    event.name = stepNames[i];
+    event.phase = Profiler::Phase::Backward;
+    event.thread = this_thread::get_id();
+    event.bytes = 0;
+    for (size_t j = 0; j < out.size(); j++)
+        if (BufferPool::keyOf(out[j]) != keys[j])
+            event.bytes += BufferPool::bytesOf(out[j]);
+    vector<const Value *> inputs;
+    for (const auto in : plan[i].inputSlots)
+        inputs.push_back(&lastValues[in]);
+    event.flops = 2 * plan[i].op->flops(inputs, lastValues[i]);
+}
+
+void Executor::endPass() {
+    if (!profiler)
+        return;
+    profiler->record(profiled);
+    for (auto &event : profiled)
+        event.name.clear();
 }
 
 const Value &Executor::propagate(const bool withGradient) {
-    for (const auto &v : order)
-        lastValues[v] = v->eval(shared_from_this());
-	// for (const auto& v : order)
-	// 	validateValue(lastValues[v]);
-    lastGrads.clear();
-	if (!withGradient)
-		return lastValues[resultOp];
-    lastGrads[resultOp] = createOnesFor(valueOf(resultOp));
-    for (auto itOrder = order.crbegin(); itOrder != order.crend(); ++itOrder) {
-        const auto &curOp = *itOrder;
-        auto inputs = curOp->inputs();
-        auto gradInputs = curOp->diff(shared_from_this(), lastGrads[curOp]);
-        for (size_t i = 0; i < inputs.size(); i++) {
-            const auto &inputOp = inputs[i];
-            const auto &gradInput = gradInputs[i];
-			// validateValue(gradInput);
-            if (auto itGrad = lastGrads.find(inputOp); itGrad != lastGrads.end()) {
-                if (holds_alternative<Scalar>(gradInput))
-                    itGrad->second = get<Scalar>(itGrad->second) + get<Scalar>(gradInput);
-                else if (holds_alternative<Matrix>(gradInput))
-                    itGrad->second = get<Matrix>(itGrad->second) + get<Matrix>(gradInput);
-                else {
-                    const auto &cube = get<Cube>(gradInput);
-                    auto &g = get<Cube>(itGrad->second);
-                    for (size_t j = 0; j < cube.size(); j++)
-                        g[j] += cube[j];
+    if (withGradient && !differentiable)
+        throw logic_error("the executor has been built without gradient");
+    const auto self = shared_from_this();
+    lastWithGradient = withGradient;
+    if (planMemory)
+        beginPass();
+    for (size_t l = 0; l < levels.size(); l++) {
+        evalLevel(self, l, withGradient && checkpoint, false);
+        if (planMemory && !withGradient) {
+            for (const auto i : dyingAfter[l])
+                release(lastValues[i]);
+            for (const auto i : levels[l])
+                releaseScratch(i);
+        } else if (checkpoint) {
+            for (const auto i : dyingAfter[l])
+                if (recomputed[i])
+                    release(lastValues[i]);
+            // Evaluated again before their diff
+            for (const auto i : levels[l])
+                if (recomputed[i])
+                    releaseScratch(i);
+        }
+    }
+	// for (const auto& v : lastValues)
+	// 	validateValue(v);
+    hasLastGrad.assign(hasLastGrad.size(), false);
+	if (!withGradient) {
+		endPass();
+		return lastValues[resultSlot];
+	}
+    if (planMemory)
+        liveBytes -= BufferPool::bytesOf(lastGrads[resultSlot]);
+    setOnesLike(lastGrads[resultSlot], lastValues[resultSlot]);
+    if (planMemory)
+        liveBytes += BufferPool::bytesOf(lastGrads[resultSlot]);
+    hasLastGrad[resultSlot] = true;
+    for (size_t l = levels.size(); l-- > 0; ) {
+        // Entering a segment dropped after the forward pass, its values are read by its own diffs only
+        if (checkpoint && segmentBegin[l] != segmentBegin.back() && segmentBegin[l + 1] != segmentBegin[l])
+            for (auto m = segmentBegin[l]; m <= l; m++)
+                evalLevel(self, m, false, true);
+        const auto &level = levels[l];
+        const auto size = static_cast<ptrdiff_t>(level.size());
+        // Sparse gradients stop at the ops without inputs, the others read dense ones
+        for (const auto i : level)
+            if (hasLastGrad[i] && !plan[i].inputs.empty() && holds_alternative<SparseColumns>(lastGrads[i])) {
+                liveBytes -= BufferPool::bytesOf(lastGrads[i]);
+                lastGrads[i] = get<SparseColumns>(lastGrads[i]).dense();
+                liveBytes += BufferPool::bytesOf(lastGrads[i]);
+            }
+        // The gradient of an input has the shape of its value
+        if (planMemory)
+            for (const auto i : level)
+                for (size_t j = 0; j < inputGrads[i].size(); j++) {
+                    auto &g = inputGrads[i][j];
+                    liveBytes -= BufferPool::bytesOf(g);
+                    if (hasLastGrad[i] && BufferPool::keyOf(g).second == 0)
+                        pool.take(valueKeys[plan[i].inputSlots[j]], g);
+                }
+        exception_ptr error;
+        #pragma omp parallel for schedule(dynamic) if(parallel && size > 1)
+        for (ptrdiff_t k = 0; k < size; k++) try {
+            const auto i = level[k];
+            if (!hasLastGrad[i] || plan[i].inputs.empty())
+                continue;
+            diffStep(self, i);
+        } catch (...) {
+            #pragma omp critical(autogradExecutorError)
+            if (!error)
+                error = current_exception();
+        }
+        if (error)
+            rethrow_exception(error);
+        if (planMemory) {
+            for (const auto i : level)
+                for (const auto &g : inputGrads[i])
+                    liveBytes += BufferPool::bytesOf(g);
+            updatePeak();
+        }
+        // Every target is owned by one thread and summed in a fixed order, so the result
+        // does not depend on the number of threads
+        const auto &targets = contributions[l];
+        const auto nTargets = static_cast<ptrdiff_t>(targets.size());
+        // Sparse gradients grow as they accumulate, by these many bytes per target
+        vector<ptrdiff_t> grown(planMemory ? targets.size() : 0);
+        #pragma omp parallel for schedule(dynamic) if(parallel && nTargets > 1)
+        for (ptrdiff_t k = 0; k < nTargets; k++) {
+            const auto slot = targets[k].target;
+            for (const auto &[i, j] : targets[k].sources) {
+                if (!hasLastGrad[i])
+                    continue;
+			    // validateValue(inputGrads[i][j]);
+                if (hasLastGrad[slot]) {
+                    const auto before = planMemory ? BufferPool::bytesOf(lastGrads[slot]) : 0;
+                    accumulate(lastGrads[slot], inputGrads[i][j]);
+                    if (planMemory)
+                        grown[k] += static_cast<ptrdiff_t>(BufferPool::bytesOf(lastGrads[slot]) - before);
+                } else {
+                    // Hand the buffer over, inputGrads[i][j] gets the old one to be overwritten next time
+                    swapValues(lastGrads[slot], inputGrads[i][j]);
+                    hasLastGrad[slot] = true;
                 }
-			} else
-				lastGrads.insert(make_pair(inputOp, gradInput));
-        }
-    }
-	for (const auto &[op, grad] : lastGrads) {
-		if (auto it = grads.find(op); it != grads.end()) {
-			// TODO: Value accumulation seems to be commonly used, write a function 
-			if (holds_alternative<Scalar>(grad))
-				it->second = get<Scalar>(it->second) + get<Scalar>(grad);
-			else if (holds_alternative<Matrix>(grad))
-				it->second = get<Matrix>(it->second) + get<Matrix>(grad);
-			else {
-				const auto &cube = get<Cube>(grad);
-				auto& g = get<Cube>(it->second);
-				for (size_t i = 0; i < cube.size(); i++)
-					g[i] += cube[i];
-			}
-		} else
-			grads.insert(make_pair(op, grad));
+            }
+        }
+        for (const auto bytes : grown)
+            liveBytes += static_cast<size_t>(bytes);
+        // The level has been differentiated: its own values and gradients are read no more, and the
+        // gradients it produced have been handed over to their targets
+        if (planMemory)
+            for (const auto i : level) {
+                for (auto &g : inputGrads[i])
+                    release(g);
+                releaseScratch(i);
+                if (!pinned[i]) {
+                    release(lastValues[i]);
+                    release(lastGrads[i]);
+                }
+            }
+    }
+	for (size_t i = 0; i < plan.size(); i++) {
+		if (!hasLastGrad[i] || (planMemory && !pinned[i]))
+			continue;
+		if (planMemory)
+			liveBytes -= BufferPool::bytesOf(grads[i]);
+		if (hasGrad[i])
+			accumulate(grads[i], lastGrads[i]);
+		else {
+			grads[i] = lastGrads[i];
+			hasGrad[i] = true;
+		}
+		if (planMemory)
+			liveBytes += BufferPool::bytesOf(grads[i]);
 	}
-    return lastValues[resultOp];
+	if (planMemory)
+		updatePeak();
+    endPass();
+    return lastValues[resultSlot];
+}
+
+MemoryReport Executor::memoryReport() const {
+    MemoryReport ret;
+    // Every value and scratch buffer, and for a pass with gradient the last and accumulated gradients of the
+    // slots it reached and the gradients of the inputs of the steps differentiated
+    for (size_t i = 0; i < plan.size(); i++) {
+        ret.unplannedBytes += BufferPool::bytesOf(valueKeys[i]);
+        for (const auto &key : scratchKeys[i])
+            ret.unplannedBytes += BufferPool::bytesOf(key);
+        if (!lastWithGradient || !hasLastGrad[i])
+            continue;
+        ret.unplannedBytes += 2 * BufferPool::bytesOf(valueKeys[i]);
+        for (const auto in : plan[i].inputSlots)
+            ret.unplannedBytes += BufferPool::bytesOf(valueKeys[in]);
+    }
+    ret.peakBytes = planMemory ? peakBytes : ret.unplannedBytes;
+    return ret;
+}
+
+ostream &autograd::operator <<(ostream &out, const MemoryReport &report) {
+    return out << "peak " << report.peakBytes << " bytes (" << report.unplannedBytes << " bytes unplanned)";
 }
 
 string Executor::graph() const {
 	stringstream ss;
-	unordered_map<OpPtr, size_t> ids;
-	auto nextId = 1;
 	ss << "digraph g {" << endl;
-	for (const auto &op : topoOrder()) {
-		ss << "  " << nextId << "[label=\"" << typeid(*op).name() << "\"];" << endl;
-		ids.insert(make_pair(op, nextId++));
-	}
-	for (const auto& op : topoOrder())
-		for (const auto& in : op->inputs())
-			ss << "  " << ids[in] << "->" << ids[op] << ";" << endl;
+	for (size_t i = 0; i < plan.size(); i++)
+		ss << "  " << i + 1 << "[label=\"" << typeNameOf(*plan[i].op) << "\"];" << endl;
+	for (size_t i = 0; i < plan.size(); i++)
+		for (const auto in : plan[i].inputSlots)
+			ss << "  " << in + 1 << "->" << i + 1 << ";" << endl;
 	ss << "}";
 	return ss.str();
 }
@@ -7,29 +7,190 @@
 
 #include <unordered_map>
 #include <string>
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <iosfwd>
 #include "Operator.h"
 #include "Value.h"
+#include "BufferPool.h"
+#include "Profiler.h"
 
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    struct ExecutorOptions {
+        // Merge the duplicates among the pure ops of the graph (see Operator::pure()) and evaluate the ones reading
+        // only literals (see ScalarLiteralOp) once, before fusion. simplifiedOps() tells how many ops this removed
+        bool simplify = true;
+        // Rewrite common patterns (dense layers, the cross-entropy loss, chains of matrix-scalar ops)
+        // into the fused ops of FusedOps.h when compiling the plan. The values of the ops absorbed
+        // this way can no longer be queried with valueOf()
+        bool fuse = true;
+        // Evaluate and differentiate independent ops of the same wavefront concurrently (OpenMP)
+        bool parallel = true;
+        // Free the buffer of every value as soon as no later step of the pass reads it, and the gradient
+        // buffers once they have been propagated, into a pool later steps take their buffers from. Without
+        // gradient a value dies after its last consumer, with gradient after its own diff. Only the values and
+        // the gradients of the result, of the ops without inputs and of the ops in keep can be queried after
+        // propagate() then
+        bool planMemory = false;
+        // Also evaluated when the result does not read them, e.g. the state an unrolled graph carries over (see
+        // Recurrent.h), without gradient then. They cannot read the result
+        std::vector<OpPtr> keep;
+        // Gradient checkpointing, implies planMemory. The levels of the plan are cut into segments and only the
+        // values read across the end of a segment survive the forward pass, the others are recomputed a segment
+        // at a time when the backward pass reaches them, along with the scratch buffers of their ops. Stochastic
+        // ops draw the same numbers again
+        bool checkpoint = false;
+        // Segments end with the level of these ops, every sqrt(depth) levels if empty
+        std::vector<OpPtr> checkpoints;
+        // (op, replacement) pairs, the plan evaluates the replacement wherever the op is read. Applied before fusion,
+        // the inputs of a replacement are substituted in turn and the graph below the op is dropped
+        std::vector<std::pair<OpPtr, OpPtr>> substitutes;
+        // Without, propagate() can only evaluate: no gradient buffers or contributions are set up
+        bool differentiable = true;
+    };
+
+    // Bytes held by the values, the gradients and the scratch buffers of an executor
+    struct MemoryReport {
+        // At the fullest point of the last propagate(), pooled buffers included
+        size_t peakBytes = 0;
+        // Kept for the whole of the same pass, as without ExecutorOptions::planMemory
+        size_t unplannedBytes = 0;
+    };
+    std::ostream &operator <<(std::ostream &out, const MemoryReport &report);
+
     class Executor : public std::enable_shared_from_this<Executor> {
     protected:
 	    virtual ~Executor() = default;
     private:
+        // One step of the compiled plan, inputs are resolved to slots once in the constructor
+        // so that propagate() never has to hash an OpPtr
+        struct Step {
+            OpPtr op;
+            std::vector<OpPtr> inputs;
+            std::vector<size_t> inputSlots;
+        };
         std::vector<OpPtr> order;
+        std::vector<Step> plan;
         OpPtr resultOp;
-        std::unordered_map<OpPtr, Value> lastValues;
-        std::unordered_map<OpPtr, Value> lastGrads;
-		std::unordered_map<OpPtr, Value> grads;
+        // Slot of every op in the plan, only used by the OpPtr based public interface
+        std::unordered_map<const Operator *, size_t> slots;
+        size_t resultSlot;
+        // Gradients flowing into one slot from the steps of one level, in a fixed order
+        struct Contribution {
+            size_t target;
+            std::vector<std::pair<size_t, size_t>> sources; // (step, index of the input)
+        };
+        // Steps grouped by their distance from the leaves, a level only depends on the ones before it
+        std::vector<std::vector<size_t>> levels;
+        std::vector<std::vector<Contribution>> contributions;
+        bool parallel;
+        bool differentiable;
+        size_t simplified = 0;
+        // The step being evaluated / differentiated by this thread, lets valueOf() resolve inputs without hashing
+        static thread_local const Step *current;
+        class StepScope;
+        bool owns(const Step *step) const { return step >= plan.data() && step < plan.data() + plan.size(); }
+        std::vector<Value> lastValues;
+        std::vector<Value> lastGrads;
+		std::vector<Value> grads;
+        // Per-step buffers handed to diffInto(), kept across propagate() calls
+        std::vector<std::vector<Value>> inputGrads;
+        std::vector<std::vector<Value>> scratches;
+        // Shape of every scratch buffer after the last eval of its step, see valueKeys
+        std::vector<std::vector<BufferPool::Key>> scratchKeys;
+        // Not vector<bool>, different slots are written from different threads
+        std::vector<char> hasLastGrad, hasGrad;
+        // Input slots whose value is fed from outside and not evaluated, see feed()
+        std::vector<char> fed;
+        // Random stream of every step, created on first use from rngSeed and the slot
+        std::vector<std::unique_ptr<std::mt19937_64>> rngs;
+        std::uint64_t rngSeed;
+        // Memory planning, see ExecutorOptions::planMemory
+        bool planMemory;
+        // Slots whose value and gradient outlive the pass
+        std::vector<char> pinned;
+        // The slots whose value dies with each level in passes without gradient
+        std::vector<std::vector<size_t>> dyingAfter;
+        // Shape of the value of every slot in the last pass, to pick its buffer from the pool
+        std::vector<BufferPool::Key> valueKeys;
+        BufferPool pool;
+        // Bytes held outside of the pool while planning, and the most held during the last pass
+        size_t liveBytes = 0, peakBytes = 0;
+        bool lastWithGradient = false;
+        // Checkpointing, see ExecutorOptions::checkpoint
+        bool checkpoint;
+        // Slots dropped after the forward pass and recomputed
+        std::vector<char> recomputed;
+        // First level of the segment of every level
+        std::vector<size_t> segmentBegin;
+        // State of the random stream of every recomputed step before its forward eval, null if it had none yet
+        std::vector<std::unique_ptr<std::mt19937_64>> rngMarks;
+        // Events of the pass being profiled, three per slot (one per Profiler::Phase)
+        std::shared_ptr<Profiler> profiler;
+        std::vector<Profiler::Event> profiled;
+        // Registered name of the op of every step, looked up once by setProfiler()
+        std::vector<std::string> stepNames;
+        void beginPass();
+        void evalStep(const std::shared_ptr<Executor> &self, size_t i, Profiler::Phase phase);
+        void diffStep(const std::shared_ptr<Executor> &self, size_t i);
+        void endPass();
+        // Evaluates a level, or only its recomputed steps
+        void evalLevel(const std::shared_ptr<Executor> &self, size_t l, bool markRngs, bool recompute);
+        void release(Value &buffer);
+        size_t scratchBytes(size_t i) const;
+        void releaseScratch(size_t i);
+        void updatePeak() { peakBytes = std::max(peakBytes, liveBytes + pool.bytes()); }
+    protected:
+        // Slot-based access for subclasses resolving their ops once, see Optimizer
+        const Value *gradientAt(const size_t slot) const { return hasGrad[slot] ? &grads[slot] : nullptr; }
     public:
-        explicit Executor(const OpPtr &result);
-		void clearGradient() { grads.clear(); }
+        explicit Executor(const OpPtr &result, const ExecutorOptions &options = {});
+		void clearGradient() { hasGrad.assign(hasGrad.size(), false); }
         const std::vector<OpPtr> &topoOrder() const { return order; }
-        const Value &valueOf(const OpPtr &ptr) { return lastValues[ptr]; }
-        const Value &gradientOf(const OpPtr &ptr) { return grads[ptr]; }
-		const Value &lastGradientOf(const OpPtr &ptr) { return lastGrads[ptr]; }
+        // The compiled plan: slot i evaluates topoOrder()[i] from the values of these slots, with substitutions,
+        // simplification and fusion applied. The result comes last. slotOf() gives the slot evaluating an op
+        const std::vector<size_t> &inputSlotsOf(const size_t slot) const { return plan[slot].inputSlots; }
+        size_t slotOf(const OpPtr &ptr) const;
+        const Value &valueOf(const OpPtr &ptr) const;
+        const Value &gradientOf(const OpPtr &ptr) const;
+		const Value &lastGradientOf(const OpPtr &ptr) const;
         const Value &propagate(bool withGradient = true);
+        const OpPtr &result() const { return resultOp; }
+        // Overrides the value of an input op (one without inputs) for this executor only: propagate() stops
+        // evaluating it and reads whatever is written to the returned buffer instead. This way several
+        // executors can share a graph, and so its parameters, while running on different inputs
+        Value &feed(const OpPtr &input);
+        void feed(const OpPtr &input, const Value &value) { feed(input) = value; }
+        // Adds grad to the accumulated gradient of ptr, as if it came from a propagate() call
+        void accumulateGradient(const OpPtr &ptr, const Value &grad);
+        // Restarts the random streams of the ops, each op of the plan draws from a stream of its own
+        // so that the draws do not depend on the order in which the ops run
+        void seed(std::uint64_t seed);
 		std::string graph() const;
+        size_t simplifiedOps() const { return simplified; }
+        MemoryReport memoryReport() const;
+        // Records every step of the following propagate() calls into profiler, nullptr stops. Profilers can be
+        // shared between executors
+        void setProfiler(std::shared_ptr<Profiler> profiler);
+        // A buffer private to the op being evaluated or differentiated, kept across propagate() calls,
+        // ops can stash results of eval() here for diff() to reuse. With planMemory it goes back to the pool
+        // once the step has been differentiated, or after its eval when no diff follows
+        Value &scratch() { return scratch(1)[0]; }
+        // At least n such buffers, for ops that keep several intermediates
+        std::vector<Value> &scratch(const size_t n) {
+            auto &buffers = scratches[current - plan.data()];
+            if (buffers.size() < n)
+                buffers.resize(n);
+            return buffers;
+        }
+        // The value of the op being differentiated, as computed by its last eval
+        const Value &output() const { return lastValues[current - plan.data()]; }
+        // The random stream of the op being evaluated
+        std::mt19937_64 &rng();
     };
 }
+}
 
 #endif //AUTOGRADIENT_EXECUTOR_H
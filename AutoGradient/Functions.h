@@ -7,6 +7,13 @@
 #include "BasicOps.h"
 
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+	// A function object provides the scalar operator() and d() (its derivative), and optionally
+	// array kernels that FunctionBroadcastOp uses instead of calling those per coefficient:
+	//   forward(x, y, cache): y = f(x), cache may keep whatever backward() wants to reuse
+	//   backward(x, y, cache, grad, ret): ret = f'(x) * grad, given y and cache from forward()
+	// y and ret come sized like x. Kernels must be coefficient-wise, outputs are allowed to alias inputs
+
 	// Ahh! operator() cannot be non-member, so CRTP trick no longer works
 	// This macro makes custom function callable by OpPtr arguments
 #define FUNCTION_CALL_OVERLOAD(name) \
@@ -22,12 +29,20 @@ namespace autograd {
 		FUNCTION_CALL_OVERLOAD(SinFunction)
 		Scalar operator ()(const Scalar x) const { return std::sin(x); }
 		Scalar d(const Scalar x) const { return std::cos(x); }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const { y.array() = x.array().sin(); }
+		void backward(const Matrix &x, const Matrix &, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = x.array().cos() * grad.array();
+		}
 	} sin;
 
 	inline struct CosFunction {
 		FUNCTION_CALL_OVERLOAD(CosFunction)
 		Scalar operator ()(const Scalar x) const { return std::cos(x); }
 		Scalar d(const Scalar x) const { return -std::sin(x); }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const { y.array() = x.array().cos(); }
+		void backward(const Matrix &x, const Matrix &, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = -x.array().sin() * grad.array();
+		}
 	} cos;
 
 	inline struct LogFunction {
@@ -35,30 +50,52 @@ namespace autograd {
 		FUNCTION_CALL_OVERLOAD(LogFunction)
 		Scalar operator ()(const Scalar x) const { return std::log(x + EPSILON); }
 		Scalar d(const Scalar x) const { return 1 / (x + EPSILON); }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const { y.array() = (x.array() + EPSILON).log(); }
+		void backward(const Matrix &x, const Matrix &, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = grad.array() / (x.array() + EPSILON);
+		}
 	} log;
 
 	inline struct ExpFunction {
 		FUNCTION_CALL_OVERLOAD(ExpFunction)
 		Scalar operator ()(const Scalar x) const { return std::exp(x); }
 		Scalar d(const Scalar x) const { return std::exp(x); }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const { y.array() = x.array().exp(); }
+		void backward(const Matrix &, const Matrix &y, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = y.array() * grad.array();
+		}
 	} exp;
 
 	inline struct TanhFunction {
 		FUNCTION_CALL_OVERLOAD(TanhFunction)
 		Scalar operator ()(const Scalar x) const { return std::tanh(x); }
 		Scalar d(const Scalar x) const { return 1 - std::tanh(x) * std::tanh(x); }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const { y.array() = x.array().tanh(); }
+		void backward(const Matrix &, const Matrix &y, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = (1 - y.array().square()) * grad.array();
+		}
 	} tanh;
 
 	inline struct SigmoidFunction {
 		FUNCTION_CALL_OVERLOAD(SigmoidFunction)
 		Scalar operator ()(const Scalar x) const { return 1 / (1 + std::exp(-x)); }
 		Scalar d(const Scalar x) const { return (*this)(x) * (1 - (*this)(x)); }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const { y.array() = 1 / (1 + (-x.array()).exp()); }
+		void backward(const Matrix &, const Matrix &y, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = y.array() * (1 - y.array()) * grad.array();
+		}
 	} sigmoid;
 
 	inline struct LReLUFunction {
 		FUNCTION_CALL_OVERLOAD(LReLUFunction)
 		Scalar operator ()(const Scalar x) const { return x > 0 ? x : 0.01 * x; }
 		Scalar d(const Scalar x) const { return x > 0 ? 1 : 0.01; }
+		void forward(const Matrix &x, Matrix &y, Matrix &) const {
+			y.array() = (x.array() > 0).select(x.array(), static_cast<Scalar>(0.01) * x.array());
+		}
+		void backward(const Matrix &x, const Matrix &, const Matrix &, const Matrix &grad, Matrix &ret) const {
+			ret.array() = (x.array() > 0).select(grad.array(), static_cast<Scalar>(0.01) * grad.array());
+		}
 	} lrelu;
 
 	inline struct MishFunction {
@@ -70,7 +107,24 @@ namespace autograd {
 			const Scalar c = std::tanh(b);
 			return c + x * a / (a + 1) * (1 - c * c);
 		}
+		// cache = tanh(softplus(x)) = n / (n + 2) with n = e^x (e^x + 2), one exp instead of exp, log and tanh
+		// Beyond x = 20 it is 1 to working precision, clamping there keeps e^x from overflowing
+		void forward(const Matrix &x, Matrix &y, Matrix &cache) const {
+			cache = x.array().min(static_cast<Scalar>(20)).exp().matrix();
+			cache.array() *= cache.array() + 2;
+			cache.array() /= cache.array() + 2;
+			y.array() = x.array() * cache.array();
+		}
+		// e^x / (e^x + 1) is the sigmoid, written so that it cannot produce inf / inf
+		void backward(const Matrix &x, const Matrix &, const Matrix &cache, const Matrix &grad, Matrix &ret) const {
+			const auto c = cache.array();
+			ret.array() = (c + x.array() / (1 + (-x.array()).exp()) * (1 - c.square())) * grad.array();
+		}
 	} mish;
 }
+}
+
+// The fused ops need the functions above, and FunctionBroadcastOp::fuse is defined there
+#include "FusedOps.h"
 
 #endif
\ No newline at end of file
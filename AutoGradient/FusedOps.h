@@ -0,0 +1,202 @@
+#ifndef AUTOGRADIENT_FUSEDOPS_H
+#define AUTOGRADIENT_FUSEDOPS_H
+
+#include <type_traits>
+#include "BasicOps.h"
+#include "AdvancedOps.h"
+#include "Functions.h"
+#include "Fusion.h"
+
+// Ops created by the fusion pass (see Fusion.h), each one replaces a small subgraph and computes
+// exactly the same values with fewer temporaries. They are not meant to be built by hand
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+	// f(w * x + b), or just w * x + b for F = void
+	// The pre-activation and the cache of the function kernels are kept in the scratch buffer of the executor
+	template <typename F>
+	class DenseOp : public Operator {
+		OpPtr w, x, b;
+		const F *f;
+	public:
+		DenseOp(OpPtr w, OpPtr x, OpPtr b, const F *f = nullptr)
+			: w(std::move(w)), x(std::move(x)), b(std::move(b)), f(f) {}
+		OVERRIDE_INPUTS { return { w, x, b }; }
+		OVERRIDE_OUTPUT { return ValueType::Matrix; }
+		void save(GraphWriter &out) const override { out.writeFunction(f); }
+		// The product, the bias and the function
+		OVERRIDE_FLOPS { return (2.0 * std::get<Matrix>(*inputs[0]).cols() + 2) * sizeOf(output); }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vw = std::get<Matrix>(V(w)), &vx = std::get<Matrix>(V(x)), &vb = std::get<Matrix>(V(b));
+			Matrix &z = matrixOf(std::is_void_v<F> ? out : env->scratch(2)[0], vw.rows(), vx.cols());
+			z.noalias() = vw * vx;
+			// Same broadcasting rules as MatrixSumOp
+			MatrixSumOp::checkBroadcast(z, vb);
+			if (vb.cols() == z.cols())
+				z += vb;
+			else if (vb.cols() == 1)
+				z.colwise() += vb.col(0);
+			else
+				z = (vb.colwise() + z.col(0)).eval();
+			if constexpr (!std::is_void_v<F>)
+				FunctionBroadcastOp<F>::apply(*f, z, matrixOf(out, z), FunctionBroadcastOp<F>::cacheOf(env->scratch(2)[1]));
+		}
+		OVERRIDE_DIFF_INTO {
+			const Matrix &vw = std::get<Matrix>(V(w)), &vx = std::get<Matrix>(V(x)), &vb = std::get<Matrix>(V(b));
+			const Matrix *gz = &std::get<Matrix>(outputGrad);
+			if constexpr (!std::is_void_v<F>) {
+				// The pre-activation is no longer needed, overwrite it with its gradient
+				auto &scratch = env->scratch(2);
+				Matrix &z = std::get<Matrix>(scratch[0]);
+				FunctionBroadcastOp<F>::applyDiff(*f, z, std::get<Matrix>(env->output()), std::get<Matrix>(scratch[1]), *gz, z);
+				gz = &z;
+			}
+			// w * x itself has been broadcast if it is a single column and b is not
+			Matrix reduced;
+			const Matrix *wxGrad = gz;
+			if (gz->cols() != vx.cols()) {
+				reduced = gz->rowwise().sum();
+				wxGrad = &reduced;
+			}
+			MatrixSumOp::reduceBroadcast(inputGrads[2], vb, *gz);
+			matrixOf(inputGrads[0], vw).noalias() = *wxGrad * vx.transpose();
+			matrixOf(inputGrads[1], vx).noalias() = vw.transpose() * *wxGrad;
+		}
+	};
+
+	template <typename F>
+	OpPtr FunctionBroadcastOp<F>::fuse(const FusionContext &ctx) const {
+		const auto sum = std::dynamic_pointer_cast<MatrixSumOp>(x);
+		if (!sum || !ctx.absorbable(x))
+			return nullptr;
+		const auto terms = sum->inputs();
+		for (size_t i = 0; i < 2; i++) {
+			if (!std::dynamic_pointer_cast<MatrixProductOp>(terms[i]) || !ctx.absorbable(terms[i]))
+				continue;
+			const auto factors = terms[i]->inputs();
+			return std::static_pointer_cast<Operator>(
+				std::make_shared<DenseOp<F>>(factors[0], factors[1], terms[1 - i], &f));
+		}
+		return nullptr;
+	}
+
+	// -dot(y, log(yHat)) - dot(a - y, log(b - yHat)), a and b are usually the constant 1
+	// Scratch holds log(yHat), log(b - yHat), b - yHat and the caches of the two log kernels
+	class FusedCrossEntropyOp : public Operator {
+		OpPtr yHat, y, a, b;
+		using Log = FunctionBroadcastOp<LogFunction>;
+	public:
+		FusedCrossEntropyOp(OpPtr yHat, OpPtr y, OpPtr a, OpPtr b)
+			: yHat(std::move(yHat)), y(std::move(y)), a(std::move(a)), b(std::move(b)) {}
+		OVERRIDE_INPUTS { return { yHat, y, a, b }; }
+		OVERRIDE_OUTPUT { return ValueType::Scalar; }
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vYHat = std::get<Matrix>(V(yHat)), &vY = std::get<Matrix>(V(y));
+			const Scalar vA = std::get<Scalar>(V(a)), vB = std::get<Scalar>(V(b));
+			auto &scratch = env->scratch(5);
+			Matrix &logYHat = matrixOf(scratch[0], vYHat), &logRest = matrixOf(scratch[1], vYHat);
+			Matrix &rest = matrixOf(scratch[2], vYHat);
+			Log::apply(autograd::log, vYHat, logYHat, Log::cacheOf(scratch[3]));
+			rest = (vB - vYHat.array()).matrix();
+			Log::apply(autograd::log, rest, logRest, Log::cacheOf(scratch[4]));
+			const Scalar dot1 = vY.cwiseProduct(logYHat).sum();
+			const Scalar dot2 = (vA - vY.array()).matrix().cwiseProduct(logRest).sum();
+			scalarOf(out) = -dot1 - dot2;
+		}
+		OVERRIDE_DIFF_INTO {
+			const Matrix &vYHat = std::get<Matrix>(V(yHat)), &vY = std::get<Matrix>(V(y));
+			const Scalar vA = std::get<Scalar>(V(a));
+			// Both dot products receive -outputGrad
+			const Scalar g = -std::get<Scalar>(outputGrad);
+			auto &scratch = env->scratch(5);
+			Matrix &logYHat = std::get<Matrix>(scratch[0]), &logRest = std::get<Matrix>(scratch[1]);
+			const Matrix &rest = std::get<Matrix>(scratch[2]);
+			const Matrix &cacheYHat = std::get<Matrix>(scratch[3]), &cacheRest = std::get<Matrix>(scratch[4]);
+			matrixOf(inputGrads[1], vY) = logYHat * g + -(logRest * g);
+			scalarOf(inputGrads[2]) = (logRest * g).sum();
+			Matrix &gYHat = matrixOf(inputGrads[0], vYHat);
+			gYHat = vY * g;
+			Log::applyDiff(autograd::log, vYHat, logYHat, cacheYHat, gYHat, gYHat);
+			// log(yHat) is no longer needed, reuse its buffer for the gradient of the second term
+			Matrix &gRest = logYHat;
+			gRest = ((vA - vY.array()) * g).matrix();
+			Log::applyDiff(autograd::log, rest, logRest, cacheRest, gRest, gRest);
+			gYHat += -gRest;
+			scalarOf(inputGrads[3]) = gRest.sum();
+		}
+	};
+
+	// A chain of MatrixScalar*Op / ScalarMatrixDiffOp applied to one matrix, computed in place
+	// Scratch keeps the intermediates needed to differentiate products and quotients
+	class MatrixScalarChainOp : public Operator {
+	public:
+		enum class Stage {
+			Product,		// s * m
+			Quotient,		// m / s
+			Sum,			// m + s
+			Diff,			// m - s
+			ReverseDiff,	// s - m
+		};
+	private:
+		OpPtr x;
+		std::vector<OpPtr> scalars;
+		std::vector<Stage> stages;
+		static bool needsInput(const Stage stage) { return stage == Stage::Product || stage == Stage::Quotient; }
+	public:
+		// stages[i] is applied with scalars[i], first to last
+		MatrixScalarChainOp(OpPtr x, std::vector<OpPtr> scalars, std::vector<Stage> stages)
+			: x(std::move(x)), scalars(std::move(scalars)), stages(std::move(stages)) {}
+		OVERRIDE_INPUTS {
+			std::vector<OpPtr> ret{ x };
+			ret.insert(ret.end(), scalars.begin(), scalars.end());
+			return ret;
+		}
+		OVERRIDE_OUTPUT { return ValueType::Matrix; }
+		void save(GraphWriter &out) const override {
+			out.write(static_cast<std::uint64_t>(stages.size()));
+			for (const auto stage : stages)
+				out.write(stage);
+		}
+		OVERRIDE_EVAL_INTO {
+			const Matrix &vx = std::get<Matrix>(V(x));
+			auto &inputsOf = env->scratch(stages.size());
+			Matrix &ret = matrixOf(out, vx);
+			for (size_t i = 0; i < stages.size(); i++) {
+				const Matrix &m = i == 0 ? vx : ret;
+				if (i > 0 && needsInput(stages[i]))
+					matrixOf(inputsOf[i], ret) = ret;
+				const Scalar s = std::get<Scalar>(V(scalars[i]));
+				switch (stages[i]) {
+					case Stage::Product: ret = s * m; break;
+					case Stage::Quotient: ret = m / s; break;
+					case Stage::Sum: ret.array() = m.array() + s; break;
+					case Stage::Diff: ret.array() = m.array() - s; break;
+					case Stage::ReverseDiff: ret.array() = s - m.array(); break;
+				}
+			}
+		}
+		OVERRIDE_DIFF_INTO {
+			const Matrix &vx = std::get<Matrix>(V(x));
+			const auto &inputsOf = env->scratch(stages.size());
+			// Walk the chain backwards, keeping the running gradient in the buffer of x
+			Matrix &g = matrixOf(inputGrads[0], vx);
+			g = std::get<Matrix>(outputGrad);
+			for (size_t i = stages.size(); i-- > 0; ) {
+				// Only products and quotients read their input, the others have none stored
+				const Matrix &m = i == 0 || !needsInput(stages[i]) ? vx : std::get<Matrix>(inputsOf[i]);
+				const Scalar s = std::get<Scalar>(V(scalars[i]));
+				Scalar &gs = scalarOf(inputGrads[i + 1]);
+				switch (stages[i]) {
+					case Stage::Product: gs = g.cwiseProduct(m).sum(); g = s * g; break;
+					case Stage::Quotient: gs = g.cwiseProduct(m).sum() / (-s * s); g = g / s; break;
+					case Stage::Sum: gs = g.sum(); break;
+					case Stage::Diff: gs = -g.sum(); break;
+					case Stage::ReverseDiff: gs = g.sum(); g = -g; break;
+				}
+			}
+		}
+	};
+}
+}
+
+#endif
@@ -0,0 +1,108 @@
+//
+// Built-in rules of the fusion pass
+//
+
+#include "Fusion.h"
+#include "FusedOps.h"
+#include <algorithm>
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    template <typename T>
+    shared_ptr<T> match(const OpPtr &op, const FusionContext &ctx) {
+        return ctx.absorbable(op) ? dynamic_pointer_cast<T>(op) : nullptr;
+    }
+
+    // w * x + b (or b + w * x) => DenseOp<void>
+    OpPtr fuseAffine(const OpPtr &op, const FusionContext &ctx) {
+        if (!dynamic_pointer_cast<MatrixSumOp>(op))
+            return nullptr;
+        const auto terms = op->inputs();
+        for (size_t i = 0; i < 2; i++) {
+            if (!match<MatrixProductOp>(terms[i], ctx))
+                continue;
+            const auto factors = terms[i]->inputs();
+            return static_pointer_cast<Operator>(make_shared<DenseOp<void>>(factors[0], factors[1], terms[1 - i]));
+        }
+        return nullptr;
+    }
+
+    // -dot(y, log(yHat)) - dot(a - y, log(b - yHat)) => FusedCrossEntropyOp
+    OpPtr fuseCrossEntropy(const OpPtr &op, const FusionContext &ctx) {
+        using Log = FunctionBroadcastOp<LogFunction>;
+        if (!dynamic_pointer_cast<ScalarDiffOp>(op))
+            return nullptr;
+        const auto terms = op->inputs();
+        const auto neg = match<ScalarNegOp>(terms[0], ctx);
+        if (!neg)
+            return nullptr;
+        const auto dot1 = neg->inputs()[0], dot2 = terms[1];
+        if (!match<DotOp>(dot1, ctx) || !match<DotOp>(dot2, ctx))
+            return nullptr;
+        const auto args1 = dot1->inputs(), args2 = dot2->inputs();
+        const auto &y = args1[0];
+        if (!match<Log>(args1[1], ctx) || !match<Log>(args2[1], ctx) || !match<ScalarMatrixDiffOp>(args2[0], ctx))
+            return nullptr;
+        const auto yHat = args1[1]->inputs()[0], oneMinusYHat = args2[1]->inputs()[0];
+        if (!match<ScalarMatrixDiffOp>(oneMinusYHat, ctx))
+            return nullptr;
+        const auto yTerm = args2[0]->inputs(), yHatTerm = oneMinusYHat->inputs();
+        if (yTerm[1] != y || yHatTerm[1] != yHat)
+            return nullptr;
+        return static_pointer_cast<Operator>(make_shared<FusedCrossEntropyOp>(yHat, y, yTerm[0], yHatTerm[0]));
+    }
+
+    // Splits op into (matrix operand, scalar operand, stage) if it is a matrix-scalar op
+    bool chainStage(const OpPtr op, OpPtr &matrix, OpPtr &scalar, MatrixScalarChainOp::Stage &stage) {
+        using Stage = MatrixScalarChainOp::Stage;
+        const auto in = op->inputs();
+        if (dynamic_pointer_cast<MatrixScalarProductOp>(op))
+            stage = Stage::Product;
+        else if (dynamic_pointer_cast<ScalarMatrixDiffOp>(op))
+            stage = Stage::ReverseDiff;
+        else if (dynamic_pointer_cast<MatrixScalarQuotientOp>(op))
+            stage = Stage::Quotient;
+        else if (dynamic_pointer_cast<MatrixScalarSumOp>(op))
+            stage = Stage::Sum;
+        else if (dynamic_pointer_cast<MatrixScalarDiffOp>(op))
+            stage = Stage::Diff;
+        else
+            return false;
+        // Products and reversed differences take the scalar first
+        const bool scalarFirst = stage == Stage::Product || stage == Stage::ReverseDiff;
+        matrix = in[scalarFirst ? 1 : 0];
+        scalar = in[scalarFirst ? 0 : 1];
+        return true;
+    }
+
+    // Two or more matrix-scalar ops in a row => MatrixScalarChainOp
+    OpPtr fuseScalarChain(const OpPtr &op, const FusionContext &ctx) {
+        OpPtr matrix, scalar;
+        MatrixScalarChainOp::Stage stage;
+        vector<OpPtr> scalars;
+        vector<MatrixScalarChainOp::Stage> stages;
+        if (!chainStage(op, matrix, scalar, stage))
+            return nullptr;
+        do {
+            scalars.push_back(scalar);
+            stages.push_back(stage);
+        } while (ctx.absorbable(matrix) && chainStage(matrix, matrix, scalar, stage));
+        if (stages.size() < 2)
+            return nullptr;
+        // Collected outermost first
+        reverse(scalars.begin(), scalars.end());
+        reverse(stages.begin(), stages.end());
+        return static_pointer_cast<Operator>(make_shared<MatrixScalarChainOp>(matrix, move(scalars), move(stages)));
+    }
+}
+
+OpPtr autograd::fuse(const OpPtr &op, const FusionContext &ctx) {
+    if (auto ret = op->fuse(ctx))
+        return ret;
+    for (const auto rule : { fuseAffine, fuseCrossEntropy, fuseScalarChain })
+        if (auto ret = rule(op, ctx))
+            return ret;
+    return nullptr;
+}
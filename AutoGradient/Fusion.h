@@ -0,0 +1,32 @@
+//
+// Graph rewriting pass run by Executor, folds common patterns into the ops of FusedOps.h
+//
+
+#ifndef AUTOGRADIENT_FUSION_H
+#define AUTOGRADIENT_FUSION_H
+
+#include <unordered_map>
+#include "Operator.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    class FusionContext {
+        std::unordered_map<const Operator *, size_t> consumers;
+        const Operator *result;
+    public:
+        // consumers: how many ops of the graph read each op
+        FusionContext(std::unordered_map<const Operator *, size_t> consumers, const Operator *result)
+            : consumers(std::move(consumers)), result(result) {}
+        // Can op be folded into the one consuming it? Only if nothing else needs its value
+        bool absorbable(const OpPtr &op) const {
+            const auto it = consumers.find(op.get());
+            return op.get() != result && it != consumers.end() && it->second == 1;
+        }
+    };
+
+    // Try op->fuse() and then the built-in rules, returns nullptr if nothing applies
+    OpPtr fuse(const OpPtr &op, const FusionContext &ctx);
+}
+}
+
+#endif //AUTOGRADIENT_FUSION_H
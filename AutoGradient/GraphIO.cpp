@@ -0,0 +1,476 @@
+//
+// Graphs saved to a versioned binary file and rebuilt from it, without the code that built them
+//
+
+#include "GraphIO.h"
+#include "BasicOps.h"
+#include "AdvancedOps.h"
+#include "Functions.h"
+#include "ConvOps.h"
+#include "FusedOps.h"
+#include "Dataset.h"
+#include <array>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    const array<char, 4> MAGIC = { 'A', 'G', 'G', 'R' };
+    // Written as is, a file from a machine of the other byte order is rejected
+    const uint32_t ENDIANNESS_MARK = 0x01020304;
+
+    struct Registry {
+        unordered_map<type_index, string> names;
+        unordered_map<string, OpLoader> loaders;
+        unordered_map<const void *, string> functionNames;
+        unordered_map<string, FunctionKind> functions;
+        // Types without loader share the one of another type registered under the same name
+        void add(const type_index type, const string &name, OpLoader loader) {
+            names.insert_or_assign(type, name);
+            if (loader)
+                loaders.insert_or_assign(name, move(loader));
+        }
+        void addFunction(const string &name, FunctionKind kind) {
+            add(kind.applyType, "FunctionApplyOp", nullptr);
+            add(kind.broadcastType, "FunctionBroadcastOp", nullptr);
+            add(kind.denseType, "DenseOp", nullptr);
+            functionNames.insert_or_assign(kind.f, name);
+            functions.insert_or_assign(name, move(kind));
+        }
+        // Ops without state, built from their N inputs in the order of inputs()
+        template <typename T, size_t N>
+        void addStateless(const string &name) {
+            add(typeid(T), name, [](const vector<OpPtr> &in, GraphReader &) -> OpPtr {
+                if constexpr (N == 1)
+                    return make_shared<T>(in.at(0));
+                else if constexpr (N == 2)
+                    return make_shared<T>(in.at(0), in.at(1));
+                else
+                    return make_shared<T>(in.at(0), in.at(1), in.at(2), in.at(3));
+            });
+        }
+        // Ops without inputs, built from their value
+        template <typename T, typename V>
+        void addInput(const string &name) {
+            add(typeid(T), name, [](const vector<OpPtr> &, GraphReader &state) -> OpPtr {
+                return make_shared<T>(state.read<V>());
+            });
+        }
+    };
+
+    Registry &registry() {
+        static Registry ret = [] {
+            Registry r;
+            r.addInput<ScalarConstOp, Scalar>("ScalarConstOp");
+            r.addInput<ScalarLiteralOp, Scalar>("ScalarLiteralOp");
+            r.addInput<MatrixConstOp, Matrix>("MatrixConstOp");
+            r.addInput<SparseConstOp, SparseMatrix>("SparseConstOp");
+            r.addInput<ScalarParamOp, Scalar>("ScalarParamOp");
+            r.addInput<MatrixParamOp, Matrix>("MatrixParamOp");
+            r.addStateless<ScalarSumOp, 2>("ScalarSumOp");
+            r.addStateless<ScalarDiffOp, 2>("ScalarDiffOp");
+            r.addStateless<ScalarProductOp, 2>("ScalarProductOp");
+            r.addStateless<ScalarQuotientOp, 2>("ScalarQuotientOp");
+            r.addStateless<ScalarPowOp, 2>("ScalarPowOp");
+            r.addStateless<ScalarNegOp, 1>("ScalarNegOp");
+            r.addStateless<MatrixSumOp, 2>("MatrixSumOp");
+            r.addStateless<MatrixDiffOp, 2>("MatrixDiffOp");
+            r.addStateless<MatrixProductOp, 2>("MatrixProductOp");
+            r.addStateless<SparseDenseProductOp, 2>("SparseDenseProductOp");
+            r.addStateless<DenseSparseProductOp, 2>("DenseSparseProductOp");
+            r.addStateless<MatrixScalarProductOp, 2>("MatrixScalarProductOp");
+            r.addStateless<MatrixScalarQuotientOp, 2>("MatrixScalarQuotientOp");
+            r.addStateless<MatrixScalarSumOp, 2>("MatrixScalarSumOp");
+            r.addStateless<MatrixScalarDiffOp, 2>("MatrixScalarDiffOp");
+            r.addStateless<ScalarMatrixDiffOp, 2>("ScalarMatrixDiffOp");
+            r.addStateless<MatrixCWiseProductOp, 2>("MatrixCWiseProductOp");
+            r.addStateless<MatrixCWiseQuotientOp, 2>("MatrixCWiseQuotientOp");
+            r.addStateless<MatrixNegOp, 1>("MatrixNegOp");
+            r.addStateless<MatrixCoefSumOp, 1>("MatrixCoefSumOp");
+            r.addStateless<MatrixMaxOp, 1>("MatrixMaxOp");
+            r.addStateless<DotOp, 2>("DotOp");
+            r.addStateless<SoftmaxOp, 1>("SoftmaxOp");
+            r.addStateless<CrossEntropyOp, 2>("CrossEntropyOp");
+            r.addStateless<SoftmaxCrossEntropyOp, 2>("SoftmaxCrossEntropyOp");
+            r.addStateless<EmbeddingOp, 2>("EmbeddingOp");
+            r.addStateless<MaskColumnsOp, 2>("MaskColumnsOp");
+            r.addStateless<FlattenOp, 1>("FlattenOp");
+            r.addStateless<FusedCrossEntropyOp, 4>("FusedCrossEntropyOp");
+            r.add(typeid(DropoutOp), "DropoutOp", [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                const auto dropRate = state.read<Scalar>();
+                const auto training = state.read<bool>();
+                return make_shared<DropoutOp>(in.at(0), dropRate, training);
+            });
+            r.add(typeid(Conv2dOp), "Conv2dOp", [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                const auto window = state.read<Window2d>();
+                const auto algorithm = state.read<Conv2dOp::Algorithm>();
+                return make_shared<Conv2dOp>(in.at(0), in.at(1), in.at(2), window, algorithm);
+            });
+            r.add(typeid(MaxPool2dOp), "MaxPool2dOp", [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                return make_shared<MaxPool2dOp>(in.at(0), state.read<Window2d>());
+            });
+            r.add(typeid(AvgPool2dOp), "AvgPool2dOp", [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                return make_shared<AvgPool2dOp>(in.at(0), state.read<Window2d>());
+            });
+            r.add(typeid(ToImageOp), "ToImageOp", [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                const auto rows = state.read<Eigen::Index>();
+                const auto cols = state.read<Eigen::Index>();
+                const auto channels = state.read<Eigen::Index>();
+                return make_shared<ToImageOp>(in.at(0), rows, cols, channels);
+            });
+            r.add(typeid(MatrixScalarChainOp), "MatrixScalarChainOp",
+                  [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                vector<MatrixScalarChainOp::Stage> stages(state.read<uint64_t>());
+                if (in.size() != stages.size() + 1)
+                    throw invalid_argument("MatrixScalarChainOp needs one scalar per stage");
+                for (auto &stage : stages)
+                    stage = state.read<MatrixScalarChainOp::Stage>();
+                return make_shared<MatrixScalarChainOp>(in[0], vector<OpPtr>(in.begin() + 1, in.end()), move(stages));
+            });
+            // The ops of every function share the loaders below, which look the function up
+            r.add(typeid(DenseOp<void>), "DenseOp", [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                if (const auto kind = state.readFunction())
+                    return kind->dense(in.at(0), in.at(1), in.at(2));
+                return make_shared<DenseOp<void>>(in.at(0), in.at(1), in.at(2));
+            });
+            r.loaders["FunctionApplyOp"] = [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                const auto kind = state.readFunction();
+                if (!kind)
+                    throw invalid_argument("FunctionApplyOp without function");
+                return kind->apply(in.at(0));
+            };
+            r.loaders["FunctionBroadcastOp"] = [](const vector<OpPtr> &in, GraphReader &state) -> OpPtr {
+                const auto kind = state.readFunction();
+                if (!kind)
+                    throw invalid_argument("FunctionBroadcastOp without function");
+                return kind->broadcast(in.at(0));
+            };
+            r.addFunction("SinFunction", functionKind(autograd::sin));
+            r.addFunction("CosFunction", functionKind(autograd::cos));
+            r.addFunction("LogFunction", functionKind(autograd::log));
+            r.addFunction("ExpFunction", functionKind(autograd::exp));
+            r.addFunction("TanhFunction", functionKind(autograd::tanh));
+            r.addFunction("SigmoidFunction", functionKind(autograd::sigmoid));
+            r.addFunction("LReLUFunction", functionKind(autograd::lrelu));
+            r.addFunction("MishFunction", functionKind(autograd::mish));
+            return r;
+        }();
+        return ret;
+    }
+
+    // An op of the saved graph and the indices of its inputs, which come before it
+    struct Node {
+        OpPtr op;
+        vector<size_t> inputs;
+    };
+
+    void writeGraph(ostream &out, const vector<Node> &nodes, vector<pair<string, size_t>> names) {
+        const auto &types = registry().names;
+        GraphWriter file;
+        file.write(MAGIC);
+        file.write(GRAPH_VERSION);
+        file.write(ENDIANNESS_MARK);
+        file.write(static_cast<uint64_t>(nodes.size()));
+        for (const auto &node : nodes) {
+            const auto type = types.find(typeid(*node.op));
+            if (type == types.end())
+                throw invalid_argument(typeNameOf(*node.op) + " is not registered, see registerOp() and registerFunction()");
+            file.write(type->second);
+            file.write(static_cast<uint64_t>(node.inputs.size()));
+            for (const auto in : node.inputs)
+                file.write(static_cast<uint64_t>(in));
+            GraphWriter state;
+            node.op->save(state);
+            file.write(state.data());
+        }
+        // Sorted, so that the same graph always gives the same bytes
+        sort(names.begin(), names.end());
+        file.write(static_cast<uint64_t>(names.size()));
+        for (const auto &[name, index] : names) {
+            file.write(name);
+            file.write(static_cast<uint64_t>(index));
+        }
+        out.write(file.data().data(), static_cast<streamsize>(file.data().size()));
+        if (!out.flush())
+            throw runtime_error("cannot write the graph");
+    }
+
+    LoadedGraph readGraph(const unsigned char *data, const size_t size) {
+        GraphReader file(data, size);
+        if (file.read<array<char, 4>>() != MAGIC)
+            throw invalid_argument("not a graph");
+        const auto version = file.read<uint32_t>();
+        if (file.read<uint32_t>() != ENDIANNESS_MARK)
+            throw invalid_argument("not a graph");
+        if (version > GRAPH_VERSION)
+            throw invalid_argument("the graph is from a newer version");
+        const auto &loaders = registry().loaders;
+        vector<OpPtr> ops(file.read<uint64_t>());
+        if (ops.empty())
+            throw invalid_argument("empty graph");
+        for (size_t i = 0; i < ops.size(); i++) {
+            const auto type = file.read<string>();
+            vector<OpPtr> inputs(file.read<uint64_t>());
+            for (auto &in : inputs) {
+                const auto index = file.read<uint64_t>();
+                if (index >= i)
+                    throw invalid_argument("the ops of the graph are not in topological order");
+                in = ops[index];
+            }
+            const auto loader = loaders.find(type);
+            if (loader == loaders.end())
+                throw invalid_argument(type + " is not registered, see registerOp()");
+            const auto bytes = file.read<string>();
+            GraphReader state(reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size());
+            ops[i] = loader->second(inputs, state);
+            if (!state.done() || ops[i]->inputs().size() != inputs.size())
+                throw invalid_argument("the saved state of " + type + " does not match its loader");
+        }
+        LoadedGraph ret{ ops.back(), {} };
+        for (auto n = file.read<uint64_t>(); n > 0; n--) {
+            auto name = file.read<string>();
+            const auto index = file.read<uint64_t>();
+            if (index >= ops.size())
+                throw invalid_argument("the graph names an op it does not have");
+            ret.ops.insert_or_assign(move(name), ops[index]);
+        }
+        return ret;
+    }
+}
+
+void GraphWriter::write(const Scalar value) {
+    const auto master = static_cast<MasterScalar>(value);
+    bytes.append(reinterpret_cast<const char *>(&master), sizeof(master));
+}
+
+void GraphWriter::write(const string &value) {
+    write(static_cast<uint64_t>(value.size()));
+    bytes.append(value);
+}
+
+void GraphWriter::write(const Matrix &value) {
+    write(static_cast<int64_t>(value.rows()));
+    write(static_cast<int64_t>(value.cols()));
+    write(static_cast<uint8_t>(sizeof(Scalar)));
+    bytes.append(reinterpret_cast<const char *>(value.data()), value.size() * sizeof(Scalar));
+}
+
+void GraphWriter::write(const SparseMatrix &value) {
+    if (!value.isCompressed()) {
+        SparseMatrix compressed = value;
+        compressed.makeCompressed();
+        write(compressed);
+        return;
+    }
+    write(static_cast<int64_t>(value.rows()));
+    write(static_cast<int64_t>(value.cols()));
+    for (Eigen::Index i = 0; i <= value.outerSize(); i++)
+        write(static_cast<int64_t>(value.outerIndexPtr()[i]));
+    for (Eigen::Index k = 0; k < value.nonZeros(); k++)
+        write(static_cast<int64_t>(value.innerIndexPtr()[k]));
+    write(Matrix(Eigen::Map<const Matrix>(value.valuePtr(), value.nonZeros(), 1)));
+}
+
+void GraphWriter::writeFunction(const void *f) {
+    if (!f) {
+        write(string());
+        return;
+    }
+    const auto &functions = registry().functionNames;
+    const auto it = functions.find(f);
+    if (it == functions.end())
+        throw invalid_argument("the graph uses a function that is not registered, see registerFunction()");
+    write(it->second);
+}
+
+void GraphReader::take(void *out, const size_t n) {
+    if (static_cast<size_t>(end - pos) < n)
+        throw invalid_argument("the graph is truncated");
+    memcpy(out, pos, n);
+    pos += n;
+}
+
+Scalar GraphReader::readScalar() {
+    MasterScalar ret;
+    take(&ret, sizeof(ret));
+    return static_cast<Scalar>(ret);
+}
+
+string GraphReader::readString() {
+    const auto n = read<uint64_t>();
+    if (static_cast<uint64_t>(end - pos) < n)
+        throw invalid_argument("the graph is truncated");
+    string ret(reinterpret_cast<const char *>(pos), n);
+    pos += n;
+    return ret;
+}
+
+Matrix GraphReader::readMatrix() {
+    const auto rows = read<int64_t>(), cols = read<int64_t>();
+    const auto size = read<uint8_t>();
+    if (rows < 0 || cols < 0 || (size != sizeof(float) && size != sizeof(double)))
+        throw invalid_argument("invalid matrix in the graph");
+    if (static_cast<uint64_t>(end - pos) / size / std::max<uint64_t>(cols, 1) < static_cast<uint64_t>(rows))
+        throw invalid_argument("the graph is truncated");
+    Matrix ret(rows, cols);
+    if (size == sizeof(Scalar))
+        memcpy(ret.data(), pos, ret.size() * sizeof(Scalar));
+    else if (size == sizeof(float))
+        ret = Eigen::Map<const Eigen::MatrixXf>(reinterpret_cast<const float *>(pos), rows, cols).cast<Scalar>();
+    else
+        ret = Eigen::Map<const Eigen::MatrixXd>(reinterpret_cast<const double *>(pos), rows, cols).cast<Scalar>();
+    pos += ret.size() * size;
+    return ret;
+}
+
+SparseMatrix GraphReader::readSparse() {
+    const auto rows = read<int64_t>(), cols = read<int64_t>();
+    if (rows < 0 || cols < 0)
+        throw invalid_argument("invalid sparse matrix in the graph");
+    if (static_cast<uint64_t>(end - pos) / sizeof(int64_t) <= static_cast<uint64_t>(rows))
+        throw invalid_argument("the graph is truncated");
+    vector<int64_t> outer(rows + 1);
+    for (auto &offset : outer)
+        offset = read<int64_t>();
+    const auto nonZeros = outer.back();
+    if (outer.front() != 0 || !is_sorted(outer.begin(), outer.end()))
+        throw invalid_argument("invalid sparse matrix in the graph");
+    if (static_cast<uint64_t>(end - pos) / sizeof(int64_t) < static_cast<uint64_t>(nonZeros))
+        throw invalid_argument("the graph is truncated");
+    SparseMatrix ret(rows, cols);
+    ret.resizeNonZeros(nonZeros);
+    for (int64_t i = 0; i <= rows; i++)
+        ret.outerIndexPtr()[i] = static_cast<SparseMatrix::StorageIndex>(outer[i]);
+    for (int64_t k = 0; k < nonZeros; k++) {
+        const auto col = read<int64_t>();
+        if (col < 0 || col >= cols)
+            throw invalid_argument("invalid sparse matrix in the graph");
+        ret.innerIndexPtr()[k] = static_cast<SparseMatrix::StorageIndex>(col);
+    }
+    const auto values = readMatrix();
+    if (values.size() != nonZeros)
+        throw invalid_argument("invalid sparse matrix in the graph");
+    copy(values.data(), values.data() + nonZeros, ret.valuePtr());
+    return ret;
+}
+
+const FunctionKind *GraphReader::readFunction() {
+    const auto name = readString();
+    if (name.empty())
+        return nullptr;
+    const auto &functions = registry().functions;
+    const auto it = functions.find(name);
+    if (it == functions.end())
+        throw invalid_argument(name + " is not registered, see registerFunction()");
+    return &it->second;
+}
+
+void autograd::registerOp(const type_index type, const string &name, OpLoader loader) {
+    registry().add(type, name, move(loader));
+}
+
+void autograd::registerFunction(const string &name, FunctionKind kind) {
+    registry().addFunction(name, move(kind));
+}
+
+string autograd::typeNameOf(const Operator &op) {
+    const auto &types = registry().names;
+    const auto it = types.find(typeid(op));
+    return it != types.end() ? it->second : typeid(op).name();
+}
+
+const OpPtr &LoadedGraph::operator [](const string &name) const {
+    const auto it = ops.find(name);
+    if (it == ops.end())
+        throw out_of_range("the graph has no op named " + name);
+    return it->second;
+}
+
+void autograd::saveGraph(ostream &out, const OpPtr &result, const OpNames &names) {
+    // Depth-first, an op is added once all of its inputs are
+    vector<Node> nodes;
+    unordered_map<const Operator *, size_t> index;
+    vector<pair<OpPtr, bool>> stack{ { result, false } };
+    while (!stack.empty()) {
+        const auto [op, expanded] = stack.back();
+        stack.pop_back();
+        if (index.count(op.get()))
+            continue;
+        const auto inputs = op->inputs();
+        if (!expanded) {
+            stack.emplace_back(op, true);
+            for (auto it = inputs.rbegin(); it != inputs.rend(); ++it)
+                if (!index.count(it->get()))
+                    stack.emplace_back(*it, false);
+            continue;
+        }
+        Node node{ op, {} };
+        for (const auto &in : inputs)
+            node.inputs.push_back(index.at(in.get()));
+        index.insert(make_pair(op.get(), nodes.size()));
+        nodes.push_back(move(node));
+    }
+    vector<pair<string, size_t>> named;
+    for (const auto &[op, name] : names) {
+        const auto it = index.find(op.get());
+        if (it == index.end())
+            throw invalid_argument(name + " is not in the graph");
+        named.emplace_back(name, it->second);
+    }
+    writeGraph(out, nodes, move(named));
+}
+
+void autograd::saveGraph(ostream &out, const Executor &executor, const OpNames &names) {
+    const auto &order = executor.topoOrder();
+    vector<Node> nodes;
+    nodes.reserve(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+        nodes.push_back({ order[i], executor.inputSlotsOf(i) });
+    vector<pair<string, size_t>> named;
+    for (const auto &[op, name] : names) {
+        try {
+            named.emplace_back(name, executor.slotOf(op));
+        } catch (const out_of_range &) {
+            throw invalid_argument(name + " is not evaluated by the plan, see ExecutorOptions::keep");
+        }
+    }
+    writeGraph(out, nodes, move(named));
+}
+
+namespace {
+    // Written next to path first, so that path is replaced only once fully written
+    template <typename G>
+    void saveGraphFile(const string &path, const G &graph, const OpNames &names) {
+        const auto temporary = path + ".tmp";
+        {
+            ofstream out(temporary, ios::binary | ios::trunc);
+            if (!out)
+                throw runtime_error("cannot write " + temporary);
+            saveGraph(out, graph, names);
+        }
+        replaceFile(temporary, path);
+    }
+}
+
+void autograd::saveGraph(const string &path, const OpPtr &result, const OpNames &names) {
+    saveGraphFile(path, result, names);
+}
+
+void autograd::saveGraph(const string &path, const Executor &executor, const OpNames &names) {
+    saveGraphFile(path, executor, names);
+}
+
+LoadedGraph autograd::loadGraph(istream &in) {
+    const string bytes{ istreambuf_iterator<char>(in), istreambuf_iterator<char>() };
+    return readGraph(reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size());
+}
+
+LoadedGraph autograd::loadGraph(const string &path) {
+    const MappedFile file(path);
+    return readGraph(file.data(), file.size());
+}
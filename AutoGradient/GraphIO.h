@@ -0,0 +1,145 @@
+//
+// Graphs saved to a versioned binary file and rebuilt from it, without the code that built them
+//
+
+#ifndef AUTOGRADIENT_GRAPHIO_H
+#define AUTOGRADIENT_GRAPHIO_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <type_traits>
+#include <iosfwd>
+#include <cstdint>
+#include "Operator.h"
+#include "Value.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    template <typename F> class FunctionApplyOp;
+    template <typename F> class FunctionBroadcastOp;
+    template <typename F> class DenseOp;
+
+    // The state of an op beyond its inputs, as written by Operator::save() and read back by its loader.
+    // Scalars are written as MasterScalar and matrices in the precision of the library, loading converts them
+    class GraphWriter {
+        std::string bytes;
+    public:
+        template <typename T>
+        void write(const T &value) {
+            static_assert(std::is_trivially_copyable_v<T> && !std::is_floating_point_v<T>,
+                          "floating-point state is written as Scalar");
+            bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+        void write(Scalar value);
+        void write(const std::string &value);
+        void write(const Matrix &value);
+        // Compressed: the row offsets and column indices, then the nonzeros as a matrix
+        void write(const SparseMatrix &value);
+        // A function object registered with registerFunction(), or nullptr
+        void writeFunction(const void *f);
+        const std::string &data() const { return bytes; }
+    };
+
+    struct FunctionKind;
+
+    class GraphReader {
+        const unsigned char *pos, *end;
+        void take(void *out, size_t n);
+    public:
+        GraphReader(const unsigned char *data, size_t size) : pos(data), end(data + size) {}
+        template <typename T>
+        T read() {
+            if constexpr (std::is_same_v<T, Scalar>)
+                return readScalar();
+            else if constexpr (std::is_same_v<T, std::string>)
+                return readString();
+            else if constexpr (std::is_same_v<T, Matrix>)
+                return readMatrix();
+            else if constexpr (std::is_same_v<T, SparseMatrix>)
+                return readSparse();
+            else {
+                static_assert(std::is_trivially_copyable_v<T> && !std::is_floating_point_v<T>,
+                              "floating-point state is read as Scalar");
+                T ret;
+                take(&ret, sizeof(T));
+                return ret;
+            }
+        }
+        // The function written by GraphWriter::writeFunction(), nullptr for nullptr
+        const FunctionKind *readFunction();
+        bool done() const { return pos == end; }
+    private:
+        Scalar readScalar();
+        std::string readString();
+        Matrix readMatrix();
+        SparseMatrix readSparse();
+    };
+
+    // Builds an op of a registered type from its inputs, in the order of inputs(), and its saved state
+    using OpLoader = std::function<OpPtr(const std::vector<OpPtr> &inputs, GraphReader &state)>;
+
+    // Ops are saved under the name their type is registered with and rebuilt by its loader. Every op of
+    // the library is registered, as are the functions of Functions.h (under the name of their type, e.g.
+    // "SinFunction"); custom ones must be registered before their graphs are saved or loaded
+    void registerOp(std::type_index type, const std::string &name, OpLoader loader);
+    template <typename T>
+    void registerOp(const std::string &name, OpLoader loader) { registerOp(typeid(T), name, std::move(loader)); }
+
+    // A function object and the ops built on it, one registered function per object
+    struct FunctionKind {
+        const void *f;
+        std::type_index applyType, broadcastType, denseType;
+        std::function<OpPtr(OpPtr x)> apply, broadcast;
+        std::function<OpPtr(OpPtr w, OpPtr x, OpPtr b)> dense;
+    };
+    template <typename F>
+    FunctionKind functionKind(const F &f) {
+        return {
+            &f, typeid(FunctionApplyOp<F>), typeid(FunctionBroadcastOp<F>), typeid(DenseOp<F>),
+            [&f](OpPtr x) { return std::static_pointer_cast<Operator>(std::make_shared<FunctionApplyOp<F>>(std::move(x), f)); },
+            [&f](OpPtr x) { return std::static_pointer_cast<Operator>(std::make_shared<FunctionBroadcastOp<F>>(std::move(x), f)); },
+            [&f](OpPtr w, OpPtr x, OpPtr b) {
+                return std::static_pointer_cast<Operator>(
+                    std::make_shared<DenseOp<F>>(std::move(w), std::move(x), std::move(b), &f));
+            } };
+    }
+    void registerFunction(const std::string &name, FunctionKind kind);
+    template <typename F>
+    void registerFunction(const std::string &name, const F &f) { registerFunction(name, functionKind(f)); }
+
+    // The name the type of op is registered with, its typeid name otherwise
+    std::string typeNameOf(const Operator &op);
+
+    // Ops of a saved graph to look up after loading, e.g. the inputs to feed and the parameters to checkpoint
+    using OpNames = std::unordered_map<OpPtr, std::string>;
+
+    struct LoadedGraph {
+        OpPtr result;
+        std::unordered_map<std::string, OpPtr> ops;
+        const OpPtr &operator [](const std::string &name) const;
+    };
+
+    constexpr std::uint32_t GRAPH_VERSION = 1;
+
+    // Layout: a header (magic "AGGR", version, number of ops), then every op in topological order, the result
+    // last (type name, indices of its inputs, length and bytes of its state), and then the names with the index
+    // of their op. Parameters and constants are saved with their current value
+    void saveGraph(std::ostream &out, const OpPtr &result, const OpNames &names = {});
+    void saveGraph(const std::string &path, const OpPtr &result, const OpNames &names = {});
+    // Saves the graph as compiled by executor, with its substitutions, simplification and fusion applied, so that
+    // executors of the loaded graph have nothing left to rewrite. Named ops must still be evaluated by the plan,
+    // see ExecutorOptions::keep
+    void saveGraph(std::ostream &out, const Executor &executor, const OpNames &names = {});
+    void saveGraph(const std::string &path, const Executor &executor, const OpNames &names = {});
+    // Rebuilds a saved graph from new ops, sharing nothing with the one that was saved
+    LoadedGraph loadGraph(std::istream &in);
+    LoadedGraph loadGraph(const std::string &path);
+}
+}
+
+#endif //AUTOGRADIENT_GRAPHIO_H
@@ -0,0 +1,118 @@
+//
+// Evaluation of a trained graph, without gradients, from any number of threads
+//
+
+#include "InferenceSession.h"
+#include "BasicOps.h"
+#include "Random.h"
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+using namespace autograd;
+
+InferenceSession::InferenceSession(OpPtr result, vector<OpPtr> inputs, const bool fuse)
+    : resultOp(move(result)), inputs(move(inputs)), rngSeed(seededRNG()()) {
+    // Walk the graph with the inference versions substituted, keyed by the op as read by its consumers
+    unordered_map<const Operator *, pair<OpPtr, OpPtr>> substitutes;
+    unordered_map<const Operator *, vector<OpPtr>> consumers;
+    vector<OpPtr> visited;
+    const auto visit = [&](const OpPtr &op) {
+        if (substitutes.count(op.get()))
+            return false;
+        auto replacement = op->inference();
+        substitutes.insert(make_pair(op.get(), make_pair(op, replacement ? replacement : op)));
+        return true;
+    };
+    queue<OpPtr> qBFS;
+    visit(resultOp);
+    qBFS.push(resultOp);
+    while (!qBFS.empty()) {
+        auto u = qBFS.front(); qBFS.pop();
+        visited.push_back(u);
+        for (const auto &v : substitutes.at(u.get()).second->inputs()) {
+            consumers[v.get()].push_back(u);
+            if (visit(v))
+                qBFS.push(v);
+        }
+    }
+    // Everything downstream of the inputs is evaluated on every run
+    unordered_set<const Operator *> dependent;
+    for (const auto &in : this->inputs)
+        if (substitutes.count(in.get()) && dependent.insert(in.get()).second)
+            qBFS.push(in);
+    while (!qBFS.empty()) {
+        auto u = qBFS.front(); qBFS.pop();
+        for (const auto &v : consumers[u.get()])
+            if (dependent.insert(v.get()).second)
+                qBFS.push(v);
+    }
+    ExecutorOptions probeOptions;
+    probeOptions.fuse = fuse;
+    probeOptions.parallel = false;
+    probeOptions.differentiable = false;
+    for (const auto &[key, substitute] : substitutes)
+        if (substitute.first != substitute.second)
+            probeOptions.substitutes.push_back(substitute);
+    // Fold the largest constant subgraphs: the ops with inputs and without dependence on the inputs of the
+    // session that are read by ones with. Tensors have no constant op and stay evaluated
+    for (const auto &op : visited) {
+        if (dependent.count(op.get()) || op->inputs().empty())
+            continue;
+        auto &[original, replacement] = substitutes.at(op.get());
+        const auto &readers = consumers[op.get()];
+        const auto frontier = op == resultOp || any_of(readers.begin(), readers.end(), [&](const OpPtr &reader) {
+            return dependent.count(reader.get()) > 0;
+        });
+        if (!frontier || replacement->outputType() == ValueType::Tensor)
+            continue;
+        const auto probe = make_shared<Context>(op, probeOptions);
+        const auto &value = probe->propagate(false);
+        if (holds_alternative<Scalar>(value))
+            replacement = literal(get<Scalar>(value));
+        else
+            replacement = constant(get<Matrix>(value));
+    }
+    options.fuse = fuse;
+    options.parallel = false;
+    options.planMemory = true;
+    options.differentiable = false;
+    for (const auto &[key, substitute] : substitutes)
+        if (substitute.first != substitute.second)
+            options.substitutes.push_back(substitute);
+    // Invalid inputs are reported here rather than on the first run
+    idle.push_back(acquire());
+}
+
+shared_ptr<InferenceSession::Context> InferenceSession::acquire() {
+    {
+        lock_guard<mutex> lock(idleMutex);
+        if (!idle.empty()) {
+            auto ret = move(idle.back());
+            idle.pop_back();
+            return ret;
+        }
+    }
+    auto ret = make_shared<Context>(resultOp, options);
+    ret->seed(rngSeed);
+    for (const auto &in : inputs)
+        ret->feed(in);
+    return ret;
+}
+
+void InferenceSession::run(const vector<reference_wrapper<const Matrix>> &batch, Value &out) {
+    if (batch.size() != inputs.size())
+        throw invalid_argument("one matrix per input is expected");
+    // An executor whose run threw is dropped
+    auto context = acquire();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const Matrix &samples = batch[i];
+        matrixOf(context->feed(inputs[i]), samples) = samples;
+    }
+    out = context->propagate(false);
+    lock_guard<mutex> lock(idleMutex);
+    idle.push_back(move(context));
+}
@@ -0,0 +1,52 @@
+//
+// Evaluation of a trained graph, without gradients, from any number of threads
+//
+
+#ifndef AUTOGRADIENT_INFERENCESESSION_H
+#define AUTOGRADIENT_INFERENCESESSION_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+#include "Executor.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // Evaluates result for batches fed to inputs. Ops with an inference version (see Operator::inference(), e.g.
+    // dropout) run it, the subgraphs that do not depend on the inputs are evaluated once here and folded into
+    // constants, and what the result does not read is never planned. So a session is built for fixed parameters:
+    // build a new one after training them further.
+    // Every concurrent run() gets an executor of its own, planned without gradient and with memory planning,
+    // so that a chain of ops alternates between a couple of pooled buffers. Idle executors are kept for the
+    // next calls
+    class InferenceSession {
+        class Context : public Executor {
+        public:
+            using Executor::Executor;
+        };
+        OpPtr resultOp;
+        std::vector<OpPtr> inputs;
+        ExecutorOptions options;
+        // Every executor is seeded with it, so that stochastic ops draw the same whichever one a run gets
+        std::uint64_t rngSeed;
+        std::mutex idleMutex;
+        std::vector<std::shared_ptr<Context>> idle;
+        std::shared_ptr<Context> acquire();
+    public:
+        // inputs: the ops fed with the batch, they must not have inputs themselves (usually constants)
+        InferenceSession(OpPtr result, std::vector<OpPtr> inputs, bool fuse = true);
+        // batch[i] goes to inputs[i], the value of the result is written to out reusing its storage
+        void run(const std::vector<std::reference_wrapper<const Matrix>> &batch, Value &out);
+        Value run(const std::vector<std::reference_wrapper<const Matrix>> &batch) {
+            Value ret;
+            run(batch, ret);
+            return ret;
+        }
+        const OpPtr &result() const { return resultOp; }
+    };
+}
+}
+
+#endif //AUTOGRADIENT_INFERENCESESSION_H
@@ -11,8 +11,11 @@
 #include "Value.h"
 
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
     class Operator;
     class Executor;
+    class FusionContext;
+    class GraphWriter;
     using OpPtr = std::shared_ptr<Operator>;
 
     class Operator {
@@ -24,14 +27,62 @@ namespace autograd {
         // Used by operator overloading to select appropriate operators
         virtual ValueType outputType() const = 0;
         // Evaluate
-        virtual Value eval(std::shared_ptr<Executor> env) const = 0;
+        virtual Value eval(std::shared_ptr<Executor> env) const {
+            Value ret;
+            evalInto(std::move(env), ret);
+            return ret;
+        }
         // The order of returned gradients must match up with the result of inputs()
-        virtual std::vector<Value> diff(std::shared_ptr<Executor> env, const Value &outputGrad) const = 0;
+        virtual std::vector<Value> diff(std::shared_ptr<Executor> env, const Value &outputGrad) const {
+            std::vector<Value> ret(inputs().size());
+            diffInto(std::move(env), outputGrad, ret);
+            return ret;
+        }
+        // In-place versions of eval() and diff(), out and inputGrads hold the buffers of the previous call
+        // (inputGrads is already sized to match inputs()), write into them to avoid reallocating every step.
+        // Each pair falls back to the other, so an op must override at least one of each
+        virtual void evalInto(std::shared_ptr<Executor> env, Value &out) const { out = eval(std::move(env)); }
+        virtual void diffInto(std::shared_ptr<Executor> env, const Value &outputGrad,
+                              std::vector<Value> &inputGrads) const {
+            inputGrads = diff(std::move(env), outputGrad);
+        }
         // Does the op contains updatable parameters ?
         // This is for the optimizer
         virtual bool updatable() const { return false; }
         // If the op is updatable, call this
         virtual void update(const Value &delta) {}
+        // The coefficients of an updatable op, for optimizers updating them in place instead of through update().
+        // With MIXED_PRECISION master is their MasterScalar copy, which is updated and then rounded into value
+        struct Parameters {
+            Scalar *value = nullptr;
+            MasterScalar *master = nullptr;
+            size_t size = 0;
+            // Shape of the coefficients, column-major
+            Eigen::Index rows = 1, cols = 1;
+        };
+        virtual Parameters parameters() { return {}; }
+        // Used by the fusion pass when Executor compiles the graph, return an op that computes the same value
+        // with (some of) the ops feeding this one folded in, or nullptr. See Fusion.h
+        virtual OpPtr fuse(const FusionContext &ctx) const { return nullptr; }
+        // Used by InferenceSession, return an op computing what this one does outside of training, or nullptr
+        // if that is the same
+        virtual OpPtr inference() const { return nullptr; }
+        // Used by the simplification pass of Executor (see ExecutorOptions::simplify). A pure op computes its value
+        // from the values of its inputs and from state fixed when it is built, deterministically. Equal pure ops
+        // reading the same inputs are merged, and pure ops reading only constant ones are evaluated once.
+        // Ops without inputs are pure if their value never changes (not parameters, nor inputs set or fed later)
+        virtual bool pure() const { return false; }
+        // For pure ops of the same type, does other hold the same state as this one? Inputs are compared already
+        virtual bool sameAs(const Operator &other) const { return true; }
+        // Used by the profiler, the floating-point operations of an eval that read inputs and wrote output, one per
+        // output coefficient unless overridden. A diff is counted as twice its eval
+        virtual double flops(const std::vector<const Value *> &inputs, const Value &output) const {
+            return static_cast<double>(sizeOf(output));
+        }
+        // Used by saveGraph(), write the state fixed when the op was built that its loader needs besides the
+        // inputs (see GraphIO.h). Parameters and constants write their current value
+        virtual void save(GraphWriter &out) const {}
     };
 }
+}
 #endif //AUTOGRADIENT_OPERATOR_H
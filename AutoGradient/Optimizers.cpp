@@ -4,61 +4,163 @@
 
 #include "Optimizers.h"
 #include <iostream>
+#include <cmath>
+#include <stdexcept>
 
 using namespace autograd;
 using namespace std;
 
-void SGDOptimizer::update() {
-    for (const auto &op : topoOrder()) {
-        if (!op->updatable()) continue;
-		if (op->outputType() == ValueType::Scalar)
-			op->update(-rate * get<Scalar>(gradientOf(op)));
-        else if (op->outputType() == ValueType::Matrix)
-            op->update(-rate * get<Matrix>(gradientOf(op)));
+namespace {
+    // Adds delta to coefficient i, through its master copy with MIXED_PRECISION
+    inline void add(Scalar *value, MasterScalar *master, const size_t i, const Scalar delta) {
+        if constexpr (MIXED_PRECISION) {
+            master[i] += delta;
+            value[i] = static_cast<Scalar>(master[i]);
+        } else
+            value[i] += delta;
     }
 }
 
-void AdamOptimizer::update() {
-    updates++;
-    const auto corr = static_cast<Scalar>(sqrt(1 - pow(beta2, updates)) / (1 - pow(beta1, updates)));
+Optimizer::Optimizer(const OpPtr &resultOp, const ExecutorOptions &options) : Executor(resultOp, options) {
     for (const auto &op : topoOrder()) {
-        if (!op->updatable()) continue;
-        if (op->outputType() == ValueType::Scalar) {
-            const auto grad = get<Scalar>(gradientOf(op));
-            Scalar now1, now2;
-			if (auto it = m1.find(op); it != m1.end())
-				it->second = now1 = beta1 * get<Scalar>(it->second) + (1 - beta1) * grad;
-			else
-				m1.insert(make_pair(op, now1 = (1 - beta1) * grad));
-			if (auto it = m2.find(op); it != m2.end())
-				it->second = now2 = beta2 * get<Scalar>(it->second) + (1 - beta2) * grad * grad;
-			else
-				m2.insert(make_pair(op, now2 = (1 - beta2) * grad * grad));
-            op->update(-alpha * corr * now1 / (sqrt(now2) + EPSILON));
-        } else if (op->outputType() == ValueType::Matrix) {
-            const Matrix &grad = get<Matrix>(gradientOf(op));
-			if (auto it = m1.find(op); it != m1.end())
-				it->second = beta1 * get<Matrix>(it->second) + (1 - beta1) * grad;
-			else
-				m1.insert(make_pair(op, (1 - beta1) * grad));
-			if (auto it = m2.find(op); it != m2.end())
-				it->second = beta2 * get<Matrix>(it->second) + (1 - beta2) * grad.cwiseProduct(grad);
-			else
-				m2.insert(make_pair(op, (1 - beta2) * grad.cwiseProduct(grad)));
-			const auto& now1 = get<Matrix>(m1[op]).array();
-			const auto& now2 = get<Matrix>(m2[op]).array();
-            op->update(-alpha * corr * (now1 / (now2.sqrt() + EPSILON)).matrix());
+        if (!op->updatable())
+            continue;
+        auto size = op->parameters().size;
+        // Ops without parameters() are sized by their value
+        if (!op->parameters().value) {
+            Value value;
+            op->evalInto(nullptr, value);
+            size = sizeOf(value);
         }
+        params.push_back({ op, slotOf(op), coefficients, size });
+        for (size_t begin = 0; begin < size; begin += CHUNK)
+            chunks.push_back({ params.size() - 1, begin, min(size, begin + CHUNK) });
+        coefficients += size;
     }
+    spans.resize(params.size());
+    coalesced.resize(params.size());
+    densified.resize(params.size());
+    copies.resize(params.size());
+    originals.resize(params.size());
+    masterCopies.resize(params.size());
 }
 
-void AdamWOptimizer::update() {
-	for (const auto &op : topoOrder()) {
-		if (!op->updatable()) continue;
-		if (op->outputType() == ValueType::Scalar)
-			op->update(-lambda * get<Scalar>(valueOf(op)));
-		if (op->outputType() == ValueType::Matrix)
-			op->update(-lambda * get<Matrix>(valueOf(op)));
-	}
-	AdamOptimizer::update();
+template <typename Kernel>
+void Optimizer::forEachCoefficient(Kernel kernel) {
+    const auto self = shared_from_this();
+    for (size_t p = 0; p < params.size(); p++) {
+        const auto &param = params[p];
+        auto &span = spans[p];
+        const auto grad = gradientAt(param.slot);
+        if (!grad) {
+            span = { nullptr, nullptr, nullptr, nullptr };
+            continue;
+        }
+        if (static_cast<size_t>(sizeOf(*grad)) != param.size)
+            throw logic_error("the gradient of a parameter does not match its size");
+        span.sparse = nullptr;
+        if (holds_alternative<SparseColumns>(*grad)) {
+            const auto &sparse = get<SparseColumns>(*grad);
+            if (param.op->parameters().value) {
+                coalesced[p] = sparse;
+                coalesced[p].coalesce();
+                const auto &indices = coalesced[p].indices;
+                if (!indices.empty() && (indices.front() < 0 || indices.back() >= sparse.cols))
+                    throw out_of_range("sparse gradient column out of range");
+                span.sparse = &coalesced[p];
+                span.grad = nullptr;
+            } else {
+                densified[p] = sparse.dense();
+                span.grad = densified[p].data();
+            }
+        } else
+            span.grad = holds_alternative<Scalar>(*grad) ? &get<Scalar>(*grad) : get<Matrix>(*grad).data();
+        if (const auto parameters = param.op->parameters(); parameters.value) {
+            span.value = parameters.value;
+            span.master = parameters.master;
+            continue;
+        }
+        // Parameters are read from the ops rather than valueOf(), the gradients may have been computed
+        // by other executors (see DataParallelTrainer) and this one never evaluated the graph
+        param.op->evalInto(self, copies[p]);
+        originals[p] = copies[p];
+        span.value = holds_alternative<Scalar>(copies[p]) ? &get<Scalar>(copies[p]) : get<Matrix>(copies[p]).data();
+        if constexpr (MIXED_PRECISION) {
+            masterCopies[p].assign(span.value, span.value + param.size);
+            span.master = masterCopies[p].data();
+        } else
+            span.master = nullptr;
+    }
+    const auto count = static_cast<ptrdiff_t>(chunks.size());
+    #pragma omp parallel for schedule(static) if(coefficients >= PARALLEL_THRESHOLD)
+    for (ptrdiff_t c = 0; c < count; c++) {
+        const auto &chunk = chunks[c];
+        const auto &span = spans[chunk.param];
+        if (!span.grad)
+            continue;
+        kernel(span.value + chunk.begin, span.master ? span.master + chunk.begin : nullptr, span.grad + chunk.begin,
+               params[chunk.param].offset + chunk.begin, chunk.end - chunk.begin);
+    }
+    // A sparse gradient updates its columns, contiguous runs of coefficients and distinct once coalesced
+    for (size_t p = 0; p < params.size(); p++) {
+        const auto &span = spans[p];
+        if (!span.sparse)
+            continue;
+        const auto rows = static_cast<size_t>(span.sparse->rows());
+        const auto columns = span.sparse->indices.size();
+        #pragma omp parallel for schedule(static) if(rows * columns >= PARALLEL_THRESHOLD)
+        for (ptrdiff_t k = 0; k < static_cast<ptrdiff_t>(columns); k++) {
+            const auto begin = static_cast<size_t>(span.sparse->indices[k]) * rows;
+            kernel(span.value + begin, span.master ? span.master + begin : nullptr, span.sparse->values.col(k).data(),
+                   params[p].offset + begin, rows);
+        }
+    }
+    for (size_t p = 0; p < params.size(); p++) {
+        if (!spans[p].grad || params[p].op->parameters().value)
+            continue;
+        if (holds_alternative<Scalar>(copies[p]))
+            params[p].op->update(get<Scalar>(copies[p]) - get<Scalar>(originals[p]));
+        else {
+            get<Matrix>(copies[p]) -= get<Matrix>(originals[p]);
+            params[p].op->update(copies[p]);
+        }
+    }
+}
+
+void SGDOptimizer::update() {
+    const auto step = static_cast<Scalar>(-rate);
+    forEachCoefficient([step](Scalar *value, MasterScalar *master, const Scalar *grad, size_t, const size_t n) {
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++)
+            add(value, master, i, step * grad[i]);
+    });
+}
+
+namespace {
+    // The decay of AdamW is applied first, from the value seen by the graph
+    template <bool DECAY>
+    void adamKernel(Scalar *value, MasterScalar *master, const Scalar *grad, Scalar *m1, Scalar *m2, const size_t n,
+                    const Scalar beta1, const Scalar beta2, const Scalar step, const Scalar epsilon,
+                    const Scalar lambda) {
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            m1[i] = beta1 * m1[i] + (1 - beta1) * grad[i];
+            m2[i] = beta2 * m2[i] + (1 - beta2) * (grad[i] * grad[i]);
+            if constexpr (DECAY)
+                add(value, master, i, -lambda * value[i]);
+            add(value, master, i, step * (m1[i] / (std::sqrt(m2[i]) + epsilon)));
+        }
+    }
+}
+
+void AdamOptimizer::update(const Scalar lambda) {
+    updates++;
+    const auto corr = static_cast<Scalar>(sqrt(1 - pow(beta2, updates)) / (1 - pow(beta1, updates)));
+    const auto step = -alpha * corr;
+    forEachCoefficient([&](Scalar *value, MasterScalar *master, const Scalar *grad, const size_t offset, const size_t n) {
+        if (lambda != 0)
+            adamKernel<true>(value, master, grad, &m1[offset], &m2[offset], n, beta1, beta2, step, EPSILON, lambda);
+        else
+            adamKernel<false>(value, master, grad, &m1[offset], &m2[offset], n, beta1, beta2, step, EPSILON, lambda);
+    });
 }
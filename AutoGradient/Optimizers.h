@@ -5,41 +5,103 @@
 #ifndef AUTOGRADIENT_OPTIMIZERS_H
 #define AUTOGRADIENT_OPTIMIZERS_H
 
+#include <string>
+#include <utility>
+#include <cstdint>
 #include "Executor.h"
 
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // Updates are single passes over the coefficients of every parameter, run in place through
+    // Operator::parameters(). Per-coefficient state (moments ...) lives in flat buffers indexed by
+    // Param::offset, so an update neither hashes ops nor allocates, and small parameters are batched.
+    // A sparse gradient (SparseColumns, see EmbeddingOp) only updates the columns it has, along with their
+    // state: the update of a large table costs as much as the columns read. For Adam that is the lazy variant,
+    // the moments of the other columns are left as they are rather than decayed
     class Optimizer : public Executor {
+        // Coefficients per task of an update: small parameters are one task each, large ones are split
+        static constexpr size_t CHUNK = 4096;
+        // Below this many coefficients an update runs on one thread
+        static constexpr size_t PARALLEL_THRESHOLD = 1 << 15;
+        struct Chunk {
+            size_t param, begin, end;
+        };
+        std::vector<Chunk> chunks;
+        // Where the coefficients and the gradient of every parameter are during an update, null when the
+        // gradient did not reach it. Sparse gradients are in sparse instead of grad
+        struct Span {
+            Scalar *value;
+            MasterScalar *master;
+            const Scalar *grad;
+            const SparseColumns *sparse;
+        };
+        std::vector<Span> spans;
+        // Sparse gradients with their repeated columns summed, and densified for ops without parameters()
+        std::vector<SparseColumns> coalesced;
+        std::vector<Matrix> densified;
+        // Copies updated in place of the values of ops without parameters(), handed back through update()
+        std::vector<Value> copies, originals;
+        std::vector<std::vector<MasterScalar>> masterCopies;
     public:
-        explicit Optimizer(const OpPtr &resultOp) : Executor(resultOp) {}
+        // The updatable ops in topological order, their slots, and where their coefficients begin in the flat buffers
+        struct Param {
+            OpPtr op;
+            size_t slot, offset, size;
+        };
+        // Per-coefficient buffers, laid out like the flat buffers, and counters: what a checkpoint saves
+        struct State {
+            std::vector<std::pair<std::string, std::vector<Scalar> *>> buffers;
+            std::vector<std::pair<std::string, std::uint64_t *>> counters;
+        };
+    protected:
+        std::vector<Param> params;
+        size_t coefficients = 0;
+        // Calls kernel(value, master, grad, offset, n) for runs of n coefficients of the parameters that have a
+        // gradient, possibly from several threads. offset is the index of the first one in the flat buffers
+        template <typename Kernel>
+        void forEachCoefficient(Kernel kernel);
+    public:
+        explicit Optimizer(const OpPtr &resultOp, const ExecutorOptions &options = {});
         virtual void update() = 0;
+        virtual State state() { return {}; }
+        const std::vector<Param> &parameterList() const { return params; }
     };
 
     class SGDOptimizer : public Optimizer {
         double rate;
     public:
-        SGDOptimizer(const OpPtr &resultOp, double rate) : Optimizer(resultOp), rate(rate) {}
+        SGDOptimizer(const OpPtr &resultOp, double rate, const ExecutorOptions &options = {})
+            : Optimizer(resultOp, options), rate(rate) {}
         void update() override;
     };
 
     class AdamOptimizer : public Optimizer {
         const Scalar EPSILON = static_cast<Scalar>(1e-8);
         Scalar alpha, beta1, beta2;
-		size_t updates;
-        std::unordered_map<OpPtr, Value> m1, m2;
+		std::uint64_t updates;
+        // First and second moments, flat
+        std::vector<Scalar> m1, m2;
+    protected:
+        // One Adam step, after decaying the parameters by lambda (AdamW)
+        void update(Scalar lambda);
     public:
-        explicit AdamOptimizer(const OpPtr &resultOp, Scalar alpha = 0.001, Scalar beta1 = 0.9, Scalar beta2 = 0.999)
-            : Optimizer(resultOp), alpha(alpha), beta1(beta1), beta2(beta2), updates(0) {}
-        void update() override;
+        explicit AdamOptimizer(const OpPtr &resultOp, Scalar alpha = 0.001, Scalar beta1 = 0.9, Scalar beta2 = 0.999,
+                               const ExecutorOptions &options = {})
+            : Optimizer(resultOp, options), alpha(alpha), beta1(beta1), beta2(beta2), updates(0),
+              m1(coefficients), m2(coefficients) {}
+        void update() override { update(0); }
+        State state() override { return { { { "m1", &m1 }, { "m2", &m2 } }, { { "updates", &updates } } }; }
     };
 	
 	class AdamWOptimizer : public AdamOptimizer {
-        const Scalar EPSILON = static_cast<Scalar>(1e-8);
         Scalar lambda;
     public:
-        AdamWOptimizer(const OpPtr &resultOp, Scalar lambda, Scalar alpha = 0.001, Scalar beta1 = 0.9, Scalar beta2 = 0.999)
-            : lambda(lambda), AdamOptimizer(resultOp, alpha, beta1, beta2) {}
-        void update() override;
+        AdamWOptimizer(const OpPtr &resultOp, Scalar lambda, Scalar alpha = 0.001, Scalar beta1 = 0.9, Scalar beta2 = 0.999,
+                       const ExecutorOptions &options = {})
+            : AdamOptimizer(resultOp, alpha, beta1, beta2, options), lambda(lambda) {}
+        void update() override { AdamOptimizer::update(lambda); }
     };
 }
+}
 
 #endif //AUTOGRADIENT_OPTIMIZERS_H
@@ -0,0 +1,98 @@
+//
+// Per-op timings of Executor::propagate(), see Executor::setProfiler()
+//
+
+#include "Profiler.h"
+#include <map>
+#include <tuple>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    const char *phaseName(const Profiler::Phase phase) {
+        switch (phase) {
+            case Profiler::Phase::Forward: return "forward";
+            case Profiler::Phase::Backward: return "backward";
+            case Profiler::Phase::Recompute: return "recompute";
+        }
+        return "";
+    }
+
+    double microseconds(const Profiler::Clock::duration d) {
+        return chrono::duration<double, micro>(d).count();
+    }
+}
+
+void Profiler::record(const vector<Event> &pass) {
+    lock_guard<std::mutex> lock(mutex);
+    for (const auto &event : pass)
+        if (!event.name.empty())
+            events.push_back(event);
+}
+
+void Profiler::clear() {
+    lock_guard<std::mutex> lock(mutex);
+    events.clear();
+    origin = Clock::now();
+}
+
+string Profiler::table() const {
+    struct Row {
+        size_t calls = 0;
+        double us = 0, flops = 0;
+        size_t bytes = 0;
+    };
+    map<pair<string, Phase>, Row> rows;
+    {
+        lock_guard<std::mutex> lock(mutex);
+        for (const auto &event : events) {
+            auto &row = rows[make_pair(event.name, event.phase)];
+            row.calls++;
+            row.us += microseconds(event.end - event.start);
+            row.flops += event.flops;
+            row.bytes += event.bytes;
+        }
+    }
+    vector<pair<pair<string, Phase>, Row>> sorted(rows.begin(), rows.end());
+    stable_sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second.us > b.second.us; });
+    double total = 0;
+    for (const auto &[key, row] : sorted)
+        total += row.us;
+    stringstream ss;
+    ss << left << setw(48) << "op" << setw(10) << "phase" << right << setw(10) << "calls" << setw(12) << "total ms"
+       << setw(8) << "%" << setw(12) << "avg us" << setw(10) << "GFLOP/s" << setw(12) << "alloc KB" << endl;
+    ss << fixed;
+    for (const auto &[key, row] : sorted)
+        ss << left << setw(48) << key.first << setw(10) << phaseName(key.second) << right << setw(10) << row.calls
+           << setw(12) << setprecision(3) << row.us / 1000 << setw(8) << setprecision(1) << 100 * row.us / max(total, 1e-9)
+           << setw(12) << setprecision(2) << row.us / row.calls << setw(10) << setprecision(2)
+           << row.flops / max(row.us, 1e-9) / 1000 << setw(12) << setprecision(1) << row.bytes / 1024.0 << endl;
+    return ss.str();
+}
+
+string Profiler::chromeTrace() const {
+    lock_guard<std::mutex> lock(mutex);
+    unordered_map<thread::id, size_t> tids;
+    stringstream ss;
+    ss << "{\"traceEvents\":[" << fixed << setprecision(3);
+    for (size_t k = 0; k < events.size(); k++) {
+        const auto &event = events[k];
+        const auto tid = tids.insert(make_pair(event.thread, tids.size())).first->second;
+        ss << (k > 0 ? "," : "") << endl << "{\"name\":\"";
+        for (const auto c : event.name) {
+            if (c == '"' || c == '\\')
+                ss << '\\';
+            ss << c;
+        }
+        ss << "\",\"cat\":\"" << phaseName(event.phase) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+           << ",\"ts\":" << microseconds(event.start - origin) << ",\"dur\":" << microseconds(event.end - event.start)
+           << ",\"args\":{\"flops\":" << setprecision(0) << event.flops << ",\"bytes\":" << event.bytes << "}}"
+           << setprecision(3);
+    }
+    ss << endl << "]}";
+    return ss.str();
+}
@@ -0,0 +1,54 @@
+//
+// Per-op timings of Executor::propagate(), see Executor::setProfiler()
+//
+
+#ifndef AUTOGRADIENT_PROFILER_H
+#define AUTOGRADIENT_PROFILER_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include "Value.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // Collects one event per step run by the executors it is set on, any number of them at once
+    class Profiler {
+    public:
+        using Clock = std::chrono::steady_clock;
+        enum class Phase {
+            Forward,
+            Backward,
+            Recompute,	// forward evals repeated by gradient checkpointing
+        };
+        struct Event {
+            // Registered name of the op, as in Executor::graph(), empty for a step that did not run
+            std::string name;
+            Phase phase = Phase::Forward;
+            Clock::time_point start, end;
+            // Estimated by Operator::flops()
+            double flops = 0;
+            // Value and gradient buffers the step had to (re)allocate, scratch buffers are not seen
+            size_t bytes = 0;
+            std::thread::id thread;
+        };
+    private:
+        mutable std::mutex mutex;
+        std::vector<Event> events;
+        Clock::time_point origin = Clock::now();
+    public:
+        // Appends the events that ran, called by the executors once per pass
+        void record(const std::vector<Event> &pass);
+        void clear();
+        // Per op type and phase: calls, time, GFLOP/s and bytes allocated, the most expensive first
+        std::string table() const;
+        // Chrome trace-event JSON, to be opened in chrome://tracing or Perfetto. One row per thread
+        std::string chromeTrace() const;
+    };
+}
+}
+
+#endif //AUTOGRADIENT_PROFILER_H
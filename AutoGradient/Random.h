@@ -3,9 +3,39 @@
 
 #include <random>
 #include <chrono>
+#include <cstdint>
+#include <atomic>
 
 namespace autograd {
+	// Seed of the whole library, unset means seeding from the clock. Atomic, RNGs are created from any thread
+	// (e.g. the executors of concurrent InferenceSession::run() calls)
+	struct GlobalSeed {
+		std::atomic<bool> set{ false };
+		// The seed of the next RNG, incremented by every one created
+		std::atomic<std::uint64_t> next{ 0 };
+	};
+	inline GlobalSeed &globalSeed() {
+		static GlobalSeed seed;
+		return seed;
+	}
+
+	// Makes every RNG created from now on (initializers, executors ...) reproducible
+	inline void setGlobalSeed(const std::uint64_t seed) {
+		globalSeed().next = seed;
+		globalSeed().set = true;
+	}
+
+	// Combines two values into a well-mixed 64-bit seed (splitmix64), used to derive independent streams
+	inline std::uint64_t mixSeed(std::uint64_t a, const std::uint64_t b) {
+		a += 0x9e3779b97f4a7c15ULL * (b + 1);
+		a = (a ^ (a >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		a = (a ^ (a >> 27)) * 0x94d049bb133111ebULL;
+		return a ^ (a >> 31);
+	}
+
 	inline std::mt19937_64 seededRNG() {
+		if (auto &seed = globalSeed(); seed.set)
+			return std::mt19937_64(mixSeed(seed.next++, 0));
 		return std::mt19937_64(
 			std::chrono::high_resolution_clock::now()
 			.time_since_epoch().count()
@@ -13,4 +43,4 @@ namespace autograd {
 	}
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,210 @@
+//
+// Recurrent cells, graphs unrolled over a sequence, plans cached per number of steps and truncated BPTT
+//
+
+#include "Recurrent.h"
+#include "BasicOps.h"
+#include "AdvancedOps.h"
+#include "Functions.h"
+#include "InitUtils.h"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    // Uniform in +-1 / sqrt(hidden)
+    OpPtr weights(const size_t rows, const size_t cols, const size_t hidden) {
+        return parameter(randUniform(rows, cols, 1 / sqrt(static_cast<double>(hidden))));
+    }
+}
+
+LSTMCell::LSTMCell(const size_t inputSize, const size_t hiddenSize) : hidden(hiddenSize) {
+    for (size_t k = 0; k < 4; k++) {
+        wx[k] = weights(hidden, inputSize, hidden);
+        wh[k] = weights(hidden, hidden, hidden);
+        b[k] = parameter(Matrix::Constant(static_cast<Eigen::Index>(hidden), 1, k == 1 ? 1 : 0).eval());
+    }
+}
+
+RecurrentState LSTMCell::operator ()(const OpPtr &x, const RecurrentState &state) const {
+    if (state.size() != 2)
+        throw invalid_argument("the state of an LSTM cell is (h, c)");
+    const auto gate = [&](const size_t k) { return wx[k] * x + wh[k] * state[0] + b[k]; };
+    const auto i = sigmoid(gate(0)), f = sigmoid(gate(1)), g = autograd::tanh(gate(2)), o = sigmoid(gate(3));
+    const auto c = cwiseProduct(f, state[1]) + cwiseProduct(i, g);
+    return { cwiseProduct(o, autograd::tanh(c)), c };
+}
+
+vector<OpPtr> LSTMCell::parameters() const {
+    vector<OpPtr> ret;
+    for (size_t k = 0; k < 4; k++)
+        ret.insert(ret.end(), { wx[k], wh[k], b[k] });
+    return ret;
+}
+
+GRUCell::GRUCell(const size_t inputSize, const size_t hiddenSize) : hidden(hiddenSize) {
+    for (size_t k = 0; k < 3; k++) {
+        wx[k] = weights(hidden, inputSize, hidden);
+        wh[k] = weights(hidden, hidden, hidden);
+        bx[k] = weights(hidden, 1, hidden);
+        bh[k] = weights(hidden, 1, hidden);
+    }
+}
+
+RecurrentState GRUCell::operator ()(const OpPtr &x, const RecurrentState &state) const {
+    if (state.size() != 1)
+        throw invalid_argument("the state of a GRU cell is (h)");
+    const auto &h = state[0];
+    const auto r = sigmoid(wx[0] * x + bx[0] + (wh[0] * h + bh[0]));
+    const auto z = sigmoid(wx[1] * x + bx[1] + (wh[1] * h + bh[1]));
+    const auto n = autograd::tanh(wx[2] * x + bx[2] + cwiseProduct(r, wh[2] * h + bh[2]));
+    return { n + cwiseProduct(z, h - n) };
+}
+
+vector<OpPtr> GRUCell::parameters() const {
+    vector<OpPtr> ret;
+    for (size_t k = 0; k < 3; k++)
+        ret.insert(ret.end(), { wx[k], wh[k], bx[k], bh[k] });
+    return ret;
+}
+
+vector<RecurrentState> autograd::scan(const CellFunction &cell, const vector<OpPtr> &xs, RecurrentState initial,
+                                      const vector<OpPtr> &masks) {
+    if (!masks.empty() && masks.size() != xs.size())
+        throw invalid_argument("one mask per step is expected");
+    vector<RecurrentState> ret;
+    ret.reserve(xs.size());
+    auto state = move(initial);
+    for (size_t t = 0; t < xs.size(); t++) {
+        auto next = cell(xs[t], state);
+        if (next.size() != state.size())
+            throw logic_error("a cell changed the size of its state");
+        // prev + mask * (next - prev): the masked columns keep prev, and pass its gradient through
+        if (!masks.empty())
+            for (size_t s = 0; s < next.size(); s++)
+                next[s] = state[s] + maskColumns(next[s] - state[s], masks[t]);
+        state = next;
+        ret.push_back(move(next));
+    }
+    return ret;
+}
+
+UnrolledPlans::Plan::Plan(UnrolledGraph graph, const ExecutorOptions &options)
+    : Executor(graph.loss, options), graph(move(graph)) {
+    for (const auto &op : topoOrder())
+        if (op->updatable())
+            parameters.push_back(op);
+    // Marks the inputs as fed right away, so that invalid ones are reported here
+    for (const auto &step : this->graph.inputs)
+        for (const auto &in : step)
+            feed(in);
+    for (const auto &in : this->graph.masks)
+        feed(in);
+    for (const auto &in : this->graph.initial)
+        feed(in);
+}
+
+UnrolledPlans::Plan &UnrolledPlans::operator [](const size_t steps) {
+    auto &plan = plans[steps];
+    if (plan)
+        return *plan;
+    auto graph = unroll(steps);
+    if (graph.inputs.size() != steps || (!graph.masks.empty() && graph.masks.size() != steps))
+        throw logic_error("the unrolled graph does not have the number of steps asked for");
+    if (graph.initial.size() != graph.final.size() || graph.stateRows.size() != graph.initial.size())
+        throw logic_error("the initial and the final state of an unrolled graph do not match");
+    auto withFinal = options;
+    withFinal.keep.insert(withFinal.keep.end(), graph.final.begin(), graph.final.end());
+    try {
+        plan = make_shared<Plan>(move(graph), withFinal);
+    } catch (...) {
+        plans.erase(steps);
+        throw;
+    }
+    return *plan;
+}
+
+SequenceTrainer::SequenceTrainer(shared_ptr<Optimizer> optimizer, UnrollFunction unroll, const size_t window,
+                                 const size_t bucket, ExecutorOptions options)
+    : optimizer(move(optimizer)), plans(move(unroll), move(options)), window(window), bucket(bucket) {
+    if (bucket == 0)
+        throw invalid_argument("buckets of at least one step are needed");
+}
+
+size_t SequenceTrainer::paddedSteps(const size_t steps) const {
+    const auto padded = (steps + bucket - 1) / bucket * bucket;
+    return window ? min(padded, window) : padded;
+}
+
+Scalar SequenceTrainer::step(const vector<vector<Matrix>> &steps, const vector<size_t> &lengths) {
+    if (steps.empty())
+        return 0;
+    const auto total = steps.size();
+    const auto &first = steps.front();
+    const auto batch = first.front().cols();
+    if (!lengths.empty() && lengths.size() != static_cast<size_t>(batch))
+        throw invalid_argument("one length per sample is expected");
+    for (const auto &inputs : steps) {
+        if (inputs.size() != first.size())
+            throw invalid_argument("every step needs the same inputs");
+        for (size_t i = 0; i < inputs.size(); i++)
+            if (inputs[i].rows() != first[i].rows() || inputs[i].cols() != batch)
+                throw invalid_argument("the inputs of the steps do not have the same shape");
+    }
+    const auto lengthOf = [&](const Eigen::Index j) {
+        return lengths.empty() ? total : min(lengths[static_cast<size_t>(j)], total);
+    };
+    size_t longest = 0, shortest = total;
+    for (Eigen::Index j = 0; j < batch; j++) {
+        longest = std::max(longest, lengthOf(j));
+        shortest = std::min(shortest, lengthOf(j));
+    }
+    const auto windowSteps = window ? window : longest;
+    // Without masks the state would go on evolving over the padded steps, checked before any update
+    for (size_t begin = 0; begin < longest; begin += windowSteps) {
+        const auto padded = paddedSteps(min(windowSteps, longest - begin));
+        if (shortest < begin + padded && plans[padded].graph.masks.empty())
+            throw invalid_argument("padded steps need an unrolled graph with masks, see UnrolledGraph::masks");
+    }
+    Matrix mask(1, batch);
+    Scalar loss = 0;
+    for (size_t begin = 0; begin < longest; begin += windowSteps) {
+        const auto count = min(windowSteps, longest - begin);
+        auto &plan = plans[paddedSteps(count)];
+        const auto &graph = plan.graph;
+        for (size_t t = 0; t < graph.inputs.size(); t++) {
+            const auto at = begin + t;
+            for (Eigen::Index j = 0; j < batch; j++)
+                mask(0, j) = at < lengthOf(j) ? 1 : 0;
+            if (!graph.masks.empty())
+                plan.feed(graph.masks[t], mask);
+            if (graph.inputs[t].size() != first.size())
+                throw logic_error("the unrolled graph does not have one op per input");
+            for (size_t i = 0; i < first.size(); i++) {
+                auto &in = matrixOf(plan.feed(graph.inputs[t][i]), first[i].rows(), batch);
+                if (at < total)
+                    in = steps[at][i] * mask.row(0).asDiagonal();
+                else
+                    in.setZero();
+            }
+        }
+        carried.resize(graph.initial.size());
+        for (size_t s = 0; s < graph.initial.size(); s++) {
+            if (begin == 0)
+                carried[s] = Matrix::Zero(graph.stateRows[s], batch);
+            plan.feed(graph.initial[s], carried[s]);
+        }
+        plan.clearGradient();
+        loss += get<Scalar>(plan.propagate());
+        for (size_t s = 0; s < graph.final.size(); s++)
+            carried[s] = get<Matrix>(plan.valueOf(graph.final[s]));
+        optimizer->clearGradient();
+        for (const auto &param : plan.parameters)
+            optimizer->accumulateGradient(param, plan.gradientOf(param));
+        optimizer->update();
+    }
+    return loss;
+}
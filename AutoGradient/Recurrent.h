@@ -0,0 +1,125 @@
+//
+// Recurrent cells, graphs unrolled over a sequence, plans cached per number of steps and truncated BPTT
+//
+
+#ifndef AUTOGRADIENT_RECURRENT_H
+#define AUTOGRADIENT_RECURRENT_H
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <functional>
+#include "Optimizers.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // The state a recurrent cell carries from one step to the next, e.g. (h, c) for LSTMCell
+    using RecurrentState = std::vector<OpPtr>;
+    // One step of a recurrent cell: the next state from the input of the step (one sample per column) and the
+    // previous state. The output of the step is the first op of the state
+    using CellFunction = std::function<RecurrentState(const OpPtr &x, const RecurrentState &state)>;
+
+    // The gates are sigmoid(wx * x + wh * h + b) per gate (input, forget, candidate with tanh, output).
+    // The forget bias starts at 1. Every step built by the cell shares its parameters
+    class LSTMCell {
+        OpPtr wx[4], wh[4], b[4];
+        size_t hidden;
+    public:
+        LSTMCell(size_t inputSize, size_t hiddenSize);
+        // (h, c)
+        RecurrentState operator ()(const OpPtr &x, const RecurrentState &state) const;
+        // Rows of every op of the state
+        std::vector<Eigen::Index> stateRows() const {
+            return { static_cast<Eigen::Index>(hidden), static_cast<Eigen::Index>(hidden) };
+        }
+        std::vector<OpPtr> parameters() const;
+    };
+
+    // Reset and update gates r and z, h' = n + z * (h - n) with n = tanh(wx * x + bx + r * (wh * h + bh))
+    class GRUCell {
+        OpPtr wx[3], wh[3], bx[3], bh[3];
+        size_t hidden;
+    public:
+        GRUCell(size_t inputSize, size_t hiddenSize);
+        // (h)
+        RecurrentState operator ()(const OpPtr &x, const RecurrentState &state) const;
+        std::vector<Eigen::Index> stateRows() const { return { static_cast<Eigen::Index>(hidden) }; }
+        std::vector<OpPtr> parameters() const;
+    };
+
+    // Unrolls cell over xs, the states after every step. With masks (a 0/1 row per step, see UnrolledGraph),
+    // the columns whose mask is 0 keep the state they had, so a sample ends with the state of its last step
+    std::vector<RecurrentState> scan(const CellFunction &cell, const std::vector<OpPtr> &xs, RecurrentState initial,
+                                     const std::vector<OpPtr> &masks = {});
+
+    // A graph unrolled over a fixed number of steps, as built by an UnrollFunction. Every op listed here
+    // is an input op (no inputs, e.g. constant(Matrix())) except final and loss
+    struct UnrolledGraph {
+        // inputs[t][i] receives input i of step t, one sample per column
+        std::vector<std::vector<OpPtr>> inputs;
+        // A row per step, 1 for the samples the step belongs to and 0 for the padding past their end. Empty
+        // if the graph is never padded
+        std::vector<OpPtr> masks;
+        // The state before the first step, and its rows (zeros start a sequence)
+        RecurrentState initial;
+        std::vector<Eigen::Index> stateRows;
+        // The state after the last step, fed to initial to go on with the sequence
+        RecurrentState final;
+        OpPtr loss;
+    };
+    using UnrollFunction = std::function<UnrolledGraph(size_t steps)>;
+
+    // Graphs unrolled over different numbers of steps and their executors, built on first use and kept: every
+    // length is compiled once, the graphs of all of them share the parameters of the cells
+    class UnrolledPlans {
+    public:
+        class Plan : public Executor {
+        public:
+            UnrolledGraph graph;
+            // The updatable ops of the graph
+            std::vector<OpPtr> parameters;
+            Plan(UnrolledGraph graph, const ExecutorOptions &options);
+        };
+    private:
+        UnrollFunction unroll;
+        ExecutorOptions options;
+        std::map<size_t, std::shared_ptr<Plan>> plans;
+    public:
+        // The final states are added to options.keep
+        explicit UnrolledPlans(UnrollFunction unroll, ExecutorOptions options = {})
+            : unroll(std::move(unroll)), options(std::move(options)) {}
+        Plan &operator [](size_t steps);
+        // Number of lengths compiled so far
+        size_t size() const { return plans.size(); }
+        void clear() { plans.clear(); }
+    };
+
+    // Trains on minibatches of sequences with truncated backpropagation through time: a sequence is cut into
+    // windows of at most window steps (all of them with 0), each one propagated by the plan of its length and
+    // followed by an update, its final state carried into the next window as a constant so that gradients stop
+    // at its beginning. The steps of a window are padded to a multiple of bucket (capped by window), which bounds
+    // the number of plans: sequences of any length reuse the same few. Padded columns of the inputs are zero and
+    // masked (see UnrolledGraph::masks), losses weighed by their targets (e.g. one-hot softmaxCrossEntropy) sum
+    // nothing over them, others should be masked with maskColumns().
+    // Gradients are computed by the plans and handed to optimizer, whose graph must hold every parameter
+    // (e.g. built on the loss of any UnrolledGraph)
+    class SequenceTrainer {
+        std::shared_ptr<Optimizer> optimizer;
+        UnrolledPlans plans;
+        size_t window, bucket;
+        std::vector<Matrix> carried;
+    public:
+        SequenceTrainer(std::shared_ptr<Optimizer> optimizer, UnrollFunction unroll, size_t window = 0,
+                        size_t bucket = 1, ExecutorOptions options = {});
+        // One minibatch: steps[t][i] goes to input i of step t, one sample per column. Sample j lasts lengths[j]
+        // steps, all of them if lengths is empty. Returns the loss summed over the windows. Throws invalid_argument
+        // if a window would be padded (see paddedSteps()) and its unrolled graph has no masks
+        Scalar step(const std::vector<std::vector<Matrix>> &steps, const std::vector<size_t> &lengths = {});
+        // The number of steps of the plan of a window of steps steps
+        size_t paddedSteps(size_t steps) const;
+        UnrolledPlans &unrolledPlans() { return plans; }
+    };
+}
+}
+
+#endif //AUTOGRADIENT_RECURRENT_H
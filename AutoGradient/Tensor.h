@@ -0,0 +1,271 @@
+//
+// Contiguous, strided N-d tensor: the multi-dimensional alternative of Value
+//
+
+#ifndef AUTOGRADIENT_TENSOR_H
+#define AUTOGRADIENT_TENSOR_H
+
+#include "Eigen/Dense"
+#include <array>
+#include <memory>
+#include <initializer_list>
+#include <stdexcept>
+#include <iostream>
+
+namespace autograd {
+    // Up to MAX_RANK dimensions, column-major: the first index moves fastest, so the first two dimensions of a
+    // contiguous tensor are laid out exactly like an Eigen matrix, and the sub-tensors along the last dimension
+    // are contiguous blocks (e.g. rows x cols x channels x batch).
+    // Copies are deep, like Eigen matrices. Views (slice(), narrow(), reshape()) share the storage of the tensor
+    // they are taken from, writes through a view are seen by every tensor sharing the storage.
+    // Assigning a tensor of the same shape writes the coefficients in place (through the view if this is one),
+    // assigning one of another shape gives this tensor a storage of its own
+    template <typename T>
+    class BasicTensor {
+    public:
+        using Index = Eigen::Index;
+        static constexpr int MAX_RANK = 4;
+        using Shape = std::array<Index, MAX_RANK>;
+        using MatrixType = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+        using MatrixMap = Eigen::Map<MatrixType, Eigen::Unaligned, Eigen::OuterStride<>>;
+        using ConstMatrixMap = Eigen::Map<const MatrixType, Eigen::Unaligned, Eigen::OuterStride<>>;
+        using ArrayMap = Eigen::Map<Eigen::Array<T, Eigen::Dynamic, 1>>;
+        using ConstArrayMap = Eigen::Map<const Eigen::Array<T, Eigen::Dynamic, 1>>;
+    private:
+        std::shared_ptr<T[]> storage;
+        Index capacity = 0, offset = 0;
+        int dims = 1;
+        // Dimensions past the rank have size 1
+        Shape shape{ 0, 1, 1, 1 }, strides{ 1, 0, 0, 0 };
+        struct ViewTag {};
+        BasicTensor(const BasicTensor &other, ViewTag)
+            : storage(other.storage), capacity(other.capacity), offset(other.offset),
+              dims(other.dims), shape(other.shape), strides(other.strides) {}
+        // Back to the state of a default-constructed tensor
+        void clear() noexcept {
+            storage.reset();
+            capacity = offset = 0;
+            dims = 1;
+            shape = { 0, 1, 1, 1 };
+            strides = { 1, 0, 0, 0 };
+        }
+        // Calls f(a, b) on every pair of coefficients of this and other, which must have the same shape
+        template <typename F>
+        void zip(const BasicTensor &other, F f) {
+            if (shape != other.shape)
+                throw std::invalid_argument("tensor shapes do not match");
+            if (contiguous() && other.contiguous()) {
+                T *a = data();
+                const T *b = other.data();
+                for (Index i = 0, n = size(); i < n; i++)
+                    f(a[i], b[i]);
+                return;
+            }
+            for (Index l = 0; l < shape[3]; l++)
+                for (Index k = 0; k < shape[2]; k++)
+                    for (Index j = 0; j < shape[1]; j++)
+                        for (Index i = 0; i < shape[0]; i++)
+                            f((*this)(i, j, k, l), other(i, j, k, l));
+        }
+    public:
+        BasicTensor() = default;
+        // An uninitialized tensor of the given shape
+        BasicTensor(std::initializer_list<Index> newShape) { resize(newShape); }
+        BasicTensor(const BasicTensor &other) { resizeLike(other); zip(other, [](T &a, const T &b) { a = b; }); }
+        // A moved-from tensor is left empty, like a moved-from Eigen matrix, so that it never keeps a shape
+        // without storage
+        BasicTensor(BasicTensor &&other) noexcept
+            : storage(std::move(other.storage)), capacity(other.capacity), offset(other.offset),
+              dims(other.dims), shape(other.shape), strides(other.strides) { other.clear(); }
+        BasicTensor &operator =(const BasicTensor &other) {
+            if (this == &other)
+                return *this;
+            if (dims != other.dims || shape != other.shape)
+                resizeLike(other);
+            zip(other, [](T &a, const T &b) { a = b; });
+            return *this;
+        }
+        BasicTensor &operator =(BasicTensor &&other) noexcept {
+            if (this == &other)
+                return *this;
+            storage = std::move(other.storage);
+            capacity = other.capacity;
+            offset = other.offset;
+            dims = other.dims;
+            shape = other.shape;
+            strides = other.strides;
+            other.clear();
+            return *this;
+        }
+        // A tensor holding a copy of m
+        static BasicTensor fromMatrix(const MatrixType &m) {
+            BasicTensor ret{ m.rows(), m.cols() };
+            ret.matrix() = m;
+            return ret;
+        }
+
+        int rank() const { return dims; }
+        Index dim(const int i) const { return shape[i]; }
+        Index stride(const int i) const { return strides[i]; }
+        const Shape &dimensions() const { return shape; }
+        Index size() const { return shape[0] * shape[1] * shape[2] * shape[3]; }
+        bool contiguous() const {
+            Index expected = 1;
+            for (int i = 0; i < MAX_RANK; expected *= shape[i++])
+                if (shape[i] != 1 && strides[i] != expected)
+                    return false;
+            return true;
+        }
+        bool sameShape(const BasicTensor &other) const { return dims == other.dims && shape == other.shape; }
+        T *data() { return storage.get() + offset; }
+        const T *data() const { return storage.get() + offset; }
+        T &operator ()(const Index i, const Index j = 0, const Index k = 0, const Index l = 0) {
+            return data()[i * strides[0] + j * strides[1] + k * strides[2] + l * strides[3]];
+        }
+        const T &operator ()(const Index i, const Index j = 0, const Index k = 0, const Index l = 0) const {
+            return data()[i * strides[0] + j * strides[1] + k * strides[2] + l * strides[3]];
+        }
+
+        // Makes this a contiguous tensor of the given shape. The storage is kept if it is large enough and not
+        // shared with a view, so that resizing to the same shape over and over does not allocate
+        void resize(const Shape &newShape, const int rank) {
+            if (rank < 1 || rank > MAX_RANK)
+                throw std::invalid_argument("unsupported tensor rank");
+            Index n = 1;
+            for (int i = 0; i < rank; i++)
+                n *= newShape[i];
+            if (!storage || storage.use_count() != 1 || capacity < n) {
+                storage.reset(new T[n]);
+                capacity = n;
+            }
+            offset = 0;
+            dims = rank;
+            for (int i = 0; i < MAX_RANK; i++) {
+                shape[i] = i < rank ? newShape[i] : 1;
+                strides[i] = i == 0 ? 1 : strides[i - 1] * shape[i - 1];
+            }
+        }
+        void resize(std::initializer_list<Index> newShape) {
+            if (newShape.size() > MAX_RANK)
+                throw std::invalid_argument("unsupported tensor rank");
+            Shape s{ 1, 1, 1, 1 };
+            std::copy(newShape.begin(), newShape.end(), s.begin());
+            resize(s, static_cast<int>(newShape.size()));
+        }
+        void resizeLike(const BasicTensor &other) { resize(other.shape, other.dims); }
+
+        // Sub-tensor at index i of the last dimension, one rank less (a rank 1 tensor gives a single coefficient)
+        BasicTensor slice(const Index i) const {
+            BasicTensor ret(*this, ViewTag{});
+            const auto last = dims - 1;
+            ret.offset += i * strides[last];
+            if (dims > 1) {
+                ret.shape[last] = 1;
+                ret.dims--;
+            } else
+                ret.shape[0] = 1;
+            return ret;
+        }
+        // Entries [begin, begin + count) of dimension axis
+        BasicTensor narrow(const int axis, const Index begin, const Index count) const {
+            if (axis < 0 || axis >= dims || begin < 0 || begin + count > shape[axis])
+                throw std::out_of_range("tensor narrowed out of its bounds");
+            BasicTensor ret(*this, ViewTag{});
+            ret.offset += begin * strides[axis];
+            ret.shape[axis] = count;
+            return ret;
+        }
+        // The same coefficients with another shape of the same size, only for contiguous tensors
+        BasicTensor reshape(std::initializer_list<Index> newShape) const {
+            if (!contiguous())
+                throw std::invalid_argument("only contiguous tensors can be reshaped");
+            if (newShape.size() < 1 || newShape.size() > MAX_RANK)
+                throw std::invalid_argument("unsupported tensor rank");
+            BasicTensor ret(*this, ViewTag{});
+            ret.dims = static_cast<int>(newShape.size());
+            ret.shape = { 1, 1, 1, 1 };
+            std::copy(newShape.begin(), newShape.end(), ret.shape.begin());
+            if (ret.size() != size())
+                throw std::invalid_argument("reshaping has to keep the size of the tensor");
+            for (int i = 0; i < MAX_RANK; i++)
+                ret.strides[i] = i == 0 ? 1 : ret.strides[i - 1] * ret.shape[i - 1];
+            return ret;
+        }
+
+        // The tensor as an Eigen matrix without copying: a rank 1 tensor is a column, a rank 2 one maps directly.
+        // Needs a unit stride along the first dimension
+        MatrixMap matrix() {
+            checkMatrix();
+            return MatrixMap(data(), shape[0], shape[1], Eigen::OuterStride<>(outerStride()));
+        }
+        ConstMatrixMap matrix() const {
+            checkMatrix();
+            return ConstMatrixMap(data(), shape[0], shape[1], Eigen::OuterStride<>(outerStride()));
+        }
+        // The matrix at index i of the last dimension of a rank 3 tensor
+        MatrixMap matrix(const Index i) { return slice(i).matrix(); }
+        ConstMatrixMap matrix(const Index i) const {
+            const BasicTensor s = slice(i);
+            return s.matrix();
+        }
+        // All coefficients as one array, only for contiguous tensors
+        ArrayMap flat() {
+            if (!contiguous())
+                throw std::invalid_argument("only contiguous tensors can be flattened");
+            return ArrayMap(data(), size());
+        }
+        ConstArrayMap flat() const {
+            if (!contiguous())
+                throw std::invalid_argument("only contiguous tensors can be flattened");
+            return ConstArrayMap(data(), size());
+        }
+
+        BasicTensor &setConstant(const T value) {
+            if (contiguous())
+                flat().setConstant(value);
+            else
+                zip(*this, [value](T &a, const T &) { a = value; });
+            return *this;
+        }
+        BasicTensor &setZero() { return setConstant(0); }
+        BasicTensor &setOnes() { return setConstant(1); }
+        BasicTensor &operator +=(const BasicTensor &other) {
+            if (contiguous() && other.contiguous() && shape == other.shape)
+                flat() += other.flat();
+            else
+                zip(other, [](T &a, const T &b) { a += b; });
+            return *this;
+        }
+        BasicTensor &operator -=(const BasicTensor &other) {
+            if (contiguous() && other.contiguous() && shape == other.shape)
+                flat() -= other.flat();
+            else
+                zip(other, [](T &a, const T &b) { a -= b; });
+            return *this;
+        }
+        BasicTensor &operator *=(const T value) {
+            zip(*this, [value](T &a, const T &) { a *= value; });
+            return *this;
+        }
+    private:
+        void checkMatrix() const {
+            if (dims > 2 || (shape[0] > 1 && strides[0] != 1))
+                throw std::invalid_argument("tensor cannot be mapped to a matrix");
+        }
+        Index outerStride() const { return dims == 2 && shape[1] > 1 ? strides[1] : shape[0]; }
+    };
+
+    // Prints the matrices along the trailing dimensions one after the other
+    template <typename T>
+    std::ostream &operator <<(std::ostream &out, const BasicTensor<T> &t) {
+        if (t.rank() <= 2)
+            return out << t.matrix();
+        for (Eigen::Index i = 0; i < t.dim(t.rank() - 1); i++) {
+            out << "[" << i << "]" << std::endl;
+            out << t.slice(i) << std::endl;
+        }
+        return out;
+    }
+}
+
+#endif //AUTOGRADIENT_TENSOR_H
@@ -0,0 +1,113 @@
+//
+// Data-parallel training: one graph, one executor per shard of the minibatch
+//
+
+#include "Trainer.h"
+#include <stdexcept>
+
+using namespace std;
+using namespace autograd;
+
+DataParallelTrainer::DataParallelTrainer(shared_ptr<Optimizer> optimizer, vector<OpPtr> inputs, const size_t shards,
+                                         const uint64_t seed)
+    : optimizer(move(optimizer)), inputs(move(inputs)), seed(seed) {
+    if (shards == 0)
+        throw invalid_argument("at least one shard is needed");
+    for (const auto &op : this->optimizer->topoOrder())
+        if (op->updatable())
+            params.push_back(op);
+    // The parallelism is across shards, the plans of the workers run serially
+    ExecutorOptions options;
+    options.parallel = false;
+    for (size_t k = 0; k < shards; k++) {
+        workers.push_back(make_shared<Worker>(this->optimizer->result(), options));
+        // Marks the inputs as fed right away, so that invalid ones are reported here
+        for (const auto &in : this->inputs)
+            workers.back()->feed(in);
+        for (const auto &param : params)
+            workers.back()->paramSlots.push_back(workers.back()->slotOf(param));
+    }
+    holder.assign(shards, 0);
+    losses.assign(shards, 0);
+    active.assign(shards, false);
+}
+
+Scalar DataParallelTrainer::step(const vector<reference_wrapper<const Matrix>> &batch) {
+    if (batch.size() != inputs.size())
+        throw invalid_argument("one matrix per input is expected");
+    const auto n = static_cast<size_t>(batch.front().get().cols());
+    const auto shards = workers.size();
+    const auto count = static_cast<ptrdiff_t>(shards);
+    // Always a parallel region, even for one shard: inside of it Eigen keeps its products single-threaded,
+    // whose results would otherwise depend on the number of threads
+    #pragma omp parallel for schedule(dynamic)
+    for (ptrdiff_t k = 0; k < count; k++) {
+        const auto begin = n * k / shards, end = n * (k + 1) / shards;
+        active[k] = begin < end;
+        if (!active[k])
+            continue;
+        auto &worker = workers[k];
+        for (size_t i = 0; i < inputs.size(); i++) {
+            const Matrix &samples = batch[i];
+            matrixOf(worker->feed(inputs[i]), samples.rows(), end - begin) = samples.middleCols(begin, end - begin);
+        }
+        worker->seed(mixSeed(mixSeed(seed, steps), k));
+        worker->clearGradient();
+        losses[k] = get<Scalar>(worker->propagate());
+    }
+    steps++;
+    pending = active;
+    for (size_t k = 0; k < shards; k++)
+        holder[k] = k;
+    // Tree all-reduce: at each round shard k absorbs shard k + stride, pairs are independent
+    for (size_t stride = 1; stride < shards; stride *= 2) {
+        const auto pairs = static_cast<ptrdiff_t>((shards + 2 * stride - 1) / (2 * stride));
+        #pragma omp parallel for schedule(dynamic) if(pairs > 1)
+        for (ptrdiff_t q = 0; q < pairs; q++) {
+            const auto k = q * 2 * stride, other = k + stride;
+            if (other >= shards || !pending[other])
+                continue;
+            if (pending[k]) {
+                auto &dst = *workers[holder[k]];
+                const auto &src = *workers[holder[other]];
+                // Parameters the loss does not reach have no gradient
+                for (size_t p = 0; p < params.size(); p++)
+                    if (const auto grad = src.gradientAt(src.paramSlots[p]))
+                        dst.accumulateGradient(params[p], *grad);
+                losses[k] += losses[other];
+            } else {
+                holder[k] = holder[other];
+                losses[k] = losses[other];
+                pending[k] = true;
+            }
+        }
+    }
+    if (!pending[0])
+        return 0;
+    optimizer->clearGradient();
+    const auto &sum = *workers[holder[0]];
+    for (size_t p = 0; p < params.size(); p++)
+        if (const auto grad = sum.gradientAt(sum.paramSlots[p]))
+            optimizer->accumulateGradient(params[p], *grad);
+    optimizer->update();
+    return losses[0];
+}
+
+Matrix DataParallelTrainer::gather(const OpPtr &op) const {
+    Eigen::Index rows = 0, cols = 0;
+    for (size_t k = 0; k < workers.size(); k++)
+        if (active[k]) {
+            const auto &v = get<Matrix>(workers[k]->valueOf(op));
+            rows = v.rows();
+            cols += v.cols();
+        }
+    Matrix ret(rows, cols);
+    cols = 0;
+    for (size_t k = 0; k < workers.size(); k++)
+        if (active[k]) {
+            const auto &v = get<Matrix>(workers[k]->valueOf(op));
+            ret.middleCols(cols, v.cols()) = v;
+            cols += v.cols();
+        }
+    return ret;
+}
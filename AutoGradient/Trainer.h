@@ -0,0 +1,66 @@
+//
+// Data-parallel training: one graph, one executor per shard of the minibatch
+//
+
+#ifndef AUTOGRADIENT_TRAINER_H
+#define AUTOGRADIENT_TRAINER_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include "Optimizers.h"
+#include "Random.h"
+
+namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
+    // Splits every minibatch into a fixed number of shards, each one propagated by a worker executor of its own.
+    // The workers share the ops of the graph, and so the parameters, but feed their shard to the inputs
+    // instead of reading the values set on them. Gradients are then summed with a tree reduction and handed
+    // to the optimizer, which makes the update equal to the one of the whole minibatch when the loss is a
+    // sum over the samples.
+    // The shards, the order of the reduction and the random streams of the workers only depend on the
+    // number of shards and the seed, never on the number of threads, so training is reproducible
+    class DataParallelTrainer {
+        class Worker : public Executor {
+        public:
+            using Executor::Executor;
+            using Executor::gradientAt;
+            // Slots of the parameters, in the order of params
+            std::vector<size_t> paramSlots;
+        };
+        std::shared_ptr<Optimizer> optimizer;
+        std::vector<OpPtr> inputs;
+        std::vector<OpPtr> params;
+        std::vector<std::shared_ptr<Worker>> workers;
+        // The gradients are reduced in place in the workers: holder[k] is the worker holding the sum of the shards
+        // absorbed by position k of the reduction so far
+        std::vector<size_t> holder;
+        std::vector<Scalar> losses;
+        // Shards that got samples in the last step, and those still holding gradients during the reduction
+        std::vector<char> active, pending;
+        std::uint64_t seed;
+        std::uint64_t steps = 0;
+    public:
+        // inputs: the ops fed with the minibatch, they must not have inputs themselves (usually constants)
+        DataParallelTrainer(std::shared_ptr<Optimizer> optimizer, std::vector<OpPtr> inputs, size_t shards,
+                            std::uint64_t seed = seededRNG()());
+        // One training step: batch[i] goes to inputs[i], one sample per column. Returns the total loss
+        Scalar step(const std::vector<std::reference_wrapper<const Matrix>> &batch);
+        // Value of op over the last minibatch, the columns computed by the shards side by side
+        Matrix gather(const OpPtr &op) const;
+        size_t shards() const { return workers.size(); }
+        // The random streams of a step derive from the seed and the number of steps before it: restore both
+        // (e.g. from checkpoint counters) to resume a run exactly
+        std::uint64_t stepCount() const { return steps; }
+        void setStepCount(const std::uint64_t steps) { this->steps = steps; }
+        // Profiles the steps of every worker, nullptr stops
+        void setProfiler(const std::shared_ptr<Profiler> &profiler) {
+            for (const auto &worker : workers)
+                worker->setProfiler(profiler);
+        }
+    };
+}
+}
+
+#endif //AUTOGRADIENT_TRAINER_H
@@ -7,9 +7,26 @@
 #define AUTOGRADIENT_VALUE_H
 
 #include "Eigen/Dense"
+#include "Eigen/SparseCore"
 #include <variant>
+#include <vector>
+#include <numeric>
+#include <algorithm>
 #include <iostream>
+#include <type_traits>
+#include "Tensor.h"
+
+// Everything depending on the precision lives in an inline namespace named after it, so that the float and the
+// double builds of the library are distinct entities and translation units of both can be linked together
+// (e.g. float inference next to double gradient checking). Code just names autograd::Executor and so on
+#ifndef AUTOGRADIENT_USE_FLOAT
+#define AUTOGRADIENT_PRECISION f64
+#else
+#define AUTOGRADIENT_PRECISION f32
+#endif
+
 namespace autograd {
+inline namespace AUTOGRADIENT_PRECISION {
     #ifndef AUTOGRADIENT_USE_FLOAT
     using Scalar = double;
     using Matrix = Eigen::MatrixXd;
@@ -21,23 +38,190 @@ namespace autograd {
 	using Array = Eigen::ArrayXf;
     using Vector = Eigen::VectorXf;
     #endif
-    // 3D Tensor, temporary implementation, the first dimension should be small
-    // For CNN should be enough
-    using Cube = std::vector<Matrix>;
+    // Parameters keep a master copy in this precision when Scalar is narrower (mixed-precision training):
+    // forward and backward run in Scalar, updates accumulate in MasterScalar so small steps are not rounded away
+    using MasterScalar = double;
+    using MasterMatrix = Eigen::MatrixXd;
+    constexpr bool MIXED_PRECISION = !std::is_same_v<Scalar, MasterScalar>;
+    // Up to 4D, contiguous and strided, see Tensor.h
+    using Tensor = BasicTensor<Scalar>;
+    // Compressed rows: sparse inputs such as bags of words or adjacency matrices, stored and multiplied at the
+    // cost of their nonzeros, see SparseConstOp
+    using SparseMatrix = Eigen::SparseMatrix<Scalar, Eigen::RowMajor>;
+    // A matrix of which only a few columns are nonzero, the gradient of a table read a column at a time (see
+    // EmbeddingOp). Column k of values belongs to column indices[k] of the rows() x cols matrix, indices may repeat
+    // (their columns add up) until coalesce(). Only the ops without inputs receive gradients of this kind, so
+    // that accumulating and applying them costs as much as the columns read
+    struct SparseColumns {
+        Eigen::Index cols = 0;
+        std::vector<Eigen::Index> indices;
+        Matrix values;
+        Eigen::Index rows() const { return values.rows(); }
+        // dst += this, for dst of the dense shape
+        void addTo(Matrix &dst) const {
+            for (size_t k = 0; k < indices.size(); k++)
+                dst.col(indices[k]) += values.col(static_cast<Eigen::Index>(k));
+        }
+        Matrix dense() const {
+            Matrix ret = Matrix::Zero(rows(), cols);
+            addTo(ret);
+            return ret;
+        }
+        // Sorts the indices and sums the columns of the repeated ones
+        void coalesce() {
+            if (std::is_sorted(indices.begin(), indices.end(), std::less_equal<>()))
+                return;
+            std::vector<size_t> order(indices.size());
+            std::iota(order.begin(), order.end(), size_t(0));
+            std::stable_sort(order.begin(), order.end(), [this](const size_t a, const size_t b) {
+                return indices[a] < indices[b];
+            });
+            std::vector<Eigen::Index> merged;
+            Matrix sums(rows(), static_cast<Eigen::Index>(indices.size()));
+            for (const auto k : order) {
+                const auto col = values.col(static_cast<Eigen::Index>(k));
+                if (merged.empty() || merged.back() != indices[k]) {
+                    merged.push_back(indices[k]);
+                    sums.col(static_cast<Eigen::Index>(merged.size() - 1)) = col;
+                } else
+                    sums.col(static_cast<Eigen::Index>(merged.size() - 1)) += col;
+            }
+            sums.conservativeResize(Eigen::NoChange, static_cast<Eigen::Index>(merged.size()));
+            indices = std::move(merged);
+            values = std::move(sums);
+        }
+    };
     // The unified value type
-    using Value = std::variant<Scalar, Matrix, Cube>;
+    using Value = std::variant<Scalar, Matrix, Tensor, SparseColumns, SparseMatrix>;
     // This is used to identify the return type of the op
     enum class ValueType {
         Scalar,
         Matrix,
-        Cube,
+        Tensor,
+        Sparse,
     };
+    // Make v hold a rows x cols matrix and return it, the storage is reused if v already holds one,
+    // so writing results through this does not allocate once the shapes settle
+    inline Matrix &matrixOf(Value &v, const Eigen::Index rows, const Eigen::Index cols) {
+        if (!std::holds_alternative<Matrix>(v))
+            return v.emplace<Matrix>(rows, cols);
+        auto &mat = std::get<Matrix>(v);
+        mat.resize(rows, cols);
+        return mat;
+    }
+    inline Matrix &matrixOf(Value &v, const Matrix &like) { return matrixOf(v, like.rows(), like.cols()); }
+    // Same as matrixOf() for tensors
+    inline Tensor &tensorOf(Value &v, const Tensor &like) {
+        if (!std::holds_alternative<Tensor>(v))
+            v.emplace<Tensor>();
+        auto &ret = std::get<Tensor>(v);
+        if (!ret.sameShape(like))
+            ret.resizeLike(like);
+        return ret;
+    }
+    inline Tensor &tensorOf(Value &v, std::initializer_list<Eigen::Index> shape) {
+        if (!std::holds_alternative<Tensor>(v))
+            v.emplace<Tensor>();
+        auto &ret = std::get<Tensor>(v);
+        Tensor::Shape dims{ 1, 1, 1, 1 };
+        std::copy(shape.begin(), shape.end(), dims.begin());
+        if (ret.rank() != static_cast<int>(shape.size()) || ret.dimensions() != dims)
+            ret.resize(dims, static_cast<int>(shape.size()));
+        return ret;
+    }
+    inline Scalar &scalarOf(Value &v) {
+        if (!std::holds_alternative<Scalar>(v))
+            return v.emplace<Scalar>();
+        return std::get<Scalar>(v);
+    }
+    // Same as matrixOf() for sparse matrices, the pattern is left to the caller
+    inline SparseMatrix &sparseOf(Value &v, const Eigen::Index rows, const Eigen::Index cols) {
+        if (!std::holds_alternative<SparseMatrix>(v))
+            return v.emplace<SparseMatrix>(rows, cols);
+        auto &ret = std::get<SparseMatrix>(v);
+        if (ret.rows() != rows || ret.cols() != cols)
+            ret.resize(rows, cols);
+        return ret;
+    }
+    // A sparse matrix with the pattern of like, its values are left to the caller. Nothing is copied if v
+    // already has that pattern, as the gradients of a sparse operand do from one pass to the next
+    inline SparseMatrix &sparseOf(Value &v, const SparseMatrix &like) {
+        if (!std::holds_alternative<SparseMatrix>(v))
+            return v.emplace<SparseMatrix>(like);
+        auto &ret = std::get<SparseMatrix>(v);
+        const auto samePattern = like.isCompressed() && ret.isCompressed() && ret.rows() == like.rows() &&
+            ret.cols() == like.cols() && ret.nonZeros() == like.nonZeros() &&
+            std::equal(like.outerIndexPtr(), like.outerIndexPtr() + like.outerSize() + 1, ret.outerIndexPtr()) &&
+            std::equal(like.innerIndexPtr(), like.innerIndexPtr() + like.nonZeros(), ret.innerIndexPtr());
+        if (!samePattern)
+            ret = like;
+        return ret;
+    }
+    // std::swap() of values, except that sparse matrices trade their storage: they have no move constructor,
+    // std::swap() would copy them
+    inline void swapValues(Value &a, Value &b) {
+        if (std::holds_alternative<SparseMatrix>(a) && std::holds_alternative<SparseMatrix>(b))
+            std::get<SparseMatrix>(a).swap(std::get<SparseMatrix>(b));
+        else
+            std::swap(a, b);
+    }
+    // Number of coefficients, the stored ones of a sparse matrix
+    inline Eigen::Index sizeOf(const Value &v) {
+        if (std::holds_alternative<Matrix>(v))
+            return std::get<Matrix>(v).size();
+        if (std::holds_alternative<Tensor>(v))
+            return std::get<Tensor>(v).size();
+        if (std::holds_alternative<SparseColumns>(v))
+            return std::get<SparseColumns>(v).rows() * std::get<SparseColumns>(v).cols;
+        if (std::holds_alternative<SparseMatrix>(v))
+            return std::get<SparseMatrix>(v).nonZeros();
+        return 1;
+    }
+    inline SparseColumns &sparseColumnsOf(Value &v) {
+        if (!std::holds_alternative<SparseColumns>(v))
+            return v.emplace<SparseColumns>();
+        return std::get<SparseColumns>(v);
+    }
+    // dst += src, for values of the same shape. Sparse columns are appended to sparse ones and added into
+    // dense ones, dst becomes dense if src is
+    inline void accumulate(Value &dst, const Value &src) {
+        if (std::holds_alternative<SparseColumns>(dst)) {
+            auto &lhs = std::get<SparseColumns>(dst);
+            if (!std::holds_alternative<SparseColumns>(src)) {
+                Matrix sum = std::get<Matrix>(src);
+                lhs.addTo(sum);
+                dst = std::move(sum);
+                return;
+            }
+            const auto &rhs = std::get<SparseColumns>(src);
+            const auto n = lhs.values.cols();
+            lhs.indices.insert(lhs.indices.end(), rhs.indices.begin(), rhs.indices.end());
+            lhs.values.conservativeResize(rhs.rows(), n + rhs.values.cols());
+            lhs.values.rightCols(rhs.values.cols()) = rhs.values;
+        } else if (std::holds_alternative<SparseColumns>(src))
+            std::get<SparseColumns>(src).addTo(std::get<Matrix>(dst));
+        else if (std::holds_alternative<Scalar>(src))
+            std::get<Scalar>(dst) += std::get<Scalar>(src);
+        else if (std::holds_alternative<Matrix>(src))
+            std::get<Matrix>(dst) += std::get<Matrix>(src);
+        else if (std::holds_alternative<SparseMatrix>(src))
+            std::get<SparseMatrix>(dst) += std::get<SparseMatrix>(src);
+        else
+            std::get<Tensor>(dst) += std::get<Tensor>(src);
+    }
     inline std::ostream &operator <<(std::ostream &out, const Value &v) {
         if (std::holds_alternative<Scalar>(v))
             return out << std::get<Scalar>(v);
         if (std::holds_alternative<Matrix>(v))
             return out << std::get<Matrix>(v);
+        if (std::holds_alternative<Tensor>(v))
+            return out << std::get<Tensor>(v);
+        if (std::holds_alternative<SparseColumns>(v))
+            return out << std::get<SparseColumns>(v).dense();
+        if (std::holds_alternative<SparseMatrix>(v))
+            return out << Matrix(std::get<SparseMatrix>(v));
         throw std::invalid_argument("unreachable code!");
     }
 }
+}
 #endif //AUTOGRADIENT_VALUE_H
@@ -0,0 +1,264 @@
+//
+// Microbenchmarks of the ops, of the executor and of a training step, see the autograd_bench target
+//
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "AutoGradient.h"
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    class BenchExecutor : public Executor {
+    public:
+        using Executor::Executor;
+    };
+
+    struct OpCase {
+        string name;
+        vector<ValueType> inputs;
+        function<OpPtr(const vector<OpPtr> &)> build;
+    };
+
+    // Inputs are parameters so that nothing gets folded, and fed so that they are not copied on every pass.
+    // Coefficients lie in [0.1, 0.9], valid for every op (log, quotients, cross-entropy ...).
+    // Sparse inputs are constants with 8 nonzeros per row
+    void benchOp(benchmark::State &state, const OpCase &op, const bool withGradient) {
+        const auto n = state.range(0);
+        vector<OpPtr> inputs;
+        vector<Value> values;
+        for (const auto type : op.inputs) {
+            if (type == ValueType::Scalar) {
+                inputs.push_back(parameter(static_cast<Scalar>(0.7)));
+                values.emplace_back(static_cast<Scalar>(0.7));
+            } else if (type == ValueType::Sparse) {
+                SparseMatrix m(n, n);
+                m.reserve(Eigen::VectorXi::Constant(n, 8));
+                for (Eigen::Index i = 0; i < n; i++)
+                    for (Eigen::Index k = 0; k < 8; k++)
+                        m.coeffRef(i, rand() % n) = static_cast<Scalar>(0.7);
+                m.makeCompressed();
+                inputs.push_back(constant(m));
+                values.emplace_back(move(m));
+            } else {
+                const Matrix m = (Matrix::Random(n, n).array() * static_cast<Scalar>(0.4) + static_cast<Scalar>(0.5)).matrix();
+                inputs.push_back(parameter(m));
+                values.emplace_back(m);
+            }
+        }
+        ExecutorOptions options;
+        options.simplify = false;
+        options.fuse = false;
+        options.parallel = false;
+        const auto executor = make_shared<BenchExecutor>(op.build(inputs), options);
+        for (size_t i = 0; i < inputs.size(); i++)
+            executor->feed(inputs[i], values[i]);
+        for (auto _ : state) {
+            executor->clearGradient();
+            benchmark::DoNotOptimize(executor->propagate(withGradient));
+        }
+        state.SetItemsProcessed(state.iterations() * n * n);
+    }
+
+    const ValueType S = ValueType::Scalar, M = ValueType::Matrix, SP = ValueType::Sparse;
+
+    vector<OpCase> opCases() {
+        return {
+            // BasicOps.h
+            { "ScalarSum", { S, S }, [](const auto &in) { return in[0] + in[1]; } },
+            { "ScalarDiff", { S, S }, [](const auto &in) { return in[0] - in[1]; } },
+            { "ScalarProduct", { S, S }, [](const auto &in) { return in[0] * in[1]; } },
+            { "ScalarQuotient", { S, S }, [](const auto &in) { return in[0] / in[1]; } },
+            { "ScalarPow", { S, S }, [](const auto &in) { return autograd::pow(in[0], in[1]); } },
+            { "ScalarNeg", { S }, [](const auto &in) { return -in[0]; } },
+            { "MatrixSum", { M, M }, [](const auto &in) { return in[0] + in[1]; } },
+            { "MatrixDiff", { M, M }, [](const auto &in) { return in[0] - in[1]; } },
+            { "MatrixProduct", { M, M }, [](const auto &in) { return in[0] * in[1]; } },
+            { "SparseDenseProduct", { SP, M }, [](const auto &in) { return in[0] * in[1]; } },
+            { "DenseSparseProduct", { M, SP }, [](const auto &in) { return in[0] * in[1]; } },
+            { "MatrixScalarProduct", { S, M }, [](const auto &in) { return in[0] * in[1]; } },
+            { "MatrixScalarQuotient", { M, S }, [](const auto &in) { return in[0] / in[1]; } },
+            { "MatrixScalarSum", { M, S }, [](const auto &in) { return in[0] + in[1]; } },
+            { "MatrixScalarDiff", { M, S }, [](const auto &in) { return in[0] - in[1]; } },
+            { "ScalarMatrixDiff", { S, M }, [](const auto &in) { return in[0] - in[1]; } },
+            { "MatrixCWiseProduct", { M, M }, [](const auto &in) { return cwiseProduct(in[0], in[1]); } },
+            { "MatrixCWiseQuotient", { M, M }, [](const auto &in) { return cwiseQuotient(in[0], in[1]); } },
+            { "MatrixNeg", { M }, [](const auto &in) { return -in[0]; } },
+            { "MatrixCoefSum", { M }, [](const auto &in) { return sum(in[0]); } },
+            { "MatrixMax", { M }, [](const auto &in) { return autograd::max(in[0]); } },
+            // AdvancedOps.h
+            { "Dot", { M, M }, [](const auto &in) { return dot(in[0], in[1]); } },
+            { "Softmax", { M }, [](const auto &in) { return softmax(in[0]); } },
+            { "CrossEntropy", { M, M }, [](const auto &in) { return crossEntropy(in[0], in[1]); } },
+            { "SoftmaxCrossEntropy", { M, M }, [](const auto &in) { return softmaxCrossEntropy(in[0], in[1]); } },
+            { "Dropout", { M }, [](const auto &in) { return dropout(in[0], 0.2); } },
+            // Functions.h, on scalars and broadcast over matrices
+            { "ScalarSigmoid", { S }, [](const auto &in) { return sigmoid(in[0]); } },
+            { "Sin", { M }, [](const auto &in) { return autograd::sin(in[0]); } },
+            { "Cos", { M }, [](const auto &in) { return autograd::cos(in[0]); } },
+            { "Log", { M }, [](const auto &in) { return autograd::log(in[0]); } },
+            { "Exp", { M }, [](const auto &in) { return autograd::exp(in[0]); } },
+            { "Tanh", { M }, [](const auto &in) { return autograd::tanh(in[0]); } },
+            { "Sigmoid", { M }, [](const auto &in) { return sigmoid(in[0]); } },
+            { "LReLU", { M }, [](const auto &in) { return lrelu(in[0]); } },
+            { "Mish", { M }, [](const auto &in) { return mish(in[0]); } },
+        };
+    }
+
+    // A chain of scalar sums, nearly all of the time goes to the executor rather than to the ops
+    void benchOverhead(benchmark::State &state, const bool withGradient) {
+        const auto nodes = state.range(0);
+        const auto p = parameter(static_cast<Scalar>(1));
+        auto v = p;
+        for (auto k = 1; k < nodes; k++)
+            v = v + p;
+        const auto executor = make_shared<BenchExecutor>(v);
+        for (auto _ : state) {
+            executor->clearGradient();
+            benchmark::DoNotOptimize(executor->propagate(withGradient));
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(executor->topoOrder().size()));
+    }
+
+    // The MLP of the demo on random MNIST-shaped batches
+    constexpr size_t INPUT = 28 * 28, HIDDEN = 128, OUTPUT = 10, BATCH = 32;
+
+    struct MLP {
+        OpPtr x = constant(Matrix::Random(INPUT, BATCH).cwiseAbs().eval());
+        OpPtr y = constant(Matrix::Identity(OUTPUT, BATCH).eval());
+        OpPtr yHat, loss;
+        MLP() {
+            auto h = mish(parameter(randNormal(HIDDEN, INPUT, sqrt(2.0 / INPUT))) * x + parameter(randNormal(HIDDEN, 0.1)));
+            yHat = softmax(parameter(randNormal(OUTPUT, HIDDEN, sqrt(1.0 / HIDDEN))) * h + parameter(randNormal(OUTPUT, 0.1)));
+            loss = -dot(y, autograd::log(yHat)) - dot(1 - y, autograd::log(1 - yHat));
+        }
+    };
+
+    void benchTrainingStep(benchmark::State &state) {
+        MLP mlp;
+        const auto optimizer = make_shared<AdamOptimizer>(mlp.loss);
+        for (auto _ : state) {
+            optimizer->clearGradient();
+            benchmark::DoNotOptimize(optimizer->propagate());
+            optimizer->update();
+        }
+        state.SetItemsProcessed(state.iterations() * BATCH);
+    }
+
+    // Only the update, over many small parameters: sum of the coefficients of state.range(0) 16 x 16 matrices
+    template <typename O>
+    void benchUpdate(benchmark::State &state) {
+        OpPtr loss;
+        for (auto k = 0; k < state.range(0); k++) {
+            const auto term = sum(parameter(Matrix::Random(16, 16).eval()));
+            loss = loss ? loss + term : term;
+        }
+        const auto optimizer = make_shared<O>(loss);
+        optimizer->propagate();
+        for (auto _ : state)
+            optimizer->update();
+        state.SetItemsProcessed(state.iterations() * state.range(0) * 16 * 16);
+    }
+
+    // Only the update of an embedding table of state.range(0) columns read at 256 random ones: the sparse
+    // gradient keeps it independent of the size of the table
+    void benchSparseUpdate(benchmark::State &state) {
+        constexpr Eigen::Index DIM = 32, LOOKUPS = 256;
+        const auto columns = state.range(0);
+        Matrix ids(1, LOOKUPS);
+        for (auto j = 0; j < LOOKUPS; j++)
+            ids(0, j) = static_cast<Scalar>(rand() % columns);
+        const auto loss = sum(embedding(parameter(Matrix::Random(DIM, columns).eval()), constant(ids)));
+        const auto optimizer = make_shared<AdamOptimizer>(loss);
+        optimizer->propagate();
+        for (auto _ : state)
+            optimizer->update();
+        state.SetItemsProcessed(state.iterations() * LOOKUPS * DIM);
+    }
+
+    // A minibatch of 64-step sequences of varying lengths through an LSTM, truncated into windows of
+    // state.range(0) steps: after the first iteration every window runs a cached plan
+    void benchSequenceStep(benchmark::State &state) {
+        constexpr size_t FEATURES = 32, UNITS = 64, CLASSES = 10, STEPS = 64;
+        constexpr Eigen::Index SEQUENCES = 32;
+        LSTMCell cell(FEATURES, UNITS);
+        const auto wOut = parameter(randNormal(CLASSES, UNITS, sqrt(1.0 / UNITS)));
+        const auto unroll = [&](const size_t steps) {
+            UnrolledGraph graph;
+            graph.stateRows = cell.stateRows();
+            for (size_t s = 0; s < graph.stateRows.size(); s++)
+                graph.initial.push_back(constant(Matrix()));
+            vector<OpPtr> xs;
+            for (size_t t = 0; t < steps; t++) {
+                graph.inputs.push_back({ constant(Matrix()), constant(Matrix()) });
+                graph.masks.push_back(constant(Matrix()));
+                xs.push_back(graph.inputs[t][0]);
+            }
+            const auto states = scan(cell, xs, graph.initial, graph.masks);
+            graph.loss = softmaxCrossEntropy(wOut * states[0][0], graph.inputs[0][1]);
+            for (size_t t = 1; t < steps; t++)
+                graph.loss = graph.loss + softmaxCrossEntropy(wOut * states[t][0], graph.inputs[t][1]);
+            graph.final = states.back();
+            return graph;
+        };
+        const auto optimizer = make_shared<AdamOptimizer>(unroll(1).loss);
+        SequenceTrainer trainer(optimizer, unroll, static_cast<size_t>(state.range(0)), 8);
+        vector<vector<Matrix>> steps(STEPS, { Matrix::Random(FEATURES, SEQUENCES), Matrix::Identity(CLASSES, SEQUENCES) });
+        vector<size_t> lengths(SEQUENCES);
+        for (auto &length : lengths)
+            length = STEPS - rand() % (STEPS / 2);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(trainer.step(steps, lengths));
+        state.SetItemsProcessed(state.iterations() * STEPS * SEQUENCES);
+    }
+
+    void benchTrainerStep(benchmark::State &state) {
+        MLP mlp;
+        const auto optimizer = make_shared<AdamOptimizer>(mlp.loss);
+        DataParallelTrainer trainer(optimizer, { mlp.x, mlp.y }, static_cast<size_t>(state.range(0)));
+        const Matrix x = Matrix::Random(INPUT, 8 * BATCH).cwiseAbs(), y = Matrix::Identity(OUTPUT, 8 * BATCH);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(trainer.step({ x, y }));
+        state.SetItemsProcessed(state.iterations() * 8 * BATCH);
+    }
+}
+
+// Results go to the console and, unless --benchmark_out is given, to autograd_bench.json
+int main(int argc, char **argv) {
+    for (const auto &op : opCases()) {
+        const auto scalarOnly = all_of(op.inputs.begin(), op.inputs.end(), [](const ValueType t) { return t == S; });
+        for (const auto withGradient : { false, true }) {
+            auto bench = benchmark::RegisterBenchmark((op.name + (withGradient ? "/ForwardBackward" : "/Forward")).c_str(),
+                                                      [op, withGradient](benchmark::State &state) {
+                                                          benchOp(state, op, withGradient);
+                                                      });
+            if (scalarOnly)
+                bench->Arg(1);
+            else
+                bench->Arg(16)->Arg(64)->Arg(256);
+        }
+    }
+    benchmark::RegisterBenchmark("ExecutorOverhead/Forward", benchOverhead, false)->Arg(100)->Arg(1000);
+    benchmark::RegisterBenchmark("ExecutorOverhead/ForwardBackward", benchOverhead, true)->Arg(100)->Arg(1000);
+    benchmark::RegisterBenchmark("Optimizer/AdamUpdate", benchUpdate<AdamOptimizer>)->Arg(10)->Arg(1000);
+    benchmark::RegisterBenchmark("Optimizer/SparseAdamUpdate", benchSparseUpdate)->Arg(1 << 12)->Arg(1 << 18);
+    benchmark::RegisterBenchmark("MLP/TrainingStep", benchTrainingStep);
+    benchmark::RegisterBenchmark("MLP/TrainerStep", benchTrainerStep)->Arg(1)->Arg(4);
+    benchmark::RegisterBenchmark("LSTM/SequenceStep", benchSequenceStep)->Arg(16)->Arg(64);
+    vector<char *> args(argv, argv + argc);
+    string out = "--benchmark_out=autograd_bench.json", format = "--benchmark_out_format=json";
+    if (none_of(args.begin(), args.end(), [](const char *arg) { return string(arg).rfind("--benchmark_out=", 0) == 0; })) {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+    auto count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
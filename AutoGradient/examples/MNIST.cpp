@@ -0,0 +1,131 @@
+﻿// MNIST.cpp: an MLP trained on MNIST, built on the autograd library
+//
+
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include "AutoGradient.h"
+
+using namespace std;
+using namespace autograd;
+using namespace std::chrono;
+
+// m is used to control the variance of random dist.
+OpPtr dense(const OpPtr &prev, size_t prevSize, size_t thisSize, double m = 1) {
+	auto v = sqrt(m / prevSize);
+	auto w = parameter(randNormal(thisSize, prevSize, v));
+	auto b = parameter(randNormal(thisSize, v));
+	return w * prev + b;
+}
+
+// Convolution with Kaiming init., filters of size x size over inChannels channels
+OpPtr conv(const OpPtr &prev, size_t inChannels, size_t outChannels, size_t size) {
+	const auto fanIn = size * size * inChannels;
+	auto w = parameter(randNormal(outChannels, fanIn, sqrt(2.0 / fanIn)));
+	auto b = parameter(randNormal(outChannels, sqrt(2.0 / fanIn)));
+	return conv2d(prev, w, b, size, size);
+}
+
+// LeNet-style feature extractor: two 5x5 convolutions each followed by a 2x2 max pooling,
+// returns the features flattened to one column per sample (16 x 4 x 4 = 256 of them)
+OpPtr lenet(const OpPtr &x) {
+	// Max pooling commutes with the (monotonic) activation, which is cheaper on the pooled planes
+	auto c1 = maxPool2d(conv(toImage(x, 28, 28), 1, 6, 5), 2);
+	auto c2 = maxPool2d(conv(toImage(lrelu(flatten(c1)), 12, 12, 6), 6, 16, 5), 2);
+	return lrelu(flatten(c2));
+}
+
+// Number of samples (columns) of a whose largest coefficient sits in the row given by labels
+size_t correct(const Matrix &a, const Matrix &labels) {
+	size_t ret = 0;
+	for (auto j = 0; j < a.cols(); j++) {
+		Matrix::Index i;
+		a.col(j).maxCoeff(&i);
+		ret += i == static_cast<Matrix::Index>(labels(0, j));
+	}
+	return ret;
+}
+
+int main() {
+	const auto HIDDEN_SIZE = 128;
+	const auto BATCH_SIZE = 32;
+	// Training is split into this many shards whatever the number of threads, so runs are reproducible
+	const auto SHARDS = 4;
+	// Convolutional features instead of feeding the raw pixels to the dense layers
+	const auto USE_LENET = false;
+	// Training steps recorded by the profiler at the beginning
+	const auto PROFILED_STEPS = 100;
+	// Saved after every epoch, a run restarted with it continues where it stopped
+	const auto CHECKPOINT = "mnist.ckpt";
+
+	auto x = constant(Vector::Zero(28 * 28));
+	// Class indices, one per column
+	auto y = constant(Matrix::Zero(1, 1).eval());
+	auto features = USE_LENET ? lenet(x) : x;
+	const size_t featureSize = USE_LENET ? 16 * 4 * 4 : 28 * 28;
+	auto h = dropout(mish(dense(features, featureSize, HIDDEN_SIZE, 2)), 0.2); // m = 2: Kaiming init.
+	auto logits = dense(h, HIDDEN_SIZE, 10);
+	auto yHat = softmax(logits);
+	// Softmax and cross-entropy in one op, straight from the logits
+	auto loss = softmaxCrossEntropy(logits, y);
+
+	auto optimizer = make_shared<AdamOptimizer>(loss);
+	DataParallelTrainer trainer(optimizer, { x, y }, SHARDS);
+	cout << optimizer->graph() << endl;
+	cout << "Simplification removed " << optimizer->simplifiedOps() << " ops" << endl;
+	// The files are mapped, samples are converted batch by batch
+	const auto imagesTest = Dataset::idx("D:/MNIST/t10k-images.idx3-ubyte", 1.0 / 255);
+	const auto labelsTest = Dataset::idx("D:/MNIST/t10k-labels.idx1-ubyte");
+	DataLoader loaderTrain({ Dataset::idx("D:/MNIST/train-images.idx3-ubyte", 1.0 / 255),
+		Dataset::idx("D:/MNIST/train-labels.idx1-ubyte") }, BATCH_SIZE);
+	const auto sizeTrain = loaderTrain.size(), sizeTest = labelsTest.size();
+
+	auto profiler = make_shared<Profiler>();
+	auto firstEpoch = 1;
+	if (filesystem::exists(CHECKPOINT)) {
+		auto counters = loadCheckpoint(CHECKPOINT, *optimizer);
+		firstEpoch = static_cast<int>(counters["epoch"]) + 1;
+		trainer.setStepCount(counters["steps"]);
+		cout << "Resuming from epoch " << firstEpoch << endl;
+	} else
+		trainer.setProfiler(profiler);
+
+	// Each propagate() runs a whole minibatch, one sample per column. The loader gathers the next one meanwhile
+	for (auto epoch = firstEpoch; epoch <= 100; epoch++) {
+		double sumLoss = 0, accTrain = 0, accTest = 0;
+		const auto start = high_resolution_clock::now();
+		size_t steps = 0;
+		while (const auto batch = loaderTrain.next()) {
+			const auto &xBatch = (*batch)[0], &yBatch = (*batch)[1];
+			sumLoss += trainer.step({ xBatch, yBatch });
+			accTrain += correct(trainer.gather(logits), yBatch);
+			printf("Epoch %3d: training %5.2lf%%\r", epoch, 100.0 * ++steps / loaderTrain.batches());
+			if (epoch == 1 && steps == PROFILED_STEPS) {
+				trainer.setProfiler(nullptr);
+				cout << endl << profiler->table();
+				ofstream("trace.json") << profiler->chromeTrace();
+			}
+		}
+		const double time = duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+		// Dropout is off in the session, and the test batches are evaluated concurrently
+		InferenceSession session(yHat, { x });
+		const auto batchesTest = static_cast<ptrdiff_t>((sizeTest + BATCH_SIZE - 1) / BATCH_SIZE);
+		#pragma omp parallel for schedule(dynamic) reduction(+:accTest)
+		for (ptrdiff_t k = 0; k < batchesTest; k++) {
+			const auto i = static_cast<size_t>(k) * BATCH_SIZE, end = min(sizeTest, i + BATCH_SIZE);
+			Matrix xTest, yTest;
+			Value yHatTest;
+			imagesTest.slice(i, end, xTest);
+			labelsTest.slice(i, end, yTest);
+			session.run({ xTest }, yHatTest);
+			accTest += correct(get<Matrix>(yHatTest), yTest);
+		}
+		printf("Epoch %3d: avg loss %6.3lf train accuracy %5.2lf%% test accuracy %5.2lf%% tps %lfus\n",
+			epoch, sumLoss / sizeTrain, 100 * accTrain / sizeTrain, 100 * accTest / sizeTest, time / sizeTrain);
+		saveCheckpoint(CHECKPOINT, *optimizer, {}, { { "epoch", epoch }, { "steps", trainer.stepCount() } });
+	}
+	return 0;
+}
@@ -0,0 +1,122 @@
+//
+// A steady-state training step allocates nothing: operator new (and malloc on glibc, which Eigen allocates
+// with) are replaced by counting versions, and propagate() + update() must leave the count unchanged once
+// the buffers are warm. See the autograd_allocation_test target
+//
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "AutoGradient.h"
+
+using namespace std;
+using namespace autograd;
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void __libc_free(void *p);
+#endif
+
+namespace {
+    atomic<size_t> allocations{ 0 };
+
+#ifdef __GLIBC__
+    void *rawAllocate(const size_t size) { return __libc_malloc(size); }
+    void rawFree(void *p) { __libc_free(p); }
+#else
+    void *rawAllocate(const size_t size) { return std::malloc(size); }
+    void rawFree(void *p) { std::free(p); }
+#endif
+
+    void *countedAllocate(const size_t size) {
+        allocations.fetch_add(1, memory_order_relaxed);
+        return rawAllocate(size ? size : 1);
+    }
+}
+
+#ifdef __GLIBC__
+// Interposes the malloc of glibc, free stays the one of glibc which owns the memory either way
+extern "C" void *malloc(const size_t size) { return countedAllocate(size); }
+#endif
+
+void *operator new(const size_t size) {
+    if (auto *p = countedAllocate(size))
+        return p;
+    throw bad_alloc();
+}
+void *operator new[](const size_t size) { return operator new(size); }
+void *operator new(const size_t size, const nothrow_t &) noexcept { return countedAllocate(size); }
+void *operator new[](const size_t size, const nothrow_t &) noexcept { return countedAllocate(size); }
+void operator delete(void *p) noexcept { rawFree(p); }
+void operator delete[](void *p) noexcept { rawFree(p); }
+void operator delete(void *p, size_t) noexcept { rawFree(p); }
+void operator delete[](void *p, size_t) noexcept { rawFree(p); }
+
+namespace {
+    enum class Mode { Serial, Parallel, Trainer, Sparse };
+
+    // A rows x cols sparse matrix with a few coefficients per row
+    SparseMatrix randSparse(const Eigen::Index rows, const Eigen::Index cols) {
+        SparseMatrix ret(rows, cols);
+        for (Eigen::Index i = 0; i < rows; i++)
+            for (Eigen::Index j = i % 3; j < cols; j += 5)
+                ret.insert(i, j) = 0.1 * static_cast<Scalar>(1 + (i + j) % 7);
+        ret.makeCompressed();
+        return ret;
+    }
+
+    // Allocations made by that many training steps of an MLP with dropout and a softmax cross-entropy loss on
+    // a minibatch, after warmUp steps. Trainer steps go through a DataParallelTrainer with 4 shards, sparse ones
+    // mix the hidden layer with sparse products on both sides
+    size_t steadyStateAllocations(const Mode mode, const size_t warmUp, const size_t steps) {
+        const size_t inputs = 64, hidden = 32, classes = 10;
+        const Eigen::Index batch = 16;
+        auto x = constant(Matrix::Zero(inputs, 1).eval());
+        auto y = constant(Matrix::Zero(1, 1).eval());
+        auto h = dropout(mish(parameter(randNormal(hidden, inputs, 0.1)) * x + parameter(randNormal(hidden, 0.1))), 0.2);
+        if (mode == Mode::Sparse)
+            h = randSparse(static_cast<Eigen::Index>(hidden), static_cast<Eigen::Index>(hidden)) * h *
+                randSparse(batch, batch);
+        auto logits = parameter(randNormal(classes, hidden, 0.1)) * h + parameter(randNormal(classes, 0.1));
+        auto loss = softmaxCrossEntropy(logits, y);
+        ExecutorOptions options;
+        options.parallel = mode == Mode::Parallel;
+        const auto optimizer = make_shared<AdamOptimizer>(loss, 0.001, 0.9, 0.999, options);
+        const Matrix samples = Matrix::Random(static_cast<Eigen::Index>(inputs), batch);
+        Matrix labels(1, batch);
+        for (Eigen::Index j = 0; j < batch; j++)
+            labels(0, j) = static_cast<Scalar>(static_cast<size_t>(j) % classes);
+        optimizer->feed(x, samples);
+        optimizer->feed(y, labels);
+        DataParallelTrainer trainer(optimizer, { x, y }, 4);
+        const vector<reference_wrapper<const Matrix>> batchInputs{ cref(samples), cref(labels) };
+        const auto step = [&] {
+            if (mode == Mode::Trainer) {
+                trainer.step(batchInputs);
+                return;
+            }
+            optimizer->clearGradient();
+            optimizer->propagate();
+            optimizer->update();
+        };
+        for (size_t i = 0; i < warmUp; i++)
+            step();
+        const auto before = allocations.load();
+        for (size_t i = 0; i < steps; i++)
+            step();
+        return allocations.load() - before;
+    }
+}
+
+int main() {
+    int failures = 0;
+    const pair<Mode, const char *> modes[] = { { Mode::Serial, "serial" }, { Mode::Parallel, "parallel" },
+                                               { Mode::Trainer, "trainer" }, { Mode::Sparse, "sparse" } };
+    for (const auto &[mode, name] : modes) {
+        const auto count = steadyStateAllocations(mode, 3, 20);
+        printf("%s: %zu allocations over 20 steps\n", name, count);
+        failures += count != 0;
+    }
+    return failures;
+}
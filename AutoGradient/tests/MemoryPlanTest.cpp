@@ -0,0 +1,123 @@
+//
+// Values kept and buffers reused across passes, with and without ExecutorOptions::planMemory. See the
+// autograd_memory_plan_test target
+//
+
+#include <cstdio>
+#include "AutoGradient.h"
+
+using namespace std;
+using namespace autograd;
+
+namespace {
+    class TestExecutor : public Executor {
+    public:
+        using Executor::Executor;
+    };
+
+    int failures = 0;
+
+    void check(const bool ok, const char *what) {
+        printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+        failures += !ok;
+    }
+
+    // Without planMemory, evaluation-only passes keep every value and reuse its buffer
+    void evaluationKeepsValues() {
+        auto w = parameter(Matrix::Constant(8, 8, 0.5).eval());
+        auto x = constant(Matrix::Ones(8, 4).eval());
+        auto wx = w * x;
+        auto y = sum(wx);
+        const auto executor = make_shared<TestExecutor>(y);
+        const Scalar *data = nullptr;
+        bool kept = true, reused = true;
+        for (int i = 0; i < 10; i++) {
+            executor->propagate(false);
+            const auto &v = executor->valueOf(wx);
+            kept = kept && holds_alternative<Matrix>(v) && get<Matrix>(v).rows() == 8 && get<Matrix>(v).cols() == 4 &&
+                   get<Matrix>(v).isApprox(Matrix::Constant(8, 4, 4));
+            if (kept && data)
+                reused = reused && get<Matrix>(v).data() == data;
+            if (kept)
+                data = get<Matrix>(v).data();
+        }
+        check(kept, "propagate(false) keeps intermediate values without planMemory");
+        check(reused, "propagate(false) reuses the buffers of intermediate values without planMemory");
+    }
+
+    // Tensors handed to the pool and taken back on the next pass, with the same values as without planning
+    void plannedConvolutions() {
+        const Eigen::Index side = 8, channels = 3, batch = 2;
+        auto x = constant(Matrix::Random(side * side, batch).eval());
+        auto w = parameter(Matrix::Random(channels, 3 * 3).eval());
+        auto b = parameter(Matrix::Random(channels, 1).eval());
+        auto features = flatten(maxPool2d(conv2d(toImage(x, side, side), w, b, 3, 3), 2));
+        auto y = sum(cwiseProduct(features, features));
+        const auto reference = make_shared<TestExecutor>(y);
+        const auto expected = get<Scalar>(reference->propagate());
+        const Matrix expectedGrad = get<Matrix>(reference->gradientOf(w));
+        for (const auto checkpoint : { false, true }) {
+            ExecutorOptions options;
+            options.planMemory = true;
+            options.checkpoint = checkpoint;
+            const auto executor = make_shared<TestExecutor>(y, options);
+            bool same = true;
+            for (int i = 0; i < 3; i++) {
+                executor->clearGradient();
+                same = same && abs(get<Scalar>(executor->propagate()) - expected) < 1e-9 * abs(expected) &&
+                       get<Matrix>(executor->gradientOf(w)).isApprox(expectedGrad);
+                same = same && abs(get<Scalar>(executor->propagate(false)) - expected) < 1e-9 * abs(expected);
+            }
+            check(same, checkpoint ? "checkpointed convolutions give the same values pass after pass"
+                                   : "planned convolutions give the same values pass after pass");
+        }
+        InferenceSession session(features, { x });
+        const Matrix samples = get<Matrix>(reference->valueOf(x));
+        const Matrix expectedFeatures = get<Matrix>(reference->valueOf(features));
+        bool same = true;
+        for (int i = 0; i < 3; i++)
+            same = same && get<Matrix>(session.run({ cref(samples) })).isApprox(expectedFeatures);
+        check(same, "an InferenceSession of convolutions gives the same values run after run");
+    }
+
+    // Dense layers keep their pre-activations in scratch buffers, released and recomputed with the values
+    void checkpointedDenseLayers() {
+        const size_t width = 32, depth = 12;
+        auto x = constant(Matrix::Random(static_cast<Eigen::Index>(width), 16).eval());
+        auto h = x;
+        vector<OpPtr> weights;
+        for (size_t i = 0; i < depth; i++) {
+            weights.push_back(parameter(randNormal(width, width, 0.2)));
+            h = mish(weights.back() * h + parameter(randNormal(width, 0.1)));
+        }
+        auto y = sum(cwiseProduct(h, h));
+        const auto reference = make_shared<TestExecutor>(y);
+        const auto expected = get<Scalar>(reference->propagate());
+        const Matrix expectedGrad = get<Matrix>(reference->gradientOf(weights[0]));
+        size_t peaks[2] = {};
+        bool same = true;
+        for (const auto checkpoint : { false, true }) {
+            ExecutorOptions options;
+            options.planMemory = true;
+            options.checkpoint = checkpoint;
+            const auto executor = make_shared<TestExecutor>(y, options);
+            for (int i = 0; i < 3; i++) {
+                executor->clearGradient();
+                same = same && abs(get<Scalar>(executor->propagate()) - expected) < 1e-9 * abs(expected) &&
+                       get<Matrix>(executor->gradientOf(weights[0])).isApprox(expectedGrad);
+            }
+            peaks[checkpoint] = executor->memoryReport().peakBytes;
+        }
+        check(same, "checkpointed dense layers give the same values and gradients pass after pass");
+        check(peaks[1] < peaks[0], "checkpointed dense layers peak lower than planned ones");
+        check(peaks[0] <= reference->memoryReport().unplannedBytes,
+              "planned dense layers peak no higher than unplanned ones");
+    }
+}
+
+int main() {
+    evaluationKeepsValues();
+    plannedConvolutions();
+    checkpointedDenseLayers();
+    return failures;
+}